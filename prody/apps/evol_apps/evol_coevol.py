@@ -109,8 +109,8 @@ def evol_coevol(msa, **kwargs):
     from numpy import arange
 
     import prody
-    from prody import parseMSA, buildMutinfoMatrix, showMutinfoMatrix
-    from prody import applyMutinfoCorr, calcShannonEntropy
+    from prody import parseMSA, buildCoevolutionMatrices, showMutinfoMatrix
+    from prody import applyMutinfoCorr
     from prody import writeArray, LOGGER, applyMutinfoNorm, writeHeatmap
     from os.path import splitext
 
@@ -122,7 +122,6 @@ def evol_coevol(msa, **kwargs):
         prefix += '_mutinfo'
 
     msa = parseMSA(msa)
-    mutinfo = buildMutinfoMatrix(msa, **kwargs)
     numformat = kwargs.get('numformat', '%12g')
     heatmap = kwargs.get('heatmap', False)
     #writeArray(prefix + '.txt', mutinfo, format=numformat)
@@ -139,12 +138,21 @@ def evol_coevol(msa, **kwargs):
         if 'joint' in norm:
             todo.append(('norm', 'joint'))
         for which in norm:
-            if which == 'join': continue
+            if which == 'joint': continue
             todo.append(('norm', which))
     if corr is not None:
         for which in corr:
             todo.append(('corr', which))
-    entropy = None
+
+    # MI, normalized MI and entropy are calculated in a single pass
+    scores = ['mutinfo']
+    if ('norm', 'joint') in todo:
+        scores.append('normmi')
+    if [what for what, which in todo if what == 'norm' and which != 'joint']:
+        scores.append('entropy')
+    scores = buildCoevolutionMatrices(msa, scores=scores,
+                                      ambiguity=kwargs.get('ambiguity', True))
+    mutinfo = scores['mutinfo']
 
     for what, which in todo:
         if what is None:
@@ -153,14 +161,12 @@ def evol_coevol(msa, **kwargs):
             tuffix = ' Mutual Information'
         elif which == 'joint':
             LOGGER.info('Applying {0} normalization.'.format(repr(which)))
-            matrix = buildMutinfoMatrix(msa, norm=True, **kwargs)
+            matrix = scores['normmi']
             suffix = '_norm_joint'
             tuffix = ' MI - Normalization: ' + which
         elif what == 'norm':
             LOGGER.info('Applying {0} normalization.'.format(repr(which)))
-            if entropy is None:
-                entropy = calcShannonEntropy(msa, **kwargs)
-            matrix = applyMutinfoNorm(mutinfo, entropy, norm=which)
+            matrix = applyMutinfoNorm(mutinfo, scores['entropy'], norm=which)
             suffix = '_norm_' + which
             tuffix = ' MI - Normalization: ' + which
         else:
@@ -26,6 +26,7 @@ Analysis
 
   * :func:`.calcMSAOccupancy` - calculate row (sequence) or column occupancy
   * :func:`.calcShannonEntropy` - calculate Shannon entropy
+  * :func:`.calcConservationScores` - calculate conservation scores
   * :func:`.buildMutinfoMatrix` - build mutual information matrix
   * :func:`.buildOMESMatrix` - build mutual observed minus expected squared
     covariance matrix
@@ -33,11 +34,16 @@ Analysis
   * :func:`.buildSeqidMatrix`- build sequence identity matrix
   * :func:`.buildDirectInfoMatrix` - build direct information matrix
   * :func:`.uniqueSequences` - select unique sequences
+  * :class:`.SequenceIndex` - find sequences similar to query sequences
   * :func:`.applyMutinfoCorr` - apply correction to mutual information matrix
   * :func:`.applyMutinfoNorm` - apply normalization to mutual information
     matrix
   * :func:`.calcMeff` - calculate sequence weights
   * :func:`.calcRankorder` - rank order scores
+  * :class:`.CoevolutionAccumulator` - update MI and OMES matrices as
+    sequences are added or removed
+  * :func:`.saveAccumulator` - save coevolution counts
+  * :func:`.loadAccumulator` - load coevolution counts
 
 
 Plotting
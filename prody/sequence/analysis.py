@@ -3,14 +3,21 @@
 
 __author__ = 'Anindita Dutta, Ahmet Bakan, Wenzhi Mao'
 
-from numpy import dtype, zeros, empty, ones
-from numpy import indices, tril_indices
+from numpy import dtype, zeros, empty, ones, ascontiguousarray, float32
+from numpy import array, dot, sqrt, absolute
+from numpy import indices, tril_indices, triu_indices, bincount, uint32
+from numpy import savez, load, lexsort
 from prody import LOGGER
+from prody.utilities import openFile
 
-__all__ = ['calcShannonEntropy', 'buildMutinfoMatrix', 'calcMSAOccupancy',
-           'applyMutinfoCorr', 'applyMutinfoNorm', 'calcRankorder',
-           'buildSeqidMatrix', 'uniqueSequences', 'buildOMESMatrix',
-           'buildSCAMatrix', 'buildDirectInfoMatrix', 'calcMeff']
+__all__ = ['calcShannonEntropy', 'calcConservationScores',
+           'buildMutinfoMatrix', 'calcMSAOccupancy', 'applyMutinfoCorr',
+           'applyMutinfoNorm', 'calcRankorder',
+           'buildSeqidMatrix', 'uniqueSequences', 'SequenceIndex',
+           'buildOMESMatrix', 'buildSCAMatrix', 'buildDirectInfoMatrix',
+           'buildPLMDCAMatrix', 'buildCoevolutionMatrices',
+           'CoevolutionAccumulator', 'saveAccumulator', 'loadAccumulator',
+           'calcMeff']
 
 
 doc_turbo = """
@@ -20,6 +27,128 @@ doc_turbo = """
     allocation fails, the implementation will fall back to slower and
     memory efficient mode."""
 
+doc_threads = """
+
+    When *n_threads* is greater than one, pairs of columns are distributed
+    over that many threads in turbo mode, and all available processors are
+    used when it is zero or negative.  Results are identical to those
+    calculated in serial mode."""
+
+doc_strategy = """
+
+    Pairs of columns are histogrammed one at a time by default.  When
+    *strategy* is ``'blocked'``, joint counts for blocks of column pairs
+    are accumulated over chunks of sequences, which keeps columns in cache
+    and runs faster for MSAs with many sequences.  Both strategies give
+    identical results, and *blocked* strategy applies in turbo mode."""
+
+doc_top = """
+
+    When *top* is given, only that many pairs of columns with the highest
+    scores are kept, and ``(rows, columns, values)`` arrays sorted in
+    descending order of values are returned in place of a matrix, as
+    :func:`.calcRankorder` returns for a symmetric matrix without diagonal,
+    i.e. row index is greater than column index.  Each thread keeps its
+    highest pairs, so that memory scales with *top* rather than the square
+    of the number of columns.  Pairs closer than *separation* columns, i.e.
+    with row index minus column index less than *separation*, are skipped."""
+
+doc_weights = """
+
+    By default, each sequence is counted once.  When *weights* is given,
+    sequences are weighted using it instead, e.g. weights returned by
+    :func:`.calcMeff` with *weight* set **True**.  When *weights* is
+    **True**, they are calculated using :func:`.calcMeff` for sequence
+    identity threshold *seqid* (default is 0.8) and cached by :class:`.MSA`
+    instances, so that weighted MI, OMES, and SCA calculations for an MSA
+    share a single weight calculation."""
+
+
+def getStrategy(strategy):
+    """Return **True** for blocked strategy, and validate *strategy*."""
+
+    if strategy not in ('pairwise', 'blocked'):
+        raise ValueError("strategy must be 'pairwise' or 'blocked'")
+    return strategy == 'blocked'
+
+
+def getTop(top, separation=1):
+    """Return arrays to be filled with *top* pairs of columns, or **None**
+    when *top* is **None**, and validate *top* and *separation*."""
+
+    if top is None:
+        return None
+    top = int(top)
+    if top < 1:
+        raise ValueError('top must be a positive integer')
+    if int(separation) < 1:
+        raise ValueError('separation must be a positive integer')
+    return (empty(top, int), empty(top, int), empty(top, float))
+
+
+def trimTop(arrays, count):
+    """Return *count* pairs filled into *arrays* by :func:`getTop` with row
+    index greater than column index."""
+
+    rows, cols, values = arrays
+    return cols[:count], rows[:count], values[:count]
+
+
+def getWeights(msa, weights, seqid=.8):
+    """Return sequence weights as a float array, or **None** when *weights*
+    is **None**."""
+
+    if weights is None or weights is False:
+        return None
+    if weights is True:
+        try:
+            cache = msa._weights
+        except AttributeError:
+            return calcMeff(msa, seqid=seqid, weight=True)[1]
+        try:
+            return cache[seqid]
+        except KeyError:
+            cache[seqid] = calcMeff(msa, seqid=seqid, weight=True)[1]
+            return cache[seqid]
+
+    weights = ascontiguousarray(weights, float)
+    number = getMSA(msa).shape[0]
+    if weights.shape != (number,):
+        raise ValueError('weights must be an array of length {0}'
+                         .format(number))
+    if not weights.sum() > 0:
+        raise ValueError('weights must have a positive sum')
+    return weights
+
+
+def getBands(seqid, method='exact', **kwargs):
+    """Return keyword arguments that select *method* for Meff calculation.
+    For ``'lsh'`` method, default number of bands and positions per band
+    are chosen so that a pair of sequences at *seqid* identity shares a
+    bucket in a band with 5% probability, and in at least one of the bands
+    with 99% probability."""
+
+    if method == 'exact':
+        return {}
+    if method != 'lsh':
+        raise ValueError("method must be 'exact' or 'lsh'")
+
+    from math import ceil, log
+    band_size = kwargs.get('band_size')
+    if band_size is None:
+        band_size = 1
+        if 0 < seqid < 1:
+            band_size = max(1, int(round(log(.05) / log(seqid))))
+    bands = kwargs.get('bands')
+    if bands is None:
+        bands = 1
+        if 0 < seqid < 1:
+            bands = int(ceil(log(.01) / log(1 - seqid ** band_size)))
+    if bands < 1 or band_size < 1:
+        raise ValueError('bands and band_size must be positive integers')
+    return {'bands': int(bands), 'band_size': int(band_size),
+            'seed': int(kwargs.get('seed', 1))}
+
 
 def getMSA(msa):
     """Return MSA character array."""
@@ -40,7 +169,18 @@ def getMSA(msa):
     return msa
 
 
-def calcShannonEntropy(msa, ambiguity=True, omitgaps=True, **kwargs):
+def getCodes(msa):
+    """Return residue codes cached by *msa*, or **None** when *msa* is not an
+    :class:`.MSA` instance."""
+
+    try:
+        return msa._getCodes()
+    except AttributeError:
+        return None
+
+
+def calcShannonEntropy(msa, ambiguity=True, omitgaps=True, n_threads=1,
+                       **kwargs):
     """Return Shannon entropy array calculated for *msa*, which may be
     an :class:`.MSA` instance or a 2D Numpy character array.  Implementation
     is case insensitive and handles ambiguous amino acids as follows:
@@ -60,17 +200,92 @@ def calcShannonEntropy(msa, ambiguity=True, omitgaps=True, **kwargs):
       * non-existent, the probability of observing amino acids in a given
         column is adjusted, by default
       * as a distinct character with its own probability, when *omitgaps* is
-        **False**"""
+        **False**
+
+    Sequences are read row by row, and blocks of columns are distributed
+    over *n_threads* threads, or all available processors when it is zero
+    or negative."""
 
     msa = getMSA(msa)
     length = msa.shape[1]
     entropy = empty(length, float)
     from .msatools import msaentropy
-    return msaentropy(msa, entropy,
-                      ambiguity=bool(ambiguity), omitgaps=bool(omitgaps))
+    return msaentropy(msa, entropy, ambiguity=bool(ambiguity),
+                      omitgaps=bool(omitgaps), n_threads=int(n_threads))
+
+
+CONSERVATION_SCORES = ('entropy', 'relent', 'jsd', 'propent')
+
+# BLOSUM62 background amino acid frequencies
+BACKGROUND = dict(zip('ARNDCQEGHILKMFPSTWYV',
+                      [.078, .051, .041, .052, .024, .034, .059, .083, .025,
+                       .062, .092, .056, .024, .044, .043, .059, .055, .014,
+                       .034, .072]))
+
+
+def calcConservationScores(msa, scores=('entropy', 'jsd'), ambiguity=True,
+                           omitgaps=True, weights=None, background=None,
+                           n_threads=1, **kwargs):
+    """Return a dictionary of conservation *scores* of columns calculated
+    for *msa*, which may be an :class:`.MSA` instance or a 2D Numpy
+    character array, in a single pass over sequences.  Scores may be any
+    of:
+
+      * ``'entropy'``, Shannon entropy, see :func:`.calcShannonEntropy`
+      * ``'relent'``, relative entropy of amino acid probabilities with
+        respect to *background* probabilities
+      * ``'jsd'``, Jensen-Shannon divergence of amino acid probabilities and
+        *background* probabilities, in bits
+      * ``'propent'``, entropy of amino acid property classes, i.e.
+        aliphatic (AVLIMC), aromatic (FWYH), polar (STNQ), positive (KR),
+        negative (DE), glycine, and proline
+
+    Ambiguous amino acids are handled as described for
+    :func:`.calcShannonEntropy` unless *ambiguity* is **False**.  Scores
+    other than Shannon entropy are calculated for the twenty standard amino
+    acids, so gaps and other characters are omitted, and they are zero for
+    columns without standard amino acids.  *omitgaps* applies to Shannon
+    entropy.
+
+    *background* may be a dictionary of amino acid probabilities or an
+    array of them in ``'ACDEFGHIKLMNPQRSTVWY'`` order, and it is normalized
+    to sum to one.  By default, BLOSUM62 background frequencies are used.
+
+    Blocks of columns are distributed over *n_threads* threads, or all
+    available processors when it is zero or negative."""
+
+    if isinstance(scores, str):
+        scores = (scores,)
+    for score in scores:
+        if score not in CONSERVATION_SCORES:
+            raise ValueError('scores must be among ' +
+                             ', '.join(CONSERVATION_SCORES))
+    if background is None:
+        background = BACKGROUND
+    if isinstance(background, dict):
+        background = [background.get(aa, 0.) for aa in 'ACDEFGHIKLMNPQRSTVWY']
+    background = array(background, float)
+    if background.shape != (20,) or (background < 0).any():
+        raise ValueError('background must have 20 non-negative values')
+    if not background.sum() > 0:
+        raise ValueError('background must have a positive sum')
+    background /= background.sum()
+    weights = getWeights(msa, weights, kwargs.get('seqid', .8))
+    msa = getMSA(msa)
+
+    from .msatools import msaconserv
+    length = msa.shape[1]
+    arrays = dict([(score, empty(length, float)) for score in scores])
+    msaconserv(msa, background, ambiguity=bool(ambiguity),
+               omitgaps=bool(omitgaps), weights=weights,
+               n_threads=int(n_threads), **arrays)
+    return arrays
+
+calcConservationScores.__doc__ += doc_weights
 
 
-def buildMutinfoMatrix(msa, ambiguity=True, turbo=True, **kwargs):
+def buildMutinfoMatrix(msa, ambiguity=True, turbo=True, n_threads=1,
+                       strategy='pairwise', weights=None, **kwargs):
     """Return mutual information matrix calculated for *msa*, which may be an
     :class:`.MSA` instance or a 2D Numpy character array.  Implementation
     is case insensitive and handles ambiguous amino acids as follows:
@@ -95,6 +310,15 @@ def buildMutinfoMatrix(msa, ambiguity=True, turbo=True, **kwargs):
     respectively.  Normalization by joint entropy can performed using this
     function with *norm* option set **True**."""
 
+    if kwargs.get('top') is not None:
+        score = 'normmi' if kwargs.pop('norm', False) else 'mutinfo'
+        return buildCoevolutionMatrices(msa, score, ambiguity=ambiguity,
+                                        n_threads=n_threads,
+                                        strategy=strategy, weights=weights,
+                                        **kwargs)[score]
+
+    codes = getCodes(msa)
+    weights = getWeights(msa, weights, kwargs.get('seqid', .8))
     msa = getMSA(msa)
 
     from .msatools import msamutinfo
@@ -104,13 +328,229 @@ def buildMutinfoMatrix(msa, ambiguity=True, turbo=True, **kwargs):
     mutinfo = msamutinfo(msa, mutinfo,
                          ambiguity=bool(ambiguity), turbo=bool(turbo),
                          norm=bool(kwargs.get('norm', False)),
-                         debug=bool(kwargs.get('debug', False)))
+                         debug=bool(kwargs.get('debug', False)),
+                         n_threads=int(n_threads), codes=codes,
+                         blocked=getStrategy(strategy), weights=weights)
     LOGGER.report('Mutual information matrix was calculated in %.2fs.',
                   '_mutinfo')
 
     return mutinfo
 
-buildMutinfoMatrix.__doc__ += doc_turbo
+buildMutinfoMatrix.__doc__ += (doc_turbo + doc_threads + doc_strategy +
+                               doc_weights + doc_top)
+
+
+COEVOLUTION_SCORES = ('mutinfo', 'normmi', 'omes', 'jointent', 'entropy')
+
+
+def buildCoevolutionMatrices(msa, scores=('mutinfo', 'omes'), ambiguity=True,
+                             omitgaps=True, n_threads=1, strategy='pairwise',
+                             weights=None, top=None, separation=1, **kwargs):
+    """Return a dictionary of *scores* calculated for *msa*, which may be an
+    :class:`.MSA` instance or a 2D Numpy character array, in a single pass
+    over column pairs.  Joint probabilities of each pair of columns are
+    calculated once for all requested scores, which may be any of:
+
+      * ``'mutinfo'``, mutual information, see :func:`.buildMutinfoMatrix`
+      * ``'normmi'``, mutual information normalized by joint entropy
+      * ``'omes'``, see :func:`.buildOMESMatrix`
+      * ``'jointent'``, joint entropy of pairs of columns
+      * ``'entropy'``, Shannon entropy of columns, see
+        :func:`.calcShannonEntropy`
+
+    Matrices have zero diagonal, and pairs of columns are returned in their
+    place when *top* is given, see below.  Ambiguous amino acids are handled as
+    described for :func:`.buildMutinfoMatrix` unless *ambiguity* is
+    **False**, and gaps are omitted from column entropy unless *omitgaps* is
+    **False**.  Column entropy is weighted as well when *weights* are
+    given."""
+
+    if isinstance(scores, str):
+        scores = (scores,)
+    for score in scores:
+        if score not in COEVOLUTION_SCORES:
+            raise ValueError('scores must be among ' +
+                             ', '.join(COEVOLUTION_SCORES))
+    codes = getCodes(msa)
+    weights = getWeights(msa, weights, kwargs.get('seqid', .8))
+    msa = getMSA(msa)
+
+    from .msatools import msacoevol
+    LOGGER.timeit('_coevol')
+    length = msa.shape[1]
+    arrays = {}
+    for score in scores:
+        if score == 'entropy':
+            arrays[score] = empty(length, float)
+        elif top is None:
+            arrays[score] = empty((length, length), float)
+        else:
+            arrays[score] = getTop(top, separation)
+    counts = msacoevol(msa, ambiguity=bool(ambiguity),
+                       omitgaps=bool(omitgaps), n_threads=int(n_threads),
+                       codes=codes, blocked=getStrategy(strategy),
+                       weights=weights, separation=int(separation), **arrays)
+    LOGGER.report('Coevolution matrices were calculated in %.2fs.',
+                  '_coevol')
+    if top is not None:
+        for score, count in zip(COEVOLUTION_SCORES[:4], counts):
+            if score in arrays:
+                arrays[score] = trimTop(arrays[score], count)
+    return arrays
+
+buildCoevolutionMatrices.__doc__ += (doc_threads + doc_strategy +
+                                     doc_weights + doc_top)
+
+
+NUMCHARS = 27
+
+
+class CoevolutionAccumulator(object):
+
+    """Accumulate character pair counts of each pair of columns of an MSA
+    that grows, or shrinks, in batches of sequences, so that MI and OMES
+    matrices can be updated without scanning sequences counted before.
+    Counts are kept for each of ``length * (length - 1) / 2`` pairs of
+    columns as 27x27 arrays of unsigned 32-bit integers, about 1.5 kB per
+    pair.  Ambiguous amino acids are counted as themselves and handled when
+    matrices are calculated, as described for :func:`.buildMutinfoMatrix`,
+    so that matrices are identical to those calculated from all sequences
+    at once.  Accumulators can be saved and loaded using
+    :func:`.saveAccumulator` and :func:`.loadAccumulator`."""
+
+    def __init__(self, length):
+
+        length = int(length)
+        if length < 1:
+            raise ValueError('length must be a positive integer')
+        self._length = length
+        self._number = 0
+        self._pairs = zeros((length * (length - 1) // 2, NUMCHARS * NUMCHARS),
+                            uint32)
+        self._columns = zeros((length, NUMCHARS), uint32)
+
+    def __repr__(self):
+
+        return '<CoevolutionAccumulator: {0} sequences, {1} columns>'.format(
+            self._number, self._length)
+
+    def __len__(self):
+
+        return self._number
+
+    def numSequences(self):
+        """Return number of sequences counted."""
+
+        return self._number
+
+    def numColumns(self):
+        """Return number of columns."""
+
+        return self._length
+
+    def _count(self, msa, remove, n_threads):
+
+        codes = getCodes(msa)
+        msa = getMSA(msa)
+        if msa.shape[1] != self._length:
+            raise ValueError('msa must have {0} columns'.format(self._length))
+        if remove and msa.shape[0] > self._number:
+            raise ValueError('msa has more sequences than counted')
+
+        from .msatools import msapaircounts
+        number = msapaircounts(msa, self._pairs, self._columns,
+                               remove=int(remove), codes=codes,
+                               n_threads=int(n_threads))
+        self._number += -number if remove else number
+
+    def addSequences(self, msa, n_threads=1):
+        """Count sequences of *msa*, which may be an :class:`.MSA` instance or
+        a 2D Numpy character array with the same number of columns.  Pairs of
+        columns are distributed over *n_threads* threads."""
+
+        self._count(msa, False, n_threads)
+
+    def removeSequences(self, msa, n_threads=1):
+        """Remove counts of sequences of *msa*, which must have been added
+        before.  Removing sequences that were not added corrupts counts."""
+
+        self._count(msa, True, n_threads)
+
+    def getMatrices(self, scores=('mutinfo', 'omes'), ambiguity=True,
+                    n_threads=1):
+        """Return a dictionary of *scores* calculated from counts, which may
+        be any of ``'mutinfo'``, ``'normmi'``, ``'omes'`` and ``'jointent'``,
+        see :func:`.buildCoevolutionMatrices`.  Pairs of columns are
+        distributed over *n_threads* threads."""
+
+        if isinstance(scores, str):
+            scores = (scores,)
+        for score in scores:
+            if score not in COEVOLUTION_SCORES[:4]:
+                raise ValueError('scores must be among ' +
+                                 ', '.join(COEVOLUTION_SCORES[:4]))
+        if not self._number:
+            raise ValueError('no sequences were counted')
+
+        from .msatools import msacountstats
+        length = self._length
+        arrays = dict([(score, empty((length, length), float))
+                       for score in scores])
+        msacountstats(self._pairs, self._columns, self._number,
+                      ambiguity=bool(ambiguity), n_threads=int(n_threads),
+                      **arrays)
+        return arrays
+
+    def getMutinfo(self, norm=False, ambiguity=True, n_threads=1):
+        """Return mutual information matrix, normalized by joint entropy
+        when *norm* is **True**, see :func:`.buildMutinfoMatrix`."""
+
+        score = 'normmi' if norm else 'mutinfo'
+        return self.getMatrices(score, ambiguity, n_threads)[score]
+
+    def getOMES(self, ambiguity=True, n_threads=1):
+        """Return OMES matrix, see :func:`.buildOMESMatrix`."""
+
+        return self.getMatrices('omes', ambiguity, n_threads)['omes']
+
+
+def saveAccumulator(accumulator, filename, **kwargs):
+    """Save *accumulator* counts as :file:`filename.coev.npz`, so that
+    counting can be resumed using :func:`.loadAccumulator`.  Upon successful
+    completion of saving, filename is returned.  This function makes use of
+    :func:`numpy.savez` function."""
+
+    if not isinstance(accumulator, CoevolutionAccumulator):
+        raise TypeError('accumulator must be a CoevolutionAccumulator')
+    filename += '.coev.npz'
+    ostream = openFile(filename, 'wb', **kwargs)
+    savez(ostream, pairs=accumulator._pairs, columns=accumulator._columns,
+          number=accumulator._number)
+    ostream.close()
+    return filename
+
+
+def loadAccumulator(filename):
+    """Return :class:`.CoevolutionAccumulator` instance after loading counts
+    from *filename*.  This function makes use of :func:`numpy.load`
+    function.  See also :func:`saveAccumulator`."""
+
+    attr_dict = load(filename)
+    try:
+        pairs, columns = attr_dict['pairs'], attr_dict['columns']
+        number = int(attr_dict['number'])
+    except KeyError:
+        raise IOError('{0} is not a valid accumulator file'.format(filename))
+    length = columns.shape[0]
+    if (columns.shape != (length, NUMCHARS) or
+        pairs.shape != (length * (length - 1) // 2, NUMCHARS * NUMCHARS)):
+        raise IOError('{0} is not a valid accumulator file'.format(filename))
+    accumulator = CoevolutionAccumulator.__new__(CoevolutionAccumulator)
+    accumulator._length = length
+    accumulator._number = number
+    accumulator._pairs = ascontiguousarray(pairs, uint32)
+    accumulator._columns = ascontiguousarray(columns, uint32)
+    return accumulator
 
 
 def calcMSAOccupancy(msa, occ='res', count=False):
@@ -252,40 +692,187 @@ def applyMutinfoCorr(mutinfo, corr='prod'):
     return mi
 
 
-def buildSeqidMatrix(msa, turbo=True):
-    """Return sequence identity matrix for *msa*."""
+SEQID_TYPES = {'float64': 0, 'float32': 1, 'uint16': 2}
 
-    msa = getMSA(msa)
 
-    LOGGER.timeit('_seqid')
-    from .seqtools import msaeye
+def buildSeqidMatrix(msa, turbo=True, dtype=float, packed=False, out=None,
+                     n_threads=1):
+    """Return sequence identity matrix for *msa*.
+
+    Identity is calculated for tiles of pairs of sequences, which are
+    distributed over *n_threads* threads, or all available processors when
+    it is zero or negative.  *dtype* may be ``float`` (default),
+    ``'float32'``, or ``'uint16'``, in which case identity times 65535,
+    rounded, is stored, so that a matrix for 100,000 sequences takes 20 GB
+    instead of 80 GB.  When *packed* is **True**, upper triangle including
+    the diagonal is returned as a 1D array in row order, i.e. the order of
+    :func:`numpy.triu_indices`, halving memory once more.
+
+    Matrix, or packed triangle, is written into *out* when it is given,
+    e.g. a :class:`numpy.memmap` instance, which must be a C-contiguous
+    array of the expected shape and *dtype*.  *turbo* is accepted for
+    backwards compatibility and has no effect."""
 
+    from numpy import dtype as getDtype
+    msa = getMSA(msa)
+    dtype = getDtype(dtype)
+    kind = SEQID_TYPES.get(dtype.name)
+    if kind is None:
+        raise ValueError("dtype must be float, 'float32', or 'uint16'")
     dim = msa.shape[0]
-    seqid = msaeye(msa, ones((dim, dim), float), turbo=bool(turbo))
+    shape = (dim * (dim + 1) // 2,) if packed else (dim, dim)
+    if out is None:
+        out = empty(shape, dtype)
+    elif (out.shape != shape or out.dtype != dtype or
+          not out.flags.c_contiguous or not out.flags.writeable):
+        raise ValueError('out must be a writeable C-contiguous array of '
+                         'shape {0} and dtype {1}'.format(shape, dtype.name))
+
+    LOGGER.timeit('_seqid')
+    from .seqtools import msaseqid
 
+    msaseqid(msa, out, kind=kind, packed=bool(packed),
+             n_threads=int(n_threads))
     LOGGER.report('Sequence identity matrix was calculated in %.2fs.',
                   '_seqid')
-    return seqid
+    return out
 
-buildSeqidMatrix.__doc__ += doc_turbo
 
-
-def uniqueSequences(msa, seqid=0.98, turbo=True):
+def uniqueSequences(msa, seqid=0.98, turbo=True, n_threads=1):
     """Return a boolean array marking unique sequences in *msa*.  A sequence
-    sharing sequence identity of *sqid* or more with another sequence coming
-    before itself in *msa* will have a **False** value in the array."""
+    sharing sequence identity of *sqid* or more with another unique sequence
+    coming before itself in *msa* will have a **False** value in the array.
+
+    Sequences are encoded once, and each unique sequence is compared with
+    the following sequences using *n_threads* threads, or all available
+    processors when it is zero or negative.  Comparison of a pair of
+    sequences stops as soon as residues left in them cannot change whether
+    identity reaches *seqid*.  *turbo* is accepted for backwards
+    compatibility and has no effect."""
 
     msa = getMSA(msa)
 
-    from .seqtools import msaeye
+    from .seqtools import msaunique
 
     if not (0 < seqid <= 1):
         raise ValueError('seqid must satisfy 0 < seqid <= 1')
 
-    return msaeye(msa, zeros(msa.shape[0], bool),
-                  unique=seqid, turbo=bool(turbo))
+    return msaunique(msa, zeros(msa.shape[0], bool), unique=float(seqid),
+                     n_threads=int(n_threads))
+
+
+class SequenceIndex(object):
 
-uniqueSequences.__doc__ += doc_turbo
+    """Index of sequences of an MSA for finding sequences similar to query
+    sequences of the same length.  Identity is calculated as described for
+    :func:`.buildSeqidMatrix`.  Sequences are encoded once, padded for SIMD
+    comparison, and sorted by number of residues, which bounds identity,
+    e.g. a query with 100 residues shares at most 80% identity with a
+    sequence with 125 residues.  Sequences that cannot reach a threshold
+    are skipped without being compared, and comparison of others stops as
+    soon as residues left decide it, so an index answers queries in a
+    fraction of the time a row of the identity matrix takes.
+
+    Queries may be a string, a list of strings, an :class:`.MSA` instance,
+    or a character array.  Results for a string are returned as they are,
+    and for others as lists or arrays with one row per query."""
+
+    def __init__(self, msa):
+
+        msa = getMSA(msa)
+        self._number, self._length = msa.shape
+        self._codes, nonzero = self._encode(msa)
+        self._order = nonzero.argsort(kind='mergesort')
+        self._nonzero = nonzero[self._order]
+
+    def __repr__(self):
+
+        return '<SequenceIndex: {0} sequences, {1} columns>'.format(
+            self._number, self._length)
+
+    def __len__(self):
+
+        return self._number
+
+    def numSequences(self):
+        """Return number of indexed sequences."""
+
+        return self._number
+
+    def numColumns(self):
+        """Return number of columns."""
+
+        return self._length
+
+    def _encode(self, msa):
+
+        from .seqtools import msaindex
+
+        stride = max(1, (msa.shape[1] + 31) // 32) * 32
+        codes = zeros((msa.shape[0], stride), 'u1')
+        nonzero = zeros(msa.shape[0], int)
+        msaindex(msa, codes, nonzero)
+        return codes, nonzero
+
+    def _queries(self, queries):
+
+        single = isinstance(queries, str)
+        if single or (isinstance(queries, list) and
+                      all(isinstance(query, str) for query in queries)):
+            seqs = [queries] if single else queries
+            if any(len(seq) != self._length for seq in seqs):
+                raise ValueError('queries must have {0} characters'
+                                 .format(self._length))
+            queries = array([list(seq) for seq in seqs], '|S1').reshape(
+                (len(seqs), self._length))
+        queries = getMSA(queries)
+        if queries.shape[1] != self._length:
+            raise ValueError('queries must have {0} columns'
+                             .format(self._length))
+        codes, nonzero = self._encode(queries)
+        return codes, nonzero, single
+
+    def findSimilar(self, queries, seqid=0.9, n_threads=1):
+        """Return indices of sequences sharing *seqid* or more identity with
+        each query and their identities, as a pair of arrays sorted by
+        decreasing identity and then by index.  Sequences are compared with
+        a query using *n_threads* threads, or all available processors when
+        it is zero or negative."""
+
+        from .seqtools import msasimilar
+
+        codes, nonzero, single = self._queries(queries)
+        index = empty(self._number, int)
+        values = empty(self._number, float)
+        results = []
+        for query, qnz in zip(codes, nonzero):
+            count = msasimilar(self._codes, self._nonzero, self._order,
+                               query, int(qnz), float(seqid), index, values,
+                               n_threads=int(n_threads))
+            which = lexsort((index[:count], -values[:count]))
+            results.append((index[which], values[which]))
+        return results[0] if single else results
+
+    def findNearest(self, queries, n=1, n_threads=1):
+        """Return indices of *n* sequences most identical to each query and
+        their identities, as a pair of arrays with shape ``(n,)`` for a
+        string and ``(number of queries, n)`` otherwise, sorted by
+        decreasing identity and then by index.  Queries are distributed over
+        *n_threads* threads, or all available processors when it is zero or
+        negative."""
+
+        from .seqtools import msanearest
+
+        n = int(n)
+        if not (0 < n <= self._number):
+            raise ValueError('n must satisfy 0 < n <= {0}'
+                             .format(self._number))
+        codes, nonzero, single = self._queries(queries)
+        index = empty((len(codes), n), int)
+        values = empty((len(codes), n), float)
+        msanearest(self._codes, self._nonzero, self._order, codes, nonzero,
+                   index, values, n_threads=int(n_threads))
+        return (index[0], values[0]) if single else (index, values)
 
 
 def calcRankorder(matrix, zscore=False, **kwargs):
@@ -342,7 +929,8 @@ def calcRankorder(matrix, zscore=False, **kwargs):
     return (row, column, matrix[row, column])
 
 
-def buildOMESMatrix(msa, ambiguity=True, turbo=True, **kwargs):
+def buildOMESMatrix(msa, ambiguity=True, turbo=True, strategy='pairwise',
+                    weights=None, **kwargs):
     """Return OMES (Observed Minus Expected Squared) covariance matrix
     calculated for *msa*, which may be an :class:`.MSA` instance or a 2D
     NumPy character array. OMES is defined as::
@@ -369,6 +957,13 @@ def buildOMESMatrix(msa, ambiguity=True, turbo=True, **kwargs):
     characters as considered as distinct types.  All non-alphabet characters
     are considered as gaps."""
 
+    if kwargs.get('top') is not None:
+        return buildCoevolutionMatrices(msa, 'omes', ambiguity=ambiguity,
+                                        strategy=strategy, weights=weights,
+                                        **kwargs)['omes']
+
+    codes = getCodes(msa)
+    weights = getWeights(msa, weights, kwargs.get('seqid', .8))
     msa = getMSA(msa)
 
     from .msatools import msaomes
@@ -376,16 +971,20 @@ def buildOMESMatrix(msa, ambiguity=True, turbo=True, **kwargs):
     length = msa.shape[1]
     omes = empty((length, length), float)
     omes = msaomes(msa, omes, ambiguity=bool(ambiguity), turbo=bool(turbo),
-                   debug=bool(kwargs.get('debug', False)))
+                   debug=bool(kwargs.get('debug', False)), codes=codes,
+                   blocked=getStrategy(strategy), weights=weights)
     LOGGER.report('OMES matrix was calculated in %.2fs.',
                   '_omes')
 
     return omes
 
-buildOMESMatrix.__doc__ += doc_turbo
+buildOMESMatrix.__doc__ += doc_turbo + doc_strategy + doc_weights + """
+    For weighted OMES, sum of weights is used as the number of sequences.
+""" + doc_top
 
 
-def buildSCAMatrix(msa, turbo=True, **kwargs):
+def buildSCAMatrix(msa, turbo=True, weights=None, strategy='pairwise',
+                   **kwargs):
     """Return SCA matrix calculated for *msa*, which may be an :class:`.MSA`
     instance or a 2D Numpy character array.
 
@@ -407,20 +1006,70 @@ def buildSCAMatrix(msa, turbo=True, **kwargs):
     characters as considered as distinct types.  All non-alphabet characters
     are considered as gaps."""
 
+    codes = getCodes(msa)
+    weights = getWeights(msa, weights, kwargs.get('seqid', .8))
     msa = getMSA(msa)
     from .msatools import msasca
     LOGGER.timeit('_sca')
     length = msa.shape[1]
-    sca = zeros((length, length), float)
-    sca = msasca(msa, sca, turbo=bool(turbo))
+    if getStrategy(strategy):
+        sca = calcSCAChunks(msa, codes, weights,
+                            int(kwargs.get('chunk', 1 << 22)),
+                            int(kwargs.get('block', 256)))
+    else:
+        sca = zeros((length, length), float)
+        sca = msasca(msa, sca, turbo=bool(turbo), codes=codes,
+                     weights=weights)
     LOGGER.report('SCA matrix was calculated in %.2fs.', '_sca')
     return sca
 
-buildSCAMatrix.__doc__ += doc_turbo
+buildSCAMatrix.__doc__ += doc_turbo + doc_weights + """
+
+    Pairs of columns are calculated one at a time by default.  When
+    *strategy* is ``'blocked'``, covariance matrix is accumulated as products
+    of blocks of centered values of sequences, using Numpy matrix
+    multiplication in single precision, and summed in double precision.
+    Only a chunk of about *chunk* values (default is 4M) is kept in memory.
+    Each product sums over at most *block* sequences (default is 256) in
+    single precision, so rounding error of the result does not grow with
+    number of sequences, and it agrees with the default strategy within a
+    relative error of about 1e-6 for deep alignments.  Larger *block*
+    values trade accuracy for fewer products."""
+
+
+def calcSCAChunks(msa, codes, weights, chunk, block):
+    """Return SCA matrix for character array *msa* accumulated over chunks of
+    sequences, products of up to *block* sequences at a time, see
+    :func:`.buildSCAMatrix`."""
+
+    from .msatools import msascatable, msascarows
+    number, length = msa.shape
+    table = zeros((length, 27), float)
+    mean = zeros(length, float)
+    msascatable(msa, table, mean, codes=codes, weights=weights)
+    scale = None
+    if weights is not None:
+        scale = sqrt(weights / weights.sum())
+    size = max(1, min(number, chunk // max(length, 1)))
+    block = max(1, block)
+    values = empty((length, size), float32)
+    sca = zeros((length, length), float)
+    for start in range(0, number, size):
+        msascarows(msa, table, mean, values, start=start, codes=codes,
+                   scale=scale)
+        count = min(size, number - start)
+        for first in range(0, count, block):
+            part = values[:, first:min(first + block, count)]
+            sca += dot(part, part.T)
+    if weights is None:
+        sca /= number
+    return absolute(sca, sca)
 
 
 def buildDirectInfoMatrix(msa, seqid=.8, pseudo_weight=.5, refine=False,
-                          **kwargs):
+                          n_threads=1, method='exact', precision='double',
+                          epsilon=1e-4, iterations=False, top=None,
+                          separation=1, **kwargs):
     """Return direct information matrix calculated for *msa*, which may be an
     :class:`.MSA` instance or a 2D Numpy character array.
 
@@ -433,35 +1082,110 @@ def buildDirectInfoMatrix(msa, seqid=.8, pseudo_weight=.5, refine=False,
     Sequences are not refined by default. When *refine* is set **True**,
     the MSA will be refined by the first sequence and the shape of direct
     information matrix will be smaller.
-    """
 
+    Sequence weights are calculated using *n_threads* threads, and they
+    are approximated when *method* is ``'lsh'``, see :func:`.calcMeff`.
+
+    Correlation matrix has a row and a column for each state of each column,
+    about 20 times the number of columns.  It is filled and inverted in
+    place, so that it is the only matrix of that size in memory, which is
+    halved when *precision* is ``'single'``.  Direct information calculated
+    in single precision usually differs in the third significant digit.
+
+    Pair probabilities of each pair of columns are fitted to single column
+    probabilities iteratively, until fields change by less than *epsilon*.
+    Pairs are fitted using *n_threads* threads.  When *iterations* is
+    **True**, a histogram of the number of iterations each pair needed is
+    also returned, i.e. ``(di, histogram)`` where ``histogram[k]`` is the
+    number of pairs that converged in *k* iterations, including pairs not
+    among *top* but excluding those skipped for *separation*."""
+
+    if precision not in ('double', 'single'):
+        raise ValueError("precision must be 'double' or 'single'")
+    codes = getCodes(msa)
     msa = getMSA(msa)
-    from .msatools import msadipretest, msadirectinfo1, msadirectinfo2
-    from numpy import matrix
+    bands = getBands(seqid, method, **kwargs)
+    from .msatools import msadipretest, msadirectinfo
 
     LOGGER.timeit('_di')
     refine = 1 if refine else 0
     # msadipretest get some parameter from msa to set matrix size
-    length, q = msadipretest(msa, refine=refine)
-    c = matrix.dot(matrix(zeros((length*q, 1), float)),
-                   matrix(zeros((1, length*q), float)))
-    prob = zeros((length, q+1), float)
-    # msadirectinfo1 return c to be inversed and prob to be used
-    meff, n, length, c, prob = msadirectinfo1(msa, c, prob, theta=1.-seqid,
-                                              pseudocount_weight=pseudo_weight,
-                                              refine=refine, q=q+1)
-
-    c = c.I
-
-    di = zeros((length, length), float)
-    # get final DI
-    di = msadirectinfo2(n, length, c, prob, di, q+1)
-    del prob, c
+    length, q = msadipretest(msa, refine=refine, codes=codes)
+    pairs = getTop(top, separation)
+    di = zeros((length, length), float) if pairs is None else pairs
+    iters = zeros((length, length), 'i') if iterations else None
+    meff, di = msadirectinfo(msa, di, theta=1.-seqid,
+                             pseudocount_weight=pseudo_weight, refine=refine,
+                             codes=codes, n_threads=int(n_threads),
+                             single=int(precision == 'single'),
+                             epsilon=float(epsilon), iterations=iters,
+                             separation=int(separation), **bands)
     LOGGER.report('DI matrix was calculated in %.2fs.', '_di')
+    if pairs is not None:
+        di = trimTop(pairs, di)
+    if iterations:
+        k = 1 if pairs is None else int(separation)
+        return di, bincount(iters[triu_indices(length, k)])
     return di
 
+buildDirectInfoMatrix.__doc__ += doc_top
+
+
+def buildPLMDCAMatrix(msa, seqid=.8, lambda_h=.01, lambda_J=.01,
+                      refine=False, n_threads=1, method='exact', max_iter=500,
+                      **kwargs):
+    """Return coupling matrix calculated for *msa* by asymmetric
+    pseudolikelihood maximization, see [ME14]_.  *msa* may be an
+    :class:`.MSA` instance or a 2D Numpy character array.
 
-def calcMeff(msa, seqid=.8, refine=False, weight=False, **kwargs):
+    For each column, fields and couplings with all other columns are fitted
+    by maximizing pseudolikelihood of sequences, weighted as in
+    :func:`.buildDirectInfoMatrix`, with L2 regularization weights
+    *lambda_h* and *lambda_J*, using L-BFGS for at most *max_iter*
+    iterations.  Columns are fitted using *n_threads* threads, and no matrix
+    is inverted, so alignments with thousands of columns can be analyzed.
+    Memory grows with the square of number of columns, *L*.  Couplings of a
+    pair are kept in single precision, about 1.8 KB, from the time the
+    first of its columns is fitted until the second one is, and at most
+    about a quarter of pairs are waiting at once, e.g. 450 MB for
+    *L* = 1000.  In addition, each thread needs about 15 × 3.5 KB × *L*
+    for fitting a column, e.g. 53 MB for *L* = 1000.
+
+    Couplings fitted for both columns of a pair are averaged, and Frobenius
+    norm of their non-gap states in zero-sum gauge is returned after average
+    product correction, see :func:`.applyMutinfoCorr`, with zero diagonal.
+    Shape of the matrix is the same as that of
+    :func:`.buildDirectInfoMatrix`.
+
+    .. [ME14] Ekeberg M, Hartonen T, Aurell E. Fast pseudolikelihood
+       maximization for direct-coupling analysis of protein structure from
+       many homologous amino-acid sequences. *J Comput Phys* **2014**
+       276:341-356."""
+
+    codes = getCodes(msa)
+    msa = getMSA(msa)
+    bands = getBands(seqid, method, **kwargs)
+    from .msatools import msadipretest, msaplmdca
+
+    LOGGER.timeit('_plm')
+    refine = 1 if refine else 0
+    length, q = msadipretest(msa, refine=refine, codes=codes)
+    norm = zeros((length, length), float)
+    meff, norm = msaplmdca(msa, norm, theta=1.-seqid,
+                           lambda_h=float(lambda_h),
+                           lambda_j=float(lambda_J), refine=refine,
+                           codes=codes, n_threads=int(n_threads),
+                           max_iter=int(max_iter), **bands)
+    if length > 2:
+        norm = applyMutinfoCorr(norm)
+    norm[range(length), range(length)] = 0
+    LOGGER.report('Pseudolikelihood couplings were calculated in %.2fs.',
+                  '_plm')
+    return norm
+
+
+def calcMeff(msa, seqid=.8, refine=False, weight=False, n_threads=1,
+             method='exact', **kwargs):
     """Return the Meff for *msa*, which may be an :class:`.MSA`
     instance or a 2D Numpy character array.
 
@@ -479,9 +1203,26 @@ def calcMeff(msa, seqid=.8, refine=False, weight=False, **kwargs):
     Sequences are not refined by default. When *refine* is set **True**, the
     MSA will be refined by the first sequence.
 
-    The weight for each sequence are returned when *weight* is **True**."""
+    The weight for each sequence are returned when *weight* is **True**.
+
+    When *n_threads* is greater than one, pairs of sequences are compared
+    using that many threads, and all available processors are used when it
+    is zero or negative.  Results are identical to those calculated in serial
+    mode.
+
+    When *method* is ``'lsh'``, Meff is approximated for deep alignments in
+    near linear time.  Identical sequences are grouped, and the rest are
+    hashed into buckets by residues at *band_size* randomly sampled
+    positions, repeated for *bands* bands.  Only sequences that share a
+    bucket are compared.  Comparisons are exact, so approximate weights are
+    never smaller than exact weights.  A pair of sequences with identity
+    *s* is missed with probability (1 - s ** *band_size*) ** *bands*, which
+    is 1% for pairs at *seqid* identity by default and drops quickly for
+    more similar pairs.  Positions are sampled using integer *seed*."""
 
+    codes = getCodes(msa)
     msa = getMSA(msa)
+    bands = getBands(seqid, method, **kwargs)
     from .msatools import msameff
     LOGGER.timeit('_meff')
     refine = 1 if refine else 0
@@ -489,8 +1230,10 @@ def calcMeff(msa, seqid=.8, refine=False, weight=False, **kwargs):
     if (not weight):
         w = zeros((msa.shape[0]), float)
         meff = msameff(msa, theta=1.-seqid, meff_only=weight,
-                       refine=refine, w=w)
+                       refine=refine, w=w, codes=codes,
+                       n_threads=int(n_threads), **bands)
     else:
-        meff = msameff(msa, theta=1.-seqid, meff_only=weight, refine=refine)
+        meff = msameff(msa, theta=1.-seqid, meff_only=weight, refine=refine,
+                       codes=codes, n_threads=int(n_threads), **bands)
     LOGGER.report('Meff was calculated in %.2fs.', '_meff')
     return meff
\ No newline at end of file
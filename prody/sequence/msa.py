@@ -1,11 +1,14 @@
 # -*- coding: utf-8 -*-
 """This module defines MSA analysis functions."""
 
-from numpy import all, zeros, dtype, array, char, cumsum
+import operator
+
+from numpy import all, zeros, empty, ones, dtype, array, char, cumsum
+from numpy import asarray, repeat, arange, frombuffer
 
 from .sequence import Sequence, splitSeqLabel
 
-from prody import LOGGER
+from prody import LOGGER, PY3K
 
 __all__ = ['MSA', 'refineMSA', 'mergeMSA']
 
@@ -15,6 +18,133 @@ except NameError:
     pass
 
 
+class LabelBuffer(object):
+
+    """Sequence labels stored in one bytes object with offsets, as parsed
+    from a file by :func:`.parseMSA` in *lazy* mode.  Labels are indexed
+    like a list, and a string is created only when a label is accessed."""
+
+    def __init__(self, buffer, offsets, keys):
+
+        self._buffer = buffer
+        self._offsets = offsets
+        self._keys = keys
+
+    def __len__(self):
+
+        return len(self._keys)
+
+    def __iter__(self):
+
+        for index in range(len(self._keys)):
+            yield self._getLabel(index)
+
+    def __getitem__(self, index):
+
+        if isinstance(index, slice):
+            return [self._getLabel(i)
+                    for i in range(*index.indices(len(self._keys)))]
+        try:
+            index = operator.index(index)
+        except TypeError:
+            raise TypeError('labels must be indexed by integers or slices')
+        if index < 0:
+            index += len(self._keys)
+        if not 0 <= index < len(self._keys):
+            raise IndexError('label index out of range')
+        return self._getLabel(index)
+
+    def _getLabel(self, index):
+
+        offsets = self._offsets
+        label = self._buffer[offsets[index]:offsets[index + 1]]
+        return label.decode('utf-8') if PY3K else label
+
+    def take(self, rows):
+        """Return labels of *rows* in a new buffer."""
+
+        rows = asarray(rows, int)
+        offsets = self._offsets
+        lengths = offsets[rows + 1] - offsets[rows]
+        newoffs = zeros(len(rows) + 1, offsets.dtype)
+        cumsum(lengths, out=newoffs[1:])
+        which = (repeat(offsets[rows] - newoffs[:-1], lengths) +
+                 arange(newoffs[-1]))
+        buffer = frombuffer(self._buffer, 'u1')[which].tobytes()
+        return LabelBuffer(buffer, newoffs, self._keys[rows])
+
+
+class LabelIndex(object):
+
+    """Mapping of identifier parts of labels in a :class:`LabelBuffer` to
+    sequence indices, which are looked up in a hash table built in C when
+    an identifier is first looked up.  Values are an index, or a list of
+    indices for identifiers shared by multiple sequences, as in the
+    dictionary built for a list of labels."""
+
+    def __init__(self, labels):
+
+        self._labels = labels
+        self._table = None
+        self._distinct = None
+
+    def _index(self):
+
+        labels = self._labels
+        if self._table is None:
+            from .msaio import indexLabels
+            size = 1
+            while size < 2 * len(labels):
+                size *= 2
+            self._table = empty(size, labels._offsets.dtype)
+            self._distinct = indexLabels(labels._buffer, labels._offsets,
+                                         labels._keys, self._table)
+
+    def _lookup(self, key):
+
+        from .msaio import lookupLabel
+        self._index()
+        labels = self._labels
+        return lookupLabel(labels._buffer, labels._offsets, labels._keys,
+                           self._table, key.encode('utf-8') if PY3K else key)
+
+    def __getitem__(self, key):
+
+        if isinstance(key, list):
+            raise TypeError('unhashable type: list')
+        rows = self._lookup(key) if isinstance(key, str) else None
+        if not rows:
+            raise KeyError(key)
+        return rows[0] if len(rows) == 1 else rows
+
+    def __contains__(self, key):
+
+        return self.get(key) is not None
+
+    def __len__(self):
+
+        self._index()
+        return self._distinct
+
+    def get(self, key, default=None):
+
+        try:
+            return self[key]
+        except (KeyError, TypeError):
+            return default
+
+    def values(self):
+
+        labels = self._labels
+        buffer, offsets, keys = labels._buffer, labels._offsets, labels._keys
+        for index in range(len(keys)):
+            key = buffer[offsets[index]:offsets[index] + keys[index]]
+            value = self[key.decode('utf-8') if PY3K else key]
+            if value == index or (isinstance(value, list) and
+                                  value[0] == index):
+                yield value
+
+
 class MSA(object):
 
     """Store and manipulate multiple sequence alignments."""
@@ -44,7 +174,9 @@ class MSA(object):
         self._labels = labels
         mapping = kwargs.get('mapping')
         if mapping is None:
-            if labels is not None:
+            if isinstance(labels, LabelBuffer):
+                mapping = LabelIndex(labels)
+            elif labels is not None:
                 # map labels to sequence index
                 self._mapping = mapping = {}
                 for index, label in enumerate(labels):
@@ -71,6 +203,8 @@ class MSA(object):
             self._labels = [None] * numseq
 
         self._msa = msa
+        self._codes = None
+        self._weights = {}
         self._title = str(title) or 'Unknown'
         self._split = bool(kwargs.get('split', True))
 
@@ -278,6 +412,20 @@ class MSA(object):
 
         return self._msa
 
+    def _getCodes(self):
+        """Return residue code array that has a row for each column of the
+        MSA.  Codes are calculated once and shared by analysis functions.
+        **None** is returned for an unaligned MSA."""
+
+        if not self._aligned:
+            return None
+        if self._codes is None:
+            from .msatools import msaencode
+            number, length = self._msa.shape
+            self._codes = msaencode(self._msa,
+                                    empty((length, number), 'uint8'))
+        return self._codes
+
     def getIndex(self, label):
         """Return index of the sequence that *label* maps onto.  If *label*
         maps onto multiple sequences or *label* is a list of labels, a list
@@ -368,7 +516,12 @@ def refineMSA(msa, label=None, rowocc=None, seqid=None, colocc=None, **kwargs):
     The order of refinements are applied in the order of arguments.  If *label*
     and *unique* is specified is specified, sequence matching *label* will
     be kept in the refined :class:`.MSA` although it may be similar to some
-    other sequence."""
+    other sequence.
+
+    Refinements are applied to masks of rows and columns in a single native
+    pass per refinement, and the refined character array is written once.
+    Rows are compared for sequence identity using *n_threads* threads, or
+    all available processors when it is zero or negative."""
 
     # if msa is a char array, it will be refined but label won't work
     try:
@@ -388,7 +541,8 @@ def refineMSA(msa, label=None, rowocc=None, seqid=None, colocc=None, **kwargs):
         raise ValueError('msa must be a 2D array or an MSA instance')
 
     title = []
-    cols = None
+    number, length = arr.shape
+    cols = ones(length, bool)
     index = None
     if label is not None:
         before = arr.shape[1]
@@ -452,20 +606,20 @@ def refineMSA(msa, label=None, rowocc=None, seqid=None, colocc=None, **kwargs):
                              'so cannot be used for refinement'.format(label))
 
         title.append('label=' + label)
-        cols = char.isalpha(arr[index]).nonzero()[0]
-        arr = arr.take(cols, 1)
+        cols = char.isalpha(arr[index])
         LOGGER.report('Label refinement reduced number of columns from {0} to '
-                      '{1} in %.2fs.'.format(before, arr.shape[1]), '_refine')
+                      '{1} in %.2fs.'.format(before, cols.sum()), '_refine')
 
         if chain is not None and not kwargs.get('keep', False):
-            before = arr.shape[1]
+            before = cols.sum()
             LOGGER.timeit('_refine')
             from prody.proteins.compare import importBioPairwise2
             from prody.proteins.compare import MATCH_SCORE, MISMATCH_SCORE
             from prody.proteins.compare import GAP_PENALTY, GAP_EXT_PENALTY
             pw2 = importBioPairwise2()
             chseq = chain.getSequence()
-            algn = pw2.align.localms(arr[index].tostring().upper(), chseq,
+            algn = pw2.align.localms(arr[index, cols].tostring().upper(),
+                                     chseq,
                                      MATCH_SCORE, MISMATCH_SCORE,
                                      GAP_PENALTY, GAP_EXT_PENALTY,
                                      one_alignment_only=1)
@@ -481,75 +635,71 @@ def refineMSA(msa, label=None, rowocc=None, seqid=None, colocc=None, **kwargs):
             tsum = torf.sum()
             assert tsum <= before, 'problem in mapping sequence to structure'
             if tsum < before:
-                arr = arr.take(torf.nonzero()[0], 1)
+                cols[cols.nonzero()[0][~torf]] = False
                 LOGGER.report('Structure refinement reduced number of '
                               'columns from {0} to {1} in %.2fs.'
-                              .format(before, arr.shape[1]), '_refine')
+                              .format(before, tsum), '_refine')
             else:
                 LOGGER.debug('All residues in the sequence are contained in '
                              'PDB structure {0}.'.format(label))
 
-    from .analysis import calcMSAOccupancy, uniqueSequences
-
-    rows = None
+    steps = {}
     if rowocc is not None:
-        before = arr.shape[0]
-        LOGGER.timeit('_refine')
         try:
             rowocc = float(rowocc)
         except Exception as err:
             raise TypeError('rowocc must be a float ({0})'.format(str(err)))
         assert 0. <= rowocc <= 1., 'rowocc must be between 0 and 1'
-
-        rows = calcMSAOccupancy(arr, 'row') >= rowocc
-        if index is not None:
-            index = rows[:index].sum()
-        rows = (rows).nonzero()[0]
-        arr = arr[rows]
+        steps['rowocc'] = rowocc
         title.append('rowocc>=' + str(rowocc))
-        LOGGER.report('Row occupancy refinement reduced number of rows from '
-                      '{0} to {1} in %.2fs.'.format(before, arr.shape[0]),
-                      '_refine')
 
     if seqid is not None:
-        before = arr.shape[0]
-        LOGGER.timeit('_refine')
-        unique = uniqueSequences(arr, seqid)
-        if index is not None:
-            unique[index] = True
-        unique = unique.nonzero()[0]
-        arr = arr[unique]
+        if not (0 < seqid <= 1):
+            raise ValueError('seqid must satisfy 0 < seqid <= 1')
+        steps['seqid'] = float(seqid)
         title.append('seqid>=' + str(seqid))
-        if rows is not None:
-            rows = rows[unique]
-        else:
-            rows = unique
-        LOGGER.report('Sequence identity refinement reduced number of rows '
-                      'from {0} to {1} in %.2fs.'.format(before, arr.shape[0]),
-                      '_refine')
 
     if colocc is not None:
-        before = arr.shape[1]
-        LOGGER.timeit('_refine')
         try:
             colocc = float(colocc)
         except Exception as err:
             raise TypeError('colocc must be a float ({0})'.format(str(err)))
         assert 0. <= colocc <= 1., 'colocc must be between 0 and 1'
-
-        cols = (calcMSAOccupancy(arr, 'col') >= colocc).nonzero()[0]
-        arr = arr.take(cols, 1)
+        steps['colocc'] = colocc
         title.append('colocc>=' + str(colocc))
-        LOGGER.report('Column occupancy refinement reduced number of columns '
-                      'from {0} to {1} in %.2fs.'.format(before, arr.shape[1]),
-                      '_refine')
 
     if not title:
         raise ValueError('label, rowocc, colocc all cannot be None')
 
-    # depending on slicing of rows, arr may not have it's own memory
-    if arr.base is not None:
-        arr = arr.copy()
+    from .msatools import msarefine, msatake
+    rows = ones(number, bool)
+    before = cols.sum()
+    LOGGER.timeit('_refine')
+    nrows, nuniq, ncols = msarefine(arr, rows, cols,
+                                    index=-1 if index is None else index,
+                                    n_threads=int(kwargs.get('n_threads', 1)),
+                                    **steps)
+    # steps run in a single pass, so each reports the time of that pass
+    if rowocc is not None:
+        LOGGER.report('Row occupancy refinement reduced number of rows from '
+                      '{0} to {1} in %.2fs.'.format(number, nrows),
+                      '_refine')
+    if seqid is not None:
+        LOGGER.report('Sequence identity refinement reduced number of rows '
+                      'from {0} to {1} in %.2fs.'.format(nrows, nuniq),
+                      '_refine')
+    if colocc is not None:
+        LOGGER.report('Column occupancy refinement reduced number of columns '
+                      'from {0} to {1} in %.2fs.'.format(before, ncols),
+                      '_refine')
+
+    cols = cols.nonzero()[0]
+    rows = rows.nonzero()[0]
+    refined = empty((len(rows), len(cols)), '|S1')
+    msatake(arr, rows, cols, refined)
+    arr = refined
+    if rowocc is None and seqid is None:
+        rows = None
 
     if msa is None:
         return arr
@@ -560,7 +710,10 @@ def refineMSA(msa, label=None, rowocc=None, seqid=None, colocc=None, **kwargs):
             mapping = copy(msa._mapping)
         else:
             labels = msa._labels
-            labels = [labels[i] for i in rows]
+            try:
+                labels = labels.take(rows)
+            except AttributeError:
+                labels = [labels[i] for i in rows]
             mapping = None
         return MSA(arr, title=msa.getTitle() + ' refined ({0})'
                    .format(', '.join(title)), labels=labels, mapping=mapping)
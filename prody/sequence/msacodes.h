@@ -0,0 +1,70 @@
+/* Residue codes shared by MSA analysis tools.  An encoded MSA is an
+   unsigned char array with a row for each column of the MSA, i.e. shape
+   is (length, number).  Alphabet characters are stored as ``ch & 63``,
+   so that case insensitive code ``code & CODEMASK`` is 1 for A/a and 26
+   for Z/z, and lower case characters have CODELOWER bit set.  All other
+   characters are gaps and have code 0.  This file is included after
+   numpy/arrayobject.h. */
+
+#ifndef MSACODES_H
+#define MSACODES_H
+
+#define CODEMASK 31
+#define CODELOWER 32
+
+
+static inline unsigned char encodeChar(char ch) {
+
+    /* Return code for an MSA character. */
+
+    if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'))
+        return (unsigned char) (ch & 63);
+    return 0;
+}
+
+
+static inline void encodeMSA(char *seq, unsigned char *codes,
+                             long number, long length) {
+
+    /* Fill *codes* (length x number) for character array *seq*
+       (number x length).  Rows are transposed in blocks to keep both arrays
+       in cache. */
+
+    long i, j, ibeg, iend, jbeg, jend, block = 64;
+    for (ibeg = 0; ibeg < number; ibeg += block) {
+        iend = ibeg + block < number ? ibeg + block : number;
+        for (jbeg = 0; jbeg < length; jbeg += block) {
+            jend = jbeg + block < length ? jbeg + block : length;
+            for (i = ibeg; i < iend; i++)
+                for (j = jbeg; j < jend; j++)
+                    codes[j * number + i] = encodeChar(seq[i * length + j]);
+        }
+    }
+}
+
+
+static inline int checkCodes(PyObject *codes, long number, long length) {
+
+    /* Return 1 when *codes* is None or an encoded MSA for an MSA of shape
+       (number, length), i.e. a C contiguous uint8 array of shape (length,
+       number), or 0 and set an exception. */
+
+    PyArrayObject *array = (PyArrayObject *) codes;
+    if (codes == Py_None)
+        return 1;
+    if (!PyArray_Check(codes) || PyArray_TYPE(array) != NPY_UINT8 ||
+        !PyArray_IS_C_CONTIGUOUS(array)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "codes must be a C contiguous uint8 array");
+        return 0;
+    }
+    if (PyArray_NDIM(array) != 2 || PyArray_DIMS(array)[0] != length ||
+        PyArray_DIMS(array)[1] != number) {
+        PyErr_SetString(PyExc_ValueError,
+                        "codes must have a row for each column of msa");
+        return 0;
+    }
+    return 1;
+}
+
+#endif
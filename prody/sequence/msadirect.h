@@ -0,0 +1,624 @@
+/* Direct information kernels for a correlation matrix of REAL elements.  This
+   file is included by msatools.c for double and float elements, and vectors
+   of DIVECTOR bytes, with DIRECT(name) defined to name functions of each
+   variant, e.g. DIRECT(factorSPD) is factorSPDDouble for doubles.  Functions
+   are compiled for instruction set extensions given by DITARGET.  Matrices
+   are square with n rows and stored in row-major order.  Their upper
+   triangle (row <= column) holds values, and lower triangle is zero, so that
+   a single matrix is factored and inverted in place, and kernels may work on
+   chunks of columns that cross the diagonal. */
+
+#ifndef DIPANEL
+#define DIPANEL 32
+#define DITILE 256
+#define DI_NOMEMORY 1
+#define DI_NOTPD 2
+#endif
+
+/* a chunk of DIVEC columns is accumulated in 4 vectors for each row */
+#define DILANES (DIVECTOR / (long) sizeof(REAL))
+#define DIVEC (4 * DILANES)
+
+#ifdef __GNUC__
+typedef REAL DIRECT(Vector) __attribute__((vector_size(DIVECTOR)));
+#endif
+
+
+static DITARGET int DIRECT(fillCovariance)(REAL *c, double *prob,
+                                           unsigned char *rows, double *w,
+                                           long number, long stride, long l,
+                                           int q, double pseudocount_weight,
+                                           int n_threads) {
+
+    /* Fill *prob* (l x q) with single site and upper triangle of *c* with
+       connected correlations of states 0 to q-2 for each pair of columns,
+       and zero lower triangle of *c*.
+       Residue indices are in *rows* and normalized weights in *w*.  Pairs
+       of columns are counted by *n_threads* threads, each using its own
+       joint probability table.  Return 0 on memory allocation failure. */
+
+    long i, j, k, n = l * (q - 1);
+    double pseudo = pseudocount_weight / q, weight = 1. - pseudocount_weight;
+    int failed = 0;
+
+    for (i = 0; i < l * q; i++)
+        prob[i] = pseudo;
+    for (k = 0; k < number; k++)
+        for (j = 0; j < l; j++)
+            prob[j * q + rows[k * stride + j]] += weight * w[k];
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads) private(i, j, k)
+    #endif
+    {
+        double *joint = malloc(q * q * sizeof(double));
+        long k1, k2;
+        REAL *ci;
+        if (!joint) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 1)
+        #endif
+        for (i = 0; i < l; i++) {
+            if (!joint)
+                continue;
+            for (j = i; j < l; j++) {
+                if (i == j) {
+                    for (k = 0; k < q * q; k++)
+                        joint[k] = 0.;
+                    for (k = 0; k < q; k++)
+                        joint[k * q + k] = pseudo;
+                } else {
+                    for (k = 0; k < q * q; k++)
+                        joint[k] = pseudo / q;
+                }
+                for (k = 0; k < number; k++)
+                    joint[rows[k * stride + i] * q + rows[k * stride + j]] +=
+                        weight * w[k];
+
+                for (k1 = 0; k1 < q - 1; k1++) {
+                    ci = c + (size_t) ((q - 1) * i + k1) * n + (q - 1) * j;
+                    for (k2 = 0; k2 < q - 1; k2++)
+                        ci[k2] = (REAL) (joint[k1 * q + k2] -
+                                         prob[i * q + k1] * prob[j * q + k2]);
+                }
+            }
+            /*Lower triangle is zeroed for kernels that work on chunks.*/
+            for (k1 = 0; k1 < q - 1; k1++) {
+                ci = c + (size_t) ((q - 1) * i + k1) * n;
+                for (k2 = 0; k2 < (q - 1) * i + k1; k2++)
+                    ci[k2] = 0;
+            }
+        }
+        free(joint);
+    }
+    return !failed;
+}
+
+
+static DITARGET void DIRECT(subtractChunk)(REAL *c0, REAL *c1, REAL *a0,
+                                           REAL *a1, long inc, REAL *b,
+                                           long ldb, long k, long m) {
+
+    /* Subtract sum of a0[p*inc] * b[p*ldb + j] over p < k from c0[j] for
+       j < m <= DIVEC, and the same for c1 and a1 unless c1 is NULL.  Full
+       chunks are accumulated in vector registers when compiler supports
+       vector types. */
+
+    long j, p;
+
+    #ifdef __GNUC__
+    if (m == DIVEC) {
+        /*Accumulators are named, so that they are kept in registers
+          without relying on loop unrolling.*/
+        DIRECT(Vector) x0, x1, x2, x3, y0, y1, y2, y3, b0, b1, b2, b3;
+        REAL *bp, f;
+        memcpy(&x0, c0, sizeof(x0));
+        memcpy(&x1, c0 + DILANES, sizeof(x0));
+        memcpy(&x2, c0 + 2 * DILANES, sizeof(x0));
+        memcpy(&x3, c0 + 3 * DILANES, sizeof(x0));
+        y0 = y1 = y2 = y3 = x0;
+        if (c1) {
+            memcpy(&y0, c1, sizeof(x0));
+            memcpy(&y1, c1 + DILANES, sizeof(x0));
+            memcpy(&y2, c1 + 2 * DILANES, sizeof(x0));
+            memcpy(&y3, c1 + 3 * DILANES, sizeof(x0));
+        }
+        for (p = 0; p < k; p++) {
+            bp = b + p * ldb;
+            memcpy(&b0, bp, sizeof(x0));
+            memcpy(&b1, bp + DILANES, sizeof(x0));
+            memcpy(&b2, bp + 2 * DILANES, sizeof(x0));
+            memcpy(&b3, bp + 3 * DILANES, sizeof(x0));
+            f = a0[p * inc];
+            x0 -= f * b0;
+            x1 -= f * b1;
+            x2 -= f * b2;
+            x3 -= f * b3;
+            if (c1) {
+                f = a1[p * inc];
+                y0 -= f * b0;
+                y1 -= f * b1;
+                y2 -= f * b2;
+                y3 -= f * b3;
+            }
+        }
+        memcpy(c0, &x0, sizeof(x0));
+        memcpy(c0 + DILANES, &x1, sizeof(x0));
+        memcpy(c0 + 2 * DILANES, &x2, sizeof(x0));
+        memcpy(c0 + 3 * DILANES, &x3, sizeof(x0));
+        if (c1) {
+            memcpy(c1, &y0, sizeof(x0));
+            memcpy(c1 + DILANES, &y1, sizeof(x0));
+            memcpy(c1 + 2 * DILANES, &y2, sizeof(x0));
+            memcpy(c1 + 3 * DILANES, &y3, sizeof(x0));
+        }
+        return;
+    }
+    #endif
+    for (j = 0; j < m; j++)
+        for (p = 0; p < k; p++) {
+            c0[j] -= a0[p * inc] * b[p * ldb + j];
+            if (c1)
+                c1[j] -= a1[p * inc] * b[p * ldb + j];
+        }
+}
+
+
+static DITARGET void DIRECT(subtractPacked)(REAL *c, long ldc, long rows,
+                                            REAL *a, long lda, REAL *packed,
+                                            long k, long m) {
+
+    /* Subtract products of *rows* rows of *a*, each with *k* contiguous
+       elements, and a packed k x m matrix from rows of *c*, two rows at a
+       time. */
+
+    long r, j;
+    REAL *cr, *ar;
+    for (r = 0; r < rows; r += 2) {
+        cr = c + (size_t) r * ldc;
+        ar = a + (size_t) r * lda;
+        for (j = 0; j < m; j += DIVEC)
+            DIRECT(subtractChunk)(cr + j, r + 1 < rows ? cr + ldc + j : NULL,
+                                  ar, ar + lda, 1, packed + j * k, DIVEC, k,
+                                  m - j < DIVEC ? m - j : DIVEC);
+    }
+}
+
+
+static DITARGET void DIRECT(packRows)(REAL *packed, REAL *b, long ldb,
+                                      long k, long m, int layout) {
+
+    /* Copy a k x m block of *b* into *packed*, so that blocks of rows far
+       apart in memory are read only once.  When *layout* is 0, block is
+       copied as chunks of DIVEC columns, each with k contiguous rows, and
+       last chunk is padded with zeros.  When it is 1, transpose of a m x k
+       block is copied the same way.  When it is 2, block is transposed into
+       m contiguous rows of k elements. */
+
+    long p, j, u, chunks = (m + DIVEC - 1) / DIVEC * DIVEC;
+    if (layout == 2) {
+        for (p = 0; p < k; p++)
+            for (j = 0; j < m; j++)
+                packed[j * k + p] = b[(size_t) p * ldb + j];
+        return;
+    }
+    for (j = m; j < chunks; j++)
+        for (p = 0; p < k; p++)
+            packed[(j / DIVEC * k + p) * DIVEC + j % DIVEC] = 0;
+    if (layout) {
+        for (j = 0; j < m; j++)
+            for (p = 0; p < k; p++)
+                packed[(j / DIVEC * k + p) * DIVEC + j % DIVEC] =
+                    b[(size_t) j * ldb + p];
+    } else {
+        for (p = 0; p < k; p++)
+            for (j = 0; j < m; j += DIVEC)
+                for (u = 0; u < DIVEC && j + u < m; u++)
+                    packed[(j / DIVEC * k + p) * DIVEC + u] =
+                        b[(size_t) p * ldb + j + u];
+    }
+}
+
+
+static DITARGET void DIRECT(updateTrailing)(REAL *a, REAL *packed, long n,
+                                            long k0, long k1,
+                                            int n_threads) {
+
+    /* Subtract outer products of factored rows k0 to k1-1 from the upper
+       triangle of rows k1 and after.  Factored rows and their transpose are
+       packed into *packed*, which must have room for 2 * DIPANEL * (n +
+       DIPANEL) elements.  Panels of rows are updated by *n_threads* threads,
+       a tile of columns at a time, and products that cross the diagonal are
+       zeroed afterwards. */
+
+    long i0, k = k1 - k0, m = n - k1;
+    REAL *trans = packed + (size_t) k * (m + DIVEC);
+
+    DIRECT(packRows)(packed, a + (size_t) k0 * n + k1, n, k, m, 0);
+    DIRECT(packRows)(trans, a + (size_t) k0 * n + k1, n, k, m, 2);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1)
+    #endif
+    for (i0 = k1; i0 < n; i0 += DIPANEL) {
+        long i, j, j0, rows = i0 + DIPANEL < n ? DIPANEL : n - i0;
+        for (j0 = i0; j0 < n; j0 += DITILE)
+            DIRECT(subtractPacked)(a + (size_t) i0 * n + j0, n, rows,
+                                   trans + (i0 - k1) * k, k,
+                                   packed + (j0 - k1) * k, k,
+                                   j0 + DITILE < n ? DITILE : n - j0);
+        for (i = i0; i < i0 + rows; i++)
+            for (j = i0; j < i; j++)
+                a[(size_t) i * n + j] = 0;
+    }
+}
+
+
+static DITARGET int DIRECT(factorSPD)(REAL *a, REAL *packed, long n,
+                                      int n_threads) {
+
+    /* Overwrite upper triangle of *a* with upper triangular U, such that
+       a = U'U.  Rows are factored in panels of DIPANEL rows, which then
+       update the rest of the matrix using *packed* as in updateTrailing.
+       Return 0 when *a* is not positive definite. */
+
+    long i, j, k, k0, k1;
+    REAL d, f, *ai, *ak;
+
+    for (k0 = 0; k0 < n; k0 += DIPANEL) {
+        k1 = k0 + DIPANEL < n ? k0 + DIPANEL : n;
+        for (k = k0; k < k1; k++) {
+            ak = a + (size_t) k * n;
+            if (!(ak[k] > 0))
+                return 0;
+            d = (REAL) sqrt(ak[k]);
+            ak[k] = d;
+            for (j = k + 1; j < n; j++)
+                ak[j] /= d;
+            for (i = k + 1; i < k1; i++) {
+                f = ak[i];
+                ai = a + (size_t) i * n;
+                for (j = i; j < n; j++)
+                    ai[j] -= f * ak[j];
+            }
+        }
+        DIRECT(updateTrailing)(a, packed, n, k0, k1, n_threads);
+    }
+    return 1;
+}
+
+
+static DITARGET void DIRECT(invertUpper)(REAL *a, REAL *saved, long n,
+                                         int n_threads) {
+
+    /* Overwrite upper triangular *a*, whose lower triangle is zero, with its
+       negated inverse.  Rows are inverted in panels from the bottom up,
+       using rows below the panel that are already inverted.  *saved* must
+       have room for DIPANEL rows, where rows of the panel are saved before
+       they are overwritten. */
+
+    long i, j, p, b0, b1, j0;
+    REAL d, f, *ai, *ap, *si;
+
+    for (b1 = n; b1 > 0; b1 = b0) {
+        b0 = b1 > DIPANEL ? b1 - DIPANEL : 0;
+        for (i = b0; i < b1; i++) {
+            ai = a + (size_t) i * n;
+            si = saved + (size_t) (i - b0) * n;
+            for (j = i; j < n; j++) {
+                si[j] = ai[j];
+                ai[j] = 0;
+            }
+        }
+
+        /*Rows below the panel are zero left of the diagonal, and they are
+          packed a block at a time for each tile of columns.*/
+        #ifdef _OPENMP
+        #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1)
+        #endif
+        for (j0 = b1; j0 < n; j0 += DITILE) {
+            long p0, kp, jw = j0 + DITILE < n ? DITILE : n - j0;
+            REAL packed[DIPANEL * DITILE];
+            for (p0 = b1; p0 < j0 + jw; p0 += DIPANEL) {
+                kp = p0 + DIPANEL < j0 + jw ? DIPANEL : j0 + jw - p0;
+                DIRECT(packRows)(packed, a + (size_t) p0 * n + j0, n, kp, jw,
+                                 0);
+                DIRECT(subtractPacked)(a + (size_t) b0 * n + j0, n, b1 - b0,
+                                       saved + p0, n, packed, kp, jw);
+            }
+        }
+
+        for (i = b1 - 1; i >= b0; i--) {
+            ai = a + (size_t) i * n;
+            si = saved + (size_t) (i - b0) * n;
+            for (p = i + 1; p < b1; p++) {
+                f = si[p];
+                ap = a + (size_t) p * n;
+                for (j = p; j < n; j++)
+                    ai[j] -= f * ap[j];
+            }
+            d = 1 / si[i];
+            ai[i] = -d;
+            for (j = i + 1; j < n; j++)
+                ai[j] *= d;
+        }
+    }
+}
+
+
+static DITARGET void DIRECT(multiplyUpper)(REAL *a, REAL *saved, long n,
+                                           int n_threads) {
+
+    /* Overwrite upper triangular *a*, V, whose lower triangle is zero, with
+       upper triangle of VV'.  A panel of rows is calculated into *saved*,
+       which must have room for DIPANEL rows, and copied back when rows below
+       it are no longer needed.  Rows that make a tile of columns of V' are
+       packed a block at a time. */
+
+    long i, j, b0, b1, j0;
+
+    for (b0 = 0; b0 < n; b0 += DIPANEL) {
+        b1 = b0 + DIPANEL < n ? b0 + DIPANEL : n;
+
+        #ifdef _OPENMP
+        #pragma omp parallel for num_threads(n_threads) schedule(dynamic, 1) \
+            private(i, j)
+        #endif
+        for (j0 = b0; j0 < n; j0 += DITILE) {
+            long p0, kp, jw = j0 + DITILE < n ? DITILE : n - j0;
+            long rows = (b1 < j0 + jw ? b1 : j0 + jw) - b0;
+            REAL packed[DIPANEL * DITILE];
+            for (i = 0; i < rows; i++)
+                for (j = j0; j < j0 + jw; j++)
+                    saved[(size_t) i * n + j] = 0;
+            for (p0 = j0; p0 < n; p0 += DIPANEL) {
+                kp = p0 + DIPANEL < n ? DIPANEL : n - p0;
+                DIRECT(packRows)(packed, a + (size_t) j0 * n + p0, n, kp, jw,
+                                 1);
+                DIRECT(subtractPacked)(saved + j0, n, rows,
+                                       a + (size_t) b0 * n + p0, n, packed,
+                                       kp, jw);
+            }
+        }
+
+        /*Products were subtracted from zero.*/
+        for (i = b0; i < b1; i++)
+            for (j = i; j < n; j++)
+                a[(size_t) i * n + j] = -saved[(size_t) (i - b0) * n + j];
+    }
+}
+
+
+static DITARGET int DIRECT(calcDirectInfo)(double *di, pairheap *top,
+                                           REAL *c, double *prob,
+                                           int *iterations, long l, int q,
+                                           double epsilon, int n_threads) {
+
+    /* Fill *di* (l x l) using inverted correlations in upper triangle of
+       *c* and single site probabilities *prob*, or push pairs into *top*
+       heap when it is not NULL.  Pairs are distributed over threads, each
+       with its own scratch arrays and heap.  Number of iterations needed by
+       each pair is written to *iterations* when it is not NULL.  Return 0
+       on memory allocation failure. */
+
+    long i, n = l * (q - 1);
+    int failed = 0;
+    double *logprob = malloc((l * q + 1) * sizeof(double));
+    if (!logprob)
+        return 0;
+
+    /*Probabilities are zero only when pseudo count weight is zero, and then
+      so are the corresponding pair probabilities, so their terms vanish.*/
+    for (i = 0; i < l * q; i++)
+        logprob[i] = prob[i] > 0 ? log(prob[i]) : 0;
+    for (i = 0; i < l; i++) {
+        if (!top)
+            di[i * l + i] = 0;
+        if (iterations)
+            iterations[i * l + i] = 0;
+    }
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+    long i, j, k1, k2;
+    int count;
+    double diff, sum1, sum2, z, lz, sumdi, f, *row;
+    double *e = malloc((2 * q * q + 6 * q) * sizeof(double));
+    double *et = e + q * q, *mu1 = et + q * q, *mu2 = mu1 + q;
+    double *scra1 = mu2 + q, *scra2 = scra1 + q;
+    double *lmu1 = scra2 + q, *lmu2 = lmu1 + q;
+    double *pi, *pj, *lpi, *lpj;
+    REAL *cij;
+    pairheap heap;
+    int ready = !top || allocHeaps(&heap, top, 1);
+    if (!e || !ready) {
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        failed = 1;
+    }
+
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic,1)
+    #endif
+    for (i = 0; i < l; i++) {
+        if (!e || !ready)
+            continue;
+        pi = prob + i * q;
+        lpi = logprob + i * q;
+        for (j = i + 1; j < l; j++) {
+            if (top && j - i < top->separation)
+                continue;
+            pj = prob + j * q;
+            lpj = logprob + j * q;
+
+            /*Pair weights are exp(-c) for the first q-1 states and 1 for
+              the last, kept as rows and as columns so that both halves of
+              the fixed-point update run over contiguous memory.*/
+            for (k1 = 0; k1 < q - 1; k1++) {
+                cij = c + (size_t) ((q - 1) * i + k1) * n + (q - 1) * j;
+                row = e + k1 * q;
+                for (k2 = 0; k2 < q - 1; k2++)
+                    row[k2] = exp(-(double) cij[k2]);
+                row[q - 1] = 1.;
+            }
+            for (k2 = 0; k2 < q; k2++)
+                e[(q - 1) * q + k2] = 1.;
+            for (k1 = 0; k1 < q; k1++)
+                for (k2 = 0; k2 < q; k2++)
+                    et[k2 * q + k1] = e[k1 * q + k2];
+            for (k1 = 0; k1 < q; k1++) {
+                mu1[k1] = 1. / q;
+                mu2[k1] = 1. / q;
+            }
+
+            diff = 1.0;
+            count = 0;
+            while (diff > epsilon) {
+                count++;
+                for (k1 = 0; k1 < q; k1++) {
+                    scra1[k1] = 0.0;
+                    scra2[k1] = 0.0;
+                }
+                for (k2 = 0; k2 < q; k2++) {
+                    f = mu2[k2];
+                    row = et + k2 * q;
+                    for (k1 = 0; k1 < q; k1++)
+                        scra1[k1] += f * row[k1];
+                    f = mu1[k2];
+                    row = e + k2 * q;
+                    for (k1 = 0; k1 < q; k1++)
+                        scra2[k1] += f * row[k1];
+                }
+                sum1 = 0.0;
+                sum2 = 0.0;
+                for (k1 = 0; k1 < q; k1++) {
+                    scra1[k1] = pi[k1] / scra1[k1];
+                    sum1 += scra1[k1];
+                    scra2[k1] = pj[k1] / scra2[k1];
+                    sum2 += scra2[k1];
+                }
+                diff = -1.0;
+                for (k1 = 0; k1 < q; k1++) {
+                    scra1[k1] /= sum1;
+                    scra2[k1] /= sum2;
+                    if (fabs(mu1[k1] - scra1[k1]) > diff)
+                        diff = fabs(mu1[k1] - scra1[k1]);
+                    if (fabs(mu2[k1] - scra2[k1]) > diff)
+                        diff = fabs(mu2[k1] - scra2[k1]);
+                    mu1[k1] = scra1[k1];
+                    mu2[k1] = scra2[k1];
+                }
+            }
+
+            /*Pair probability is e * mu1 * mu2 / z, so its logarithm needs
+              only the logarithms of the 2q fields and of z, the exponent
+              being the correlation itself.*/
+            z = 0.0;
+            for (k1 = 0; k1 < q; k1++) {
+                f = 0.0;
+                row = e + k1 * q;
+                for (k2 = 0; k2 < q; k2++)
+                    f += row[k2] * mu2[k2];
+                z += f * mu1[k1];
+                lmu1[k1] = mu1[k1] > 0 ? log(mu1[k1]) - lpi[k1] : 0;
+                lmu2[k1] = mu2[k1] > 0 ? log(mu2[k1]) - lpj[k1] : 0;
+            }
+            lz = log(z);
+            sumdi = 0.0;
+            for (k1 = 0; k1 < q; k1++) {
+                row = e + k1 * q;
+                f = mu1[k1] / z;
+                sum1 = 0.0;
+                if (k1 < q - 1) {
+                    cij = c + (size_t) ((q - 1) * i + k1) * n + (q - 1) * j;
+                    for (k2 = 0; k2 < q - 1; k2++)
+                        sum1 += row[k2] * mu2[k2] *
+                                (lmu2[k2] - (double) cij[k2]);
+                } else
+                    for (k2 = 0; k2 < q - 1; k2++)
+                        sum1 += row[k2] * mu2[k2] * lmu2[k2];
+                sum1 += row[q - 1] * mu2[q - 1] * lmu2[q - 1];
+                sum2 = 0.0;
+                for (k2 = 0; k2 < q; k2++)
+                    sum2 += row[k2] * mu2[k2];
+                sumdi += f * (sum1 + sum2 * (lmu1[k1] - lz));
+            }
+
+            if (top)
+                pushPair(&heap, sumdi, i, j);
+            else
+                di[i * l + j] = di[j * l + i] = sumdi;
+            if (iterations)
+                iterations[i * l + j] = iterations[j * l + i] = count;
+        }
+    }
+    if (top) {
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        mergeHeaps(top, &heap, 1);
+    }
+    free(e);
+    }
+
+    if (top)
+        sortHeap(top);
+    free(logprob);
+    return !failed;
+}
+
+
+static DITARGET int DIRECT(directInfo)(double *di, pairheap *top,
+                                       unsigned char *rows, double *w,
+                                       long number, long stride, long l,
+                                       int q, double pseudocount_weight,
+                                       double epsilon, int *iterations,
+                                       int n_threads) {
+
+    /* Fill *di*, or *top* heap when it is not NULL, for residue indices in
+       *rows* and normalized sequence weights *w*.  Correlation matrix is the only buffer of quadratic size in number
+       of states, and it is inverted in place.  Return DI_NOMEMORY on memory
+       allocation failure and DI_NOTPD when correlation matrix is not positive
+       definite, or 0 on success. */
+
+    long n = l * (q - 1);
+    int status = 0;
+    REAL *c = malloc(((size_t) n * n + 1) * sizeof(REAL));
+    REAL *saved = malloc((size_t) 2 * DIPANEL * (n + DIPANEL) * sizeof(REAL));
+    double *prob = malloc((l * q + 1) * sizeof(double));
+
+    if (!c || !saved || !prob ||
+        !DIRECT(fillCovariance)(c, prob, rows, w, number, stride, l, q,
+                                pseudocount_weight, n_threads))
+        status = DI_NOMEMORY;
+    else if (!DIRECT(factorSPD)(c, saved, n, n_threads))
+        status = DI_NOTPD;
+    else {
+        DIRECT(invertUpper)(c, saved, n, n_threads);
+        DIRECT(multiplyUpper)(c, saved, n, n_threads);
+        if (!DIRECT(calcDirectInfo)(di, top, c, prob, iterations, l, q,
+                                    epsilon, n_threads))
+            status = DI_NOMEMORY;
+    }
+    free(c);
+    free(saved);
+    free(prob);
+    return status;
+}
+
+
+#undef DILANES
+#undef DIVEC
+#undef REAL
+#undef DIRECT
+#undef DIVECTOR
+#undef DITARGET
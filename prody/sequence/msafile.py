@@ -4,9 +4,14 @@ analyzing multiple sequence alignments."""
 
 __author__ = 'Anindita Dutta, Ahmet Bakan'
 
-from os.path import isfile, splitext, split, getsize
+from os.path import isfile, splitext, split
+from threading import Thread
+try:
+    from queue import Queue, Full
+except ImportError:
+    from Queue import Queue, Full
 
-from numpy import array, fromstring, empty
+from numpy import array, fromstring
 
 from .sequence import splitSeqLabel, Sequence
 
@@ -18,11 +23,14 @@ __all__ = ['MSAFile', 'splitSeqLabel', 'parseMSA', 'writeMSA']
 FASTA = 'FASTA'
 SELEX = 'SELEX'
 STOCKHOLM = 'Stockholm'
+A3M = 'A3M'
 MSAFORMATS = {
     FASTA.lower(): FASTA,
     SELEX.lower(): SELEX,
     STOCKHOLM.lower(): STOCKHOLM,
 }
+# A3M files are only parsed, by parseMSA
+A3MEXTS = ('.a3m', '.a2m')
 MSAEXTMAP = {
     FASTA: '.fasta',
     SELEX: '.slx',
@@ -35,6 +43,8 @@ MSAEXTMAP = {
     '.fasta': FASTA
 }
 
+COMPRESSED = ('.gz', '.bz2', '.xz')
+
 WSJOIN = ' '.join
 ESJOIN = ''.join
 
@@ -466,14 +476,107 @@ class MSAFile(object):
             write(self._selex_line.format(label, sequence))
 
 
+def openCompressed(filename):
+    """Return a binary file object that decompresses gzip, bzip2, or xz
+    compressed *filename*."""
+
+    ext = splitext(filename)[1].lower()
+    if ext == '.gz':
+        from gzip import GzipFile as CompressedFile
+    elif ext == '.bz2':
+        from bz2 import BZ2File as CompressedFile
+    else:
+        try:
+            from lzma import LZMAFile as CompressedFile
+        except ImportError:
+            raise IOError('lzma module is required for parsing xz '
+                          'compressed file ' + repr(filename))
+    return CompressedFile(filename, 'rb')
+
+
+class BlockReader(object):
+
+    """Decompress a compressed file in a thread, *blocksize* bytes at a
+    time, while blocks read before are parsed.  At most *ahead* blocks wait
+    to be read, so that memory for decompressed data is bounded.  zlib,
+    bz2, and lzma modules release the GIL while they decompress, so the
+    thread runs alongside the parser while it releases the GIL too."""
+
+    def __init__(self, filename, blocksize=1 << 24, ahead=2):
+
+        self._stream = openCompressed(filename)
+        self._queue = Queue(ahead)
+        self._stopped = False
+        self._thread = Thread(target=self._decompress, args=(blocksize,))
+        self._thread.daemon = True
+        self._thread.start()
+
+    def _decompress(self, blocksize):
+
+        try:
+            block = True
+            while block and not self._stopped:
+                block = self._stream.read(blocksize)
+                self._put(block)
+        except Exception as err:
+            self._put(err)
+
+    def _put(self, item):
+
+        while not self._stopped:
+            try:
+                self._queue.put(item, timeout=.1)
+            except Full:
+                continue
+            break
+
+    def read(self):
+        """Return next block of decompressed data, or an empty bytes object
+        at the end of the file."""
+
+        item = self._queue.get()
+        if isinstance(item, Exception):
+            raise item
+        return item
+
+    def close(self):
+        """Stop decompressing and close the file."""
+
+        self._stopped = True
+        self._thread.join()
+        self._stream.close()
+
+
 def parseMSA(filename, **kwargs):
     """Return an :class:`.MSA` instance that stores multiple sequence alignment
-    and sequence labels parsed from Stockholm, SELEX, or FASTA format
-    *filename* file, which may be a compressed file. Uncompressed MSA files
-    are parsed using C code at a fraction of the time it would take to parse
-    compressed files in Python."""
-
-    from .msa import MSA
+    and sequence labels parsed from Stockholm, SELEX, FASTA, or A3M format
+    *filename* file, which may be a gzip, bzip2, or xz compressed file.
+    MSA files are parsed using C code at a fraction of the time it would
+    take to parse them in Python.  Stockholm and SELEX files may be
+    interleaved in blocks, and lower case residues and dots of insert
+    states are dropped from A3M (:file:`.a3m`) and A2M (:file:`.a2m`)
+    files.  *filter*, *filter_full*, and *slice* arguments of
+    :class:`.MSAFile` are applied while the file is parsed, so that
+    sequences and columns that are filtered out are never copied.
+
+    Uncompressed files are mapped into memory.  Compressed files are
+    decompressed in 16 MB blocks by a thread while earlier blocks are
+    parsed, without temporary files, and only labels and residues of parsed
+    sequences are kept.  Residues of FASTA and A3M files become the array
+    without a copy, unless *filter* or *slice* is given, so these files take
+    about as much memory as uncompressed ones.  Residues of Stockholm and
+    SELEX files are copied into the array, which may double the memory
+    needed for them.
+
+    Contents are split into chunks at sequence boundaries, which are parsed
+    by *n_threads* threads, or all available processors when it is zero or
+    negative.  When *lazy* is **True**, labels are kept in one bytes
+    object, and a string is created for a label only when it is accessed,
+    so that labels of millions of sequences are parsed without creating
+    Python objects.  Labels are then indexed in a hash table, built in C
+    when a label is first looked up, e.g. by :meth:`.MSA.getIndex`."""
+
+    from .msa import MSA, LabelBuffer
 
     try:
         fileok = isfile(filename)
@@ -484,18 +587,19 @@ def parseMSA(filename, **kwargs):
             raise IOError('[Errno 2] No such file or directory: ' +
                           repr(filename))
 
-    # if MSA is a compressed file or filter/slice is passed, use
-    #   Python parsers
+    # if MSA is not aligned, use Python parsers
 
     LOGGER.timeit('_parsemsa')
 
     title, ext = splitext(filename)
     title = split(title)[1]
+    compressed = ext.lower() in COMPRESSED
+    if compressed:
+        title, ext = splitext(title)
     aligned = kwargs.get('aligned', True)
-    if (ext.lower() == '.gz' or 'filter' in kwargs or 'slice' in kwargs or
-            not aligned):
-        if ext.lower() == '.gz':
-            title = splitext(title)[0]
+    n_threads = kwargs.pop('n_threads', 1)
+    lazy = kwargs.pop('lazy', False)
+    if not aligned:
         msa = MSAFile(filename, split=False, **kwargs)
         seqlist = []
         sappend = seqlist.append
@@ -528,18 +632,44 @@ def parseMSA(filename, **kwargs):
         else:
             msaarr = array(seqlist, '|S' + str(maxlen))
     else:
-        filesize = getsize(filename)
-        format = MSAEXTMAP.get(splitext(filename)[1])
+        format = kwargs.get('format')
+        if format:
+            format = format.lower()
+            format = A3M if format == 'a3m' else MSAFORMATS.get(format)
+        elif ext.lower() in A3MEXTS:
+            format = A3M
+        else:
+            format = MSAEXTMAP.get(ext)
 
         if format == FASTA:
             from .msaio import parseFasta as parser
         elif format == SELEX or format == STOCKHOLM:
             from .msaio import parseSelex as parser
+        elif format == A3M:
+            from .msaio import parseA3M as parser
         else:
             raise IOError('MSA file format is not recognized from the '
                           'extension')
-        msaarr = empty(filesize, '|S1')
-        msaarr, labels, mapping, lcount = parser(filename, msaarr)
+        reader = BlockReader(filename) if compressed else None
+        options = dict(n_threads=int(n_threads),
+                       filter=kwargs.get('filter'),
+                       filter_full=int(bool(kwargs.get('filter_full'))),
+                       slice=kwargs.get('slice'),
+                       read=reader.read if reader else None)
+        try:
+            if lazy:
+                msaarr, labels, lcount = parser(filename, lazy=True,
+                                                **options)
+                labels = LabelBuffer(*labels)
+                mapping = None
+            else:
+                msaarr, labels, mapping, lcount = parser(filename, **options)
+        finally:
+            if reader:
+                reader.close()
+        if not len(msaarr):
+            LOGGER.warn('No sequences were parsed from {0}.'.format(filename))
+            return
         if lcount != len(msaarr):
             LOGGER.warn('Failed to parse {0} sequence labels.'
                         .format(len(msaarr) - lcount))
@@ -608,13 +738,16 @@ def writeMSA(filename, msa, **kwargs):
     else:
         from prody.utilities import backupFile
         backupFile(filename)
+        labels = msa._labels
+        if not isinstance(labels, list):
+            labels = list(labels)
         if format == FASTA:
             from .msaio import writeFasta
-            writeFasta(filename, msa._labels, seqarr,
+            writeFasta(filename, labels, seqarr,
                        kwargs.get('line_length', LEN_FASTA_LINE))
         else:
             from .msaio import writeSelex
-            writeSelex(filename, msa._labels, seqarr,
+            writeSelex(filename, labels, seqarr,
                        stockholm=format != SELEX,
                        label_length=kwargs.get('label_length',
                                                LEN_SELEX_LABEL))
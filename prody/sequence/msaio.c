@@ -1,9 +1,21 @@
 #include "Python.h"
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include "numpy/arrayobject.h"
+#ifdef _WIN32
+#define MSAIO_NOMMAP
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #define LENLABEL 100
-#define FASTALINELEN 1000
-#define SELEXLINELEN 10000
+#define FORMAT_FASTA 0
+#define FORMAT_SELEX 1
+#define FORMAT_A3M 2
 
 static char *intcat(char *msg, int line) {
 
@@ -16,13 +28,14 @@ static char *intcat(char *msg, int line) {
 }
 
 
-static int parseLabel(PyObject *labels, PyObject *mapping, char *line,
-                      int length) {
+static long labelLength(char *line, long length, long *key) {
 
-    /* Append label to *labels*, extract identifier, and index label
-       position in the list. Return 1 when successful, 0 on failure. */
+    /* Return length of label in *line*, which ends at a control character,
+       and set length of the identifier used for indexing it, which ends at
+       a slash followed by residue numbers, to *key*. */
 
-    int i, ch, slash = 0, dash = 0;//, ipipe = 0, pipes[4] = {0, 0, 0, 0};
+    long i, slash = 0, dash = 0;//, ipipe = 0, pipes[4] = {0, 0, 0, 0};
+    int ch;
 
     for (i = 0; i < length; i++) {
         ch = line[i];
@@ -35,6 +48,19 @@ static int parseLabel(PyObject *labels, PyObject *mapping, char *line,
         //else if (line[i] == '|' && ipipe < 4)
         //    pipes[ipipe++] = i;
     }
+    *key = slash > 0 && dash > slash ? slash : i;
+    return i;
+}
+
+
+static int parseLabel(PyObject *labels, PyObject *mapping, char *line,
+                      int length) {
+
+    /* Append label to *labels*, extract identifier, and index label
+       position in the list. Return 1 when successful, 0 on failure. */
+
+    long i, key;
+    i = labelLength(line, length, &key);
 
     PyObject *label, *index;
     #if PY_MAJOR_VERSION >= 3
@@ -55,12 +81,12 @@ static int parseLabel(PyObject *labels, PyObject *mapping, char *line,
         return 0;
     }
 
-    if (slash > 0 && dash > slash) {
+    if (key < i) {
         Py_DECREF(label);
         #if PY_MAJOR_VERSION >= 3
-        label = PyUnicode_FromStringAndSize(line, slash);
+        label = PyUnicode_FromStringAndSize(line, key);
         #else
-        label = PyString_FromStringAndSize(line, slash);
+        label = PyString_FromStringAndSize(line, key);
         #endif
     }
 
@@ -87,82 +113,1085 @@ static int parseLabel(PyObject *labels, PyObject *mapping, char *line,
 }
 
 
-static PyObject *parseFasta(PyObject *self, PyObject *args) {
+static char *mapFile(char *filename, size_t *size) {
 
-    /* Parse sequences from *filename* into the memory pointed by the
-       Numpy array passed as Python object. */
+    /* Return contents of *filename* mapped into memory, or read into it where
+       memory mapping is not available, and set *size*.  Return NULL and set
+       an exception on failure.  An empty file is returned as an empty
+       string.  Release with unmapFile. */
 
-    char *filename;
-    PyArrayObject *msa;
-
-    if (!PyArg_ParseTuple(args, "sO", &filename, &msa))
+    char *data;
+    #ifdef MSAIO_NOMMAP
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+        return NULL;
+    }
+    _fseeki64(file, 0, SEEK_END);
+    *size = (size_t) _ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+    data = malloc(*size + 1);
+    if (!data) {
+        fclose(file);
+        PyErr_NoMemory();
         return NULL;
+    }
+    if (fread(data, 1, *size, file) != *size) {
+        free(data);
+        fclose(file);
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+        return NULL;
+    }
+    fclose(file);
+    #else
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &info) < 0) {
+        if (fd >= 0)
+            close(fd);
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+        return NULL;
+    }
+    *size = (size_t) info.st_size;
+    if (!*size) {
+        close(fd);
+        return "";
+    }
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, filename);
+        return NULL;
+    }
+    #ifdef MADV_SEQUENTIAL
+    madvise(data, *size, MADV_SEQUENTIAL);
+    #endif
+    #endif
+    return data;
+}
 
-    PyObject *labels = PyList_New(0), *mapping = PyDict_New();
-    if (!labels || !mapping)
-        return PyErr_NoMemory();
 
-    char *line = malloc((FASTALINELEN) * sizeof(char));
-    if (!line)
-        return PyErr_NoMemory();
+static void unmapFile(char *data, size_t size) {
 
-    char *data = (char *) PyArray_DATA(msa);
+    /* Release file contents returned by mapFile. */
 
-    int aligned = 1;
-    char ch, errmsg[LENLABEL] = "failed to parse FASTA file at line ";
-    long index = 0, count = 0;
-    long iline = 0, i, seqlen = 0, curlen = 0;
+    #ifdef MSAIO_NOMMAP
+    free(data);
+    #else
+    if (size)
+        munmap(data, size);
+    #endif
+}
 
-    FILE *file = fopen(filename, "rb");
-    while (fgets(line, FASTALINELEN, file) != NULL) {
+
+static char *nextLine(char *line, char *end, size_t *length) {
+
+    /* Return end of *line*, i.e. its newline character or *end*, and set
+       *length* to the number of characters before it, without a trailing
+       carriage return.  memchr scans many characters at a time. */
+
+    char *eol = memchr(line, '\n', end - line);
+    if (!eol)
+        eol = end;
+    *length = eol - line;
+    while (*length && line[*length - 1] == '\r')
+        (*length)--;
+    return eol;
+}
+
+
+typedef struct {
+    char *label;      /* label, or NULL for the end of a block */
+    long lablen;      /* number of characters in label */
+    char *beg, *end;  /* residue lines of a FASTA or A3M record, or sequence
+                         in a line of a SELEX or Stockholm block */
+    long length;      /* number of aligned residues */
+    long line;        /* line of label, counted from the start of a chunk
+                         until chunks are merged */
+} msaRecord;
+
+typedef struct {
+    char *beg, *end;     /* lines of a chunk of data */
+    long lines;          /* number of lines */
+    msaRecord *records;  /* records, or lines of blocks, in the chunk */
+    long count, size;    /* number of records and allocated size */
+    long error;          /* line of the first error, 0 when none, and -1 on
+                            memory allocation failure */
+} msaChunk;
+
+typedef struct {
+    int format;
+    msaRecord *records;  /* records, or lines of blocks, in order */
+    long count;          /* number of records */
+    long number;         /* number of sequences */
+    long length;         /* number of aligned residues */
+    long nblocks;        /* number of SELEX or Stockholm blocks */
+    long *blocks;        /* first record of each block */
+    long *columns;       /* first column of each block */
+} msaLayout;
+
+
+static void splitChunks(char *data, size_t size, msaChunk *chunks,
+                        long nchunks, int format) {
+
+    /* Split *data* into *nchunks* chunks of about the same size that start
+       at the beginning of a line, and for FASTA and A3M formats, of a
+       record.  Some chunks may be empty. */
+
+    char *end = data + size, *pos, *eol;
+    long k;
+    chunks[0].beg = data;
+    for (k = 1; k < nchunks; k++) {
+        pos = data + size / nchunks * k;
+        if (pos < chunks[k - 1].beg)
+            pos = chunks[k - 1].beg;
+        if (pos > data && pos[-1] != '\n') {
+            eol = memchr(pos, '\n', end - pos);
+            pos = eol ? eol + 1 : end;
+        }
+        while (format != FORMAT_SELEX && pos < end && *pos != '>') {
+            eol = memchr(pos, '\n', end - pos);
+            pos = eol ? eol + 1 : end;
+        }
+        chunks[k].beg = chunks[k - 1].end = pos;
+    }
+    chunks[nchunks - 1].end = end;
+}
+
+
+static msaRecord *addRecord(msaChunk *chunk, long iline) {
+
+    /* Return a new record at *iline* of *chunk*, or NULL and set error on
+       memory allocation failure. */
+
+    if (chunk->count == chunk->size) {
+        long size = chunk->size ? chunk->size * 2 : 1024;
+        msaRecord *records = realloc(chunk->records,
+                                     size * sizeof(msaRecord));
+        if (!records) {
+            chunk->error = -1;
+            return NULL;
+        }
+        chunk->records = records;
+        chunk->size = size;
+    }
+    msaRecord *record = chunk->records + chunk->count++;
+    memset(record, 0, sizeof(msaRecord));
+    record->line = iline;
+    return record;
+}
+
+
+static int insertState(char ch) {
+
+    /* Return 1 for characters of A3M and A2M insert states, i.e. lower case
+       residues and gaps shown as dots. */
+
+    return (ch >= 'a' && ch <= 'z') || ch == '.';
+}
+
+
+static void scanFasta(msaChunk *chunk, int format) {
+
+    /* Find records and count their residues in a chunk of FASTA or A3M
+       formatted data, dropping insert states of A3M records, and set the
+       number of the line where residues appear before the first label as
+       error. */
+
+    char *line = chunk->beg, *end = chunk->end, *eol;
+    size_t len, i;
+    long iline = 0;
+    msaRecord *record = NULL;
+    while (line < end && !chunk->error) {
+        eol = nextLine(line, end, &len);
         iline++;
-        if (line[0] == '>') {
-            if (seqlen != curlen) {
-                if (seqlen) {
-                    aligned = 0;
-                    free(line);
-                    free(data);
-                    fclose(file);
-                    PyErr_SetString(PyExc_IOError, intcat(errmsg, iline));
-                    return NULL;
-                } else
-                    seqlen = curlen;
-            }
+        if (len && line[0] == '>') {
+            if (!(record = addRecord(chunk, iline)))
+                break;
             // `line + 1` is to omit `>` character
-            count += parseLabel(labels, mapping, line + 1, FASTALINELEN);
-            curlen = 0;
-        } else {
-            for (i = 0; i < FASTALINELEN; i++) {
-                ch = line[i];
-                if (ch < 32)
-                    break;
-                else {
-                    data[index++] = ch;
-                    curlen++;
-                }
+            record->label = line + 1;
+            record->lablen = (long) len - 1;
+            record->beg = record->end = eol < end ? eol + 1 : end;
+        } else if (len) {
+            if (!record) {
+                chunk->error = iline;
+                break;
             }
+            record->end = line + len;
+            if (format == FORMAT_A3M) {
+                for (i = 0; i < len; i++)
+                    record->length += !insertState(line[i]);
+            } else
+                record->length += (long) len;
         }
+        line = eol + 1;
     }
-    fclose(file);
+    chunk->lines = iline;
+}
 
-    free(line);
-    if (aligned && seqlen != curlen) {
-        PyErr_SetString(PyExc_IOError, intcat(errmsg, iline));
+
+static int isBlank(char ch) {
+
+    return ch == ' ' || ch == '\t';
+}
+
+
+static void scanSelex(msaChunk *chunk) {
+
+    /* Find sequence lines in a chunk of SELEX or Stockholm formatted data,
+       and mark ends of blocks, i.e. blank lines and ``//``, with records
+       without a label.  The sequence is the last word of a line and the
+       label is what comes before it, so that sequences may start at any
+       position.  Comment and annotation lines are skipped.  Set the number
+       of a line without a label as error. */
+
+    char *line = chunk->beg, *end = chunk->end, *eol;
+    size_t len, beg, last;
+    long iline = 0;
+    msaRecord *record;
+    while (line < end && !chunk->error) {
+        eol = nextLine(line, end, &len);
+        iline++;
+        while (len && isBlank(line[len - 1]))
+            len--;
+        if (!len || line[0] == '/') {
+            if (!addRecord(chunk, iline))
+                break;
+        } else if (line[0] != '#' && line[0] != '%') {
+            for (beg = len; beg && !isBlank(line[beg - 1]); beg--);
+            for (last = beg; last && isBlank(line[last - 1]); last--);
+            if (!last) {
+                chunk->error = iline;
+                break;
+            }
+            if (!(record = addRecord(chunk, iline)))
+                break;
+            record->label = line;
+            record->lablen = (long) last;
+            record->beg = line + beg;
+            record->end = line + len;
+            record->length = (long) (len - beg);
+        }
+        line = eol + 1;
+    }
+    chunk->lines = iline;
+}
+
+
+static long mergeChunks(msaChunk *chunks, long nchunks, msaLayout *layout) {
+
+    /* Merge records of chunks into *layout*, and return 0, -1 on memory
+       allocation failure, or the number of the first line where a sequence
+       ends misaligned, or a block does not repeat sequences of the first
+       block in the same order.  FASTA and A3M records end at the label of
+       the next record, or at the last line. */
+
+    long k, i, b, lines = 0, count = 0, error = 0;
+    for (k = 0; k < nchunks; k++)
+        count += chunks[k].count;
+    msaRecord *records = malloc((count + 1) * sizeof(msaRecord));
+    if (!records)
+        return -1;
+    layout->records = records;
+    for (k = 0; k < nchunks && !error; k++) {
+        msaChunk *chunk = chunks + k;
+        if (chunk->error)
+            error = chunk->error < 0 ? -1 : lines + chunk->error;
+        for (i = 0; i < chunk->count; i++) {
+            chunk->records[i].line += lines;
+            *records++ = chunk->records[i];
+        }
+        lines += chunk->lines;
+    }
+    if (error)
+        return error;
+    records = layout->records;
+    layout->count = count;
+
+    if (layout->format != FORMAT_SELEX) {
+        layout->number = count;
+        layout->length = count ? records[0].length : 0;
+        for (i = 0; i < count; i++)
+            if (records[i].length != layout->length)
+                return i + 1 < count ? records[i + 1].line : lines;
+        return 0;
+    }
+
+    /* blocks are runs of sequence lines */
+    layout->blocks = malloc((count + 1) * sizeof(long));
+    layout->columns = malloc((count + 1) * sizeof(long));
+    if (!layout->blocks || !layout->columns)
+        return -1;
+    for (i = 0; i < count; i++)
+        if (records[i].label && (!i || !records[i - 1].label))
+            layout->blocks[layout->nblocks++] = i;
+    layout->number = 0;
+    for (i = layout->nblocks ? layout->blocks[0] : count;
+         i < count && records[i].label; i++)
+        layout->number++;
+    layout->length = 0;
+    for (b = 0; b < layout->nblocks; b++) {
+        msaRecord *first = records + layout->blocks[0],
+                  *block = records + layout->blocks[b];
+        layout->columns[b] = layout->length;
+        for (i = 0; i < layout->number; i++) {
+            if (layout->blocks[b] + i == count || !block[i].label)
+                return block[i - 1].line;
+            if (block[i].lablen != first[i].lablen ||
+                memcmp(block[i].label, first[i].label, first[i].lablen) ||
+                block[i].length != block[0].length)
+                return block[i].line;
+        }
+        if (layout->blocks[b] + i < count && block[i].label)
+            return block[i].line;
+        layout->length += block[0].length;
+    }
+    return 0;
+}
+
+
+static msaRecord *getRecord(msaLayout *layout, long row) {
+
+    /* Return the record holding the label of sequence *row*. */
+
+    if (layout->format == FORMAT_SELEX)
+        return layout->records + layout->blocks[0] + row;
+    return layout->records + row;
+}
+
+
+static void copyRecord(msaRecord *record, int format, char *out) {
+
+    /* Copy aligned residues of a FASTA or A3M *record* to *out*. */
+
+    char *line = record->beg, *end = record->end, *eol;
+    size_t len, i;
+    while (line < end) {
+        eol = nextLine(line, end, &len);
+        if (format == FORMAT_A3M) {
+            for (i = 0; i < len; i++)
+                if (!insertState(line[i]))
+                    *out++ = line[i];
+        } else {
+            memcpy(out, line, len);
+            out += len;
+        }
+        line = eol + 1;
+    }
+}
+
+
+static void copySequence(msaLayout *layout, long row, char *out) {
+
+    /* Copy aligned residues of sequence *row* to *out*. */
+
+    long b;
+    msaRecord *record;
+    if (layout->format == FORMAT_SELEX) {
+        for (b = 0; b < layout->nblocks; b++) {
+            record = layout->records + layout->blocks[b] + row;
+            memcpy(out + layout->columns[b], record->beg, record->length);
+        }
+        return;
+    }
+    copyRecord(layout->records + row, layout->format, out);
+}
+
+
+static npy_intp *sliceColumns(PyObject *slice, long length, long *ncols) {
+
+    /* Return indices of columns selected by *slice*, a slice or an object
+       that can be used to index a Numpy array of *length* elements, i.e.
+       indices or a boolean mask, and set their number to *ncols*.  Return
+       NULL and set an exception on failure. */
+
+    npy_intp *cols;
+    long i;
+    if (PySlice_Check(slice)) {
+        Py_ssize_t start, stop, step, slicelength;
+        #if PY_MAJOR_VERSION >= 3
+        if (PySlice_GetIndicesEx(slice, length, &start, &stop, &step,
+                                 &slicelength) < 0)
+        #else
+        if (PySlice_GetIndicesEx((PySliceObject *) slice, length, &start,
+                                 &stop, &step, &slicelength) < 0)
+        #endif
+            return NULL;
+        cols = malloc((slicelength + 1) * sizeof(npy_intp));
+        if (!cols) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        for (i = 0; i < slicelength; i++)
+            cols[i] = start + i * step;
+        *ncols = slicelength;
+        return cols;
+    }
+
+    PyArrayObject *array = (PyArrayObject *) PyArray_FROM_O(slice);
+    if (!array)
         return NULL;
+    if (PyArray_TYPE(array) == NPY_BOOL) {
+        PyArrayObject *which;
+        if (PyArray_NDIM(array) != 1 || PyArray_SIZE(array) != length) {
+            Py_DECREF(array);
+            PyErr_SetString(PyExc_IndexError, "boolean slice must have an "
+                            "element for each column");
+            return NULL;
+        }
+        which = (PyArrayObject *) PyArray_Nonzero(array);
+        Py_DECREF(array);
+        if (!which)
+            return NULL;
+        array = (PyArrayObject *) PySequence_GetItem((PyObject *) which, 0);
+        Py_DECREF(which);
+        if (!array)
+            return NULL;
+    }
+    PyArrayObject *indices = (PyArrayObject *) PyArray_FROMANY(
+        (PyObject *) array, NPY_INTP, 0, 1,
+        NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+    Py_DECREF(array);
+    if (!indices)
+        return NULL;
+    *ncols = (long) PyArray_SIZE(indices);
+    cols = malloc((*ncols + 1) * sizeof(npy_intp));
+    if (!cols) {
+        Py_DECREF(indices);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    npy_intp *data = (npy_intp *) PyArray_DATA(indices);
+    for (i = 0; i < *ncols; i++) {
+        cols[i] = data[i] < 0 ? data[i] + length : data[i];
+        if (cols[i] < 0 || cols[i] >= length) {
+            Py_DECREF(indices);
+            free(cols);
+            PyErr_SetString(PyExc_IndexError, "slice index out of range");
+            return NULL;
+        }
     }
+    Py_DECREF(indices);
+    return cols;
+}
+
 
-    npy_intp dims[2] = {index / seqlen, seqlen};
-    PyArray_Dims arr_dims;
-    arr_dims.ptr = dims;
-    arr_dims.len = 2;
-    PyArray_Resize(msa, &arr_dims, 0, NPY_CORDER);
-    PyObject *result = Py_BuildValue("(OOOi)", msa, labels, mapping, count);
-    Py_DECREF(labels);
-    Py_DECREF(mapping);
+static npy_intp *filterRows(msaLayout *layout, PyObject *filter, int full,
+                            long *nrows) {
+
+    /* Return indices of sequences for which *filter* returns true when it
+       is called with the label, or its identifier part unless *full* is
+       true, and the sequence as strings, and set their number to *nrows*.
+       Return NULL and set an exception on failure. */
+
+    npy_intp *rows = malloc((layout->number + 1) * sizeof(npy_intp));
+    char *seq = malloc(layout->length + 1);
+    long row, key, lablen;
+    int keep = 0;
+    *nrows = 0;
+    if (!rows || !seq) {
+        free(rows);
+        free(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (row = 0; row < layout->number && keep >= 0; row++) {
+        msaRecord *record = getRecord(layout, row);
+        lablen = labelLength(record->label, record->lablen, &key);
+        copySequence(layout, row, seq);
+        #if PY_MAJOR_VERSION >= 3
+        PyObject *label = PyUnicode_FromStringAndSize(record->label,
+                                                      full ? lablen : key);
+        PyObject *sequence = PyUnicode_FromStringAndSize(seq,
+                                                         layout->length);
+        #else
+        PyObject *label = PyString_FromStringAndSize(record->label,
+                                                     full ? lablen : key);
+        PyObject *sequence = PyString_FromStringAndSize(seq, layout->length);
+        #endif
+        PyObject *result = NULL;
+        if (label && sequence)
+            result = PyObject_CallFunctionObjArgs(filter, label, sequence,
+                                                  NULL);
+        keep = result ? PyObject_IsTrue(result) : -1;
+        Py_XDECREF(label);
+        Py_XDECREF(sequence);
+        Py_XDECREF(result);
+        if (keep > 0)
+            rows[(*nrows)++] = row;
+    }
+    free(seq);
+    if (keep < 0) {
+        free(rows);
+        return NULL;
+    }
+    return rows;
+}
+
+
+static PyObject *bufferLabels(char **label, long *lablen, long number,
+                              int n_threads) {
+
+    /* Return labels copied into one bytes object, an array of *number* + 1
+       offsets of labels in it, and an array of lengths of identifiers used
+       for indexing them.  Python strings are not created for labels, and
+       the GIL is held only to allocate these objects. */
+
+    npy_intp dim = number, dim1 = number + 1;
+    PyObject *offsets = PyArray_SimpleNew(1, &dim1, NPY_INTP);
+    PyObject *keys = PyArray_SimpleNew(1, &dim, NPY_INTP);
+    if (!offsets || !keys) {
+        Py_XDECREF(offsets);
+        Py_XDECREF(keys);
+        return PyErr_NoMemory();
+    }
+    npy_intp *offs = (npy_intp *) PyArray_DATA((PyArrayObject *) offsets),
+             *keylen = (npy_intp *) PyArray_DATA((PyArrayObject *) keys);
+    long k;
+
+    Py_BEGIN_ALLOW_THREADS
+    offs[0] = 0;
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    #endif
+    for (k = 0; k < number; k++) {
+        long key;
+        offs[k + 1] = labelLength(label[k], lablen[k], &key);
+        keylen[k] = key;
+    }
+    for (k = 0; k < number; k++)
+        offs[k + 1] += offs[k];
+    Py_END_ALLOW_THREADS
+
+    PyObject *buffer = PyBytes_FromStringAndSize(NULL, offs[number]);
+    if (!buffer) {
+        Py_DECREF(offsets);
+        Py_DECREF(keys);
+        return NULL;
+    }
+    char *data = PyBytes_AS_STRING(buffer);
+
+    Py_BEGIN_ALLOW_THREADS
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    #endif
+    for (k = 0; k < number; k++)
+        memcpy(data + offs[k], label[k], offs[k + 1] - offs[k]);
+    Py_END_ALLOW_THREADS
+
+    PyObject *result = Py_BuildValue("(OOO)", buffer, offsets, keys);
+    Py_DECREF(buffer);
+    Py_DECREF(offsets);
+    Py_DECREF(keys);
     return result;
 }
 
 
+static msaChunk *scanChunks(char *data, size_t size, int format,
+                            int n_threads, long *nchunks) {
+
+    /* Return chunks of *size* characters of *data*, in which records are
+       found by *n_threads* threads, and set their number to *nchunks*.
+       Return NULL on memory allocation failure. */
+
+    long k;
+    /* more chunks than threads balance their work */
+    *nchunks = n_threads > 1 ? n_threads * 4 : 1;
+    msaChunk *chunks = calloc(*nchunks, sizeof(msaChunk));
+    if (!chunks)
+        return NULL;
+    splitChunks(data, size, chunks, *nchunks, format);
+
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+    #endif
+    for (k = 0; k < *nchunks; k++) {
+        if (format == FORMAT_SELEX)
+            scanSelex(chunks + k);
+        else
+            scanFasta(chunks + k, format);
+    }
+    return chunks;
+}
+
+
+static void freeChunks(msaChunk *chunks, long nchunks) {
+
+    /* Release chunks returned by scanChunks. */
+
+    long k;
+    for (k = 0; k < nchunks; k++)
+        free(chunks[k].records);
+    free(chunks);
+}
+
+
+static void freeResidues(PyObject *capsule) {
+
+    /* Release residues adopted by an array, see buildMSA. */
+
+    free(PyCapsule_GetPointer(capsule, NULL));
+}
+
+
+static PyObject *buildMSA(msaLayout *layout, long iline, int format,
+                          char *residues, int n_threads, int lazy,
+                          PyObject *filter, int full, PyObject *slice) {
+
+    /* Return a new Numpy character array of sequences in *layout*, and
+       their labels, or set an error for line *iline* of a file of *format*
+       when it is not 0, or on memory allocation failure when it is -1.
+       Sequences are selected by *filter* and columns by *slice* before
+       they are copied, see filterRows and sliceColumns, and they are
+       copied into rows by *n_threads* threads.  *residues*, when not NULL,
+       holds FASTA or A3M sequences of layout in order, and it becomes the
+       array when all of them are kept, or it is freed.  Labels are indexed
+       in order at the end, or when *lazy* is true, returned in a buffer as
+       described in bufferLabels instead of a list and a dictionary. */
+
+    char errmsg[LENLABEL];
+    strcpy(errmsg, format == FORMAT_SELEX ?
+           "failed to parse SELEX/Stockholm file at line " :
+           format == FORMAT_A3M ? "failed to parse A3M file at line " :
+           "failed to parse FASTA file at line ");
+    npy_intp *rows = NULL, *cols = NULL;
+    PyObject *msa = NULL, *result = NULL, *labels = NULL, *mapping = NULL;
+    char **label = NULL;
+    long *lablen = NULL, k, nrows, ncols;
+    int adopt;
+    if (iline < 0) {
+        PyErr_NoMemory();
+        goto done;
+    } else if (iline) {
+        PyErr_SetString(PyExc_IOError, intcat(errmsg, iline));
+        goto done;
+    }
+
+    nrows = layout->number;
+    ncols = layout->length;
+    if (slice && slice != Py_None &&
+        !(cols = sliceColumns(slice, layout->length, &ncols)))
+        goto done;
+    if (filter && filter != Py_None &&
+        !(rows = filterRows(layout, filter, full, &nrows)))
+        goto done;
+
+    npy_intp dims[2] = {nrows, ncols};
+    adopt = residues && nrows && !rows && !cols;
+    if (adopt) {
+        msa = PyArray_New(&PyArray_Type, 2, dims, NPY_STRING, NULL,
+                          residues, 1, NPY_ARRAY_CARRAY, NULL);
+        PyObject *capsule = msa ? PyCapsule_New(residues, NULL,
+                                                freeResidues) : NULL;
+        if (!capsule)
+            goto done;
+        /* residues are released with the capsule from here on */
+        residues = NULL;
+        if (PyArray_SetBaseObject((PyArrayObject *) msa, capsule) < 0)
+            goto done;
+    } else
+        msa = PyArray_New(&PyArray_Type, 2, dims, NPY_STRING, NULL, NULL, 1,
+                          0, NULL);
+    label = malloc((nrows + 1) * sizeof(char *));
+    lablen = malloc((nrows + 1) * sizeof(long));
+    if (!msa || !label || !lablen) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    char *out = (char *) PyArray_DATA((PyArrayObject *) msa);
+    int failed = 0;
+    Py_BEGIN_ALLOW_THREADS
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        /* sliced sequences are gathered from a row of all columns */
+        char *seq = cols ? malloc(layout->length + 1) : NULL;
+        long i, j;
+        if (cols && !seq) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic,64)
+        #endif
+        for (i = 0; i < nrows; i++) {
+            long row = rows ? rows[i] : i;
+            msaRecord *record = getRecord(layout, row);
+            label[i] = record->label;
+            lablen[i] = record->lablen;
+            if (adopt)
+                continue;
+            if (!cols)
+                copySequence(layout, row, out + i * ncols);
+            else if (seq) {
+                copySequence(layout, row, seq);
+                for (j = 0; j < ncols; j++)
+                    out[i * ncols + j] = seq[cols[j]];
+            }
+        }
+        free(seq);
+    }
+    Py_END_ALLOW_THREADS
+    if (failed) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    if (lazy) {
+        labels = bufferLabels(label, lablen, nrows, n_threads);
+        if (labels)
+            result = Py_BuildValue("(OOl)", msa, labels, nrows);
+    } else {
+        labels = PyList_New(0);
+        mapping = PyDict_New();
+        if (labels && mapping) {
+            long count = 0;
+            for (k = 0; k < nrows; k++)
+                count += parseLabel(labels, mapping, label[k],
+                                    (int) lablen[k]);
+            result = Py_BuildValue("(OOOl)", msa, labels, mapping, count);
+        } else
+            PyErr_NoMemory();
+    }
+
+  done:
+    free(layout->records);
+    free(layout->blocks);
+    free(layout->columns);
+    free(residues);
+    free(rows);
+    free(cols);
+    free(label);
+    free(lablen);
+    Py_XDECREF(msa);
+    Py_XDECREF(labels);
+    Py_XDECREF(mapping);
+    return result;
+}
+
+
+static int getThreads(int n_threads) {
+
+    /* Return number of threads, all available processors when *n_threads*
+       is zero or negative, or 1 without OpenMP. */
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    #else
+    n_threads = 1;
+    #endif
+    return n_threads;
+}
+
+
+static PyObject *parseBuffer(char *data, size_t size, int format,
+                             int n_threads, int lazy, PyObject *filter,
+                             int full, PyObject *slice) {
+
+    /* Parse sequences from *size* characters of *data* into a new Numpy
+       character array.  Data is split into chunks, in which records are
+       found by *n_threads* threads, and records are merged in order so that
+       the array is allocated at its exact size, see buildMSA. */
+
+    long iline, nchunks;
+    msaLayout layout;
+    memset(&layout, 0, sizeof(msaLayout));
+    layout.format = format;
+    n_threads = getThreads(n_threads);
+
+    Py_BEGIN_ALLOW_THREADS
+    msaChunk *chunks = scanChunks(data, size, format, n_threads, &nchunks);
+    iline = chunks ? mergeChunks(chunks, nchunks, &layout) : -1;
+    if (chunks)
+        freeChunks(chunks, nchunks);
+    Py_END_ALLOW_THREADS
+
+    return buildMSA(&layout, iline, format, NULL, n_threads, lazy, filter,
+                    full, slice);
+}
+
+
+typedef struct {
+    long label;       /* offset of label, or -1 for the end of a block */
+    long lablen;      /* number of characters in label */
+    long beg;         /* offset of aligned residues */
+    long length;      /* number of aligned residues */
+    long line;        /* line of label */
+} msaEntry;
+
+typedef struct {
+    char *residues;        /* aligned residues of records */
+    size_t nres, rescap;   /* their number and allocated size */
+    char *labels;          /* labels of records */
+    size_t nlab, labcap;   /* their number and allocated size */
+    msaEntry *entries;     /* records, or lines of blocks, in order */
+    long count, size;      /* number of records and allocated size */
+    long lines;            /* number of lines stored */
+} msaStore;
+
+
+static int reserve(char **buffer, size_t *capacity, size_t size) {
+
+    /* Grow *buffer* to hold *size* characters, doubling its *capacity*,
+       and return 0 on memory allocation failure. */
+
+    if (size <= *capacity)
+        return 1;
+    size_t grown = *capacity ? *capacity * 2 : 1 << 20;
+    while (grown < size)
+        grown *= 2;
+    char *data = realloc(*buffer, grown);
+    if (!data)
+        return 0;
+    *buffer = data;
+    *capacity = grown;
+    return 1;
+}
+
+
+static long storeChunk(msaStore *store, msaChunk *chunk, int format) {
+
+    /* Store labels and aligned residues of records of *chunk*, which was
+       scanned from data that will be discarded, and return 0, -1 on memory
+       allocation failure, or the number of the line of its error. */
+
+    long i;
+    if (chunk->error)
+        return chunk->error < 0 ? -1 : store->lines + chunk->error;
+    if (store->count + chunk->count > store->size) {
+        long size = store->size ? store->size : 1024;
+        while (size < store->count + chunk->count)
+            size *= 2;
+        msaEntry *entries = realloc(store->entries, size * sizeof(msaEntry));
+        if (!entries)
+            return -1;
+        store->entries = entries;
+        store->size = size;
+    }
+    for (i = 0; i < chunk->count; i++) {
+        msaRecord *record = chunk->records + i;
+        msaEntry *entry = store->entries + store->count++;
+        entry->label = -1;
+        entry->lablen = record->lablen;
+        entry->beg = (long) store->nres;
+        entry->length = record->length;
+        entry->line = store->lines + record->line;
+        if (!record->label)
+            continue;
+        if (!reserve(&store->labels, &store->labcap,
+                     store->nlab + record->lablen + 1) ||
+            !reserve(&store->residues, &store->rescap,
+                     store->nres + record->length + 1))
+            return -1;
+        entry->label = (long) store->nlab;
+        memcpy(store->labels + store->nlab, record->label, record->lablen);
+        store->nlab += record->lablen;
+        if (format == FORMAT_SELEX)
+            memcpy(store->residues + store->nres, record->beg,
+                   record->length);
+        else
+            copyRecord(record, format, store->residues + store->nres);
+        store->nres += record->length;
+    }
+    store->lines += chunk->lines;
+    return 0;
+}
+
+
+static size_t pieceEnd(char *data, size_t size, int format) {
+
+    /* Return the number of characters of *data* that make complete lines,
+       and for FASTA and A3M formats, complete records, as the last record
+       may continue in data that is not read yet. */
+
+    size_t i = size;
+    while (i > 0) {
+        i--;
+        if (data[i] == '\n' &&
+            (format == FORMAT_SELEX || (i + 1 < size && data[i + 1] == '>')))
+            return i + 1;
+    }
+    return 0;
+}
+
+
+static PyObject *parseStream(PyObject *read, int format, int n_threads,
+                             int lazy, PyObject *filter, int full,
+                             PyObject *slice) {
+
+    /* Parse sequences from blocks of data returned by calling *read*,
+       until it returns an empty block, e.g. as they are decompressed by
+       another thread.  Pieces of complete records are scanned by
+       *n_threads* threads while the GIL is released, and only labels and
+       aligned residues of records are kept, so that the data is not held
+       in memory, see buildMSA. */
+
+    msaStore store;
+    memset(&store, 0, sizeof(msaStore));
+    char *text = NULL;
+    size_t length = 0, capacity = 0, cut;
+    long iline = 0, i, nchunks;
+    int final = 0;
+    n_threads = getThreads(n_threads);
+
+    while (!final && !iline) {
+        PyObject *block = PyObject_CallObject(read, NULL);
+        Py_buffer view;
+        if (!block || PyObject_GetBuffer(block, &view, PyBUF_SIMPLE) < 0) {
+            Py_XDECREF(block);
+            free(text);
+            free(store.residues);
+            free(store.labels);
+            free(store.entries);
+            return NULL;
+        }
+        final = view.len == 0;
+        Py_BEGIN_ALLOW_THREADS
+        if (reserve(&text, &capacity, length + view.len + 1)) {
+            memcpy(text + length, view.buf, view.len);
+            length += view.len;
+            cut = final ? length : pieceEnd(text, length, format);
+            if (cut) {
+                msaChunk *chunks = scanChunks(text, cut, format, n_threads,
+                                              &nchunks);
+                iline = chunks ? 0 : -1;
+                for (i = 0; chunks && i < nchunks && !iline; i++)
+                    iline = storeChunk(&store, chunks + i, format);
+                if (chunks)
+                    freeChunks(chunks, nchunks);
+                memmove(text, text + cut, length - cut);
+                length -= cut;
+            }
+        } else
+            iline = -1;
+        Py_END_ALLOW_THREADS
+        PyBuffer_Release(&view);
+        Py_DECREF(block);
+    }
+    free(text);
+
+    /* stored records are merged as a chunk, and A3M residues no longer
+       have insert states */
+    msaLayout layout;
+    memset(&layout, 0, sizeof(msaLayout));
+    layout.format = format == FORMAT_A3M ? FORMAT_FASTA : format;
+    msaChunk chunk;
+    memset(&chunk, 0, sizeof(msaChunk));
+    if (!iline && store.nres < store.rescap) {
+        char *residues = realloc(store.residues, store.nres + 1);
+        if (residues)
+            store.residues = residues;
+    }
+    if (!iline) {
+        chunk.records = malloc((store.count + 1) * sizeof(msaRecord));
+        chunk.count = store.count;
+        chunk.lines = store.lines;
+        iline = chunk.records ? 0 : -1;
+    }
+    for (i = 0; !iline && i < store.count; i++) {
+        msaEntry *entry = store.entries + i;
+        msaRecord *record = chunk.records + i;
+        record->label = entry->label < 0 ? NULL : store.labels + entry->label;
+        record->lablen = entry->lablen;
+        record->beg = store.residues + entry->beg;
+        record->end = record->beg + entry->length;
+        record->length = entry->length;
+        record->line = entry->line;
+    }
+    if (!iline)
+        iline = mergeChunks(&chunk, 1, &layout);
+    free(chunk.records);
+    free(store.entries);
+
+    PyObject *result = buildMSA(&layout, iline, format,
+                                format == FORMAT_SELEX ? NULL :
+                                store.residues, n_threads, lazy, filter,
+                                full, slice);
+    if (format == FORMAT_SELEX)
+        free(store.residues);
+    free(store.labels);
+    return result;
+}
+
+
+static PyObject *parseSource(char *filename, int format, int n_threads,
+                             int lazy, PyObject *filter, int full,
+                             PyObject *slice) {
+
+    /* Parse sequences from *filename* mapped into memory, see
+       parseBuffer. */
+
+    PyObject *result;
+    size_t size;
+    char *data = mapFile(filename, &size);
+    if (!data)
+        return NULL;
+    result = parseBuffer(data, size, format, n_threads, lazy, filter, full,
+                         slice);
+    unmapFile(data, size);
+    return result;
+}
+
+
+static PyObject *parseFormat(PyObject *args, PyObject *kwargs, int format) {
+
+    /* Parse arguments of parseFasta, parseSelex, and parseA3M, and parse
+       sequences from *filename*, or from blocks returned by *read* when it
+       is given, e.g. for compressed files, see parseSource and
+       parseStream. */
+
+    char *filename;
+    PyObject *filter = NULL, *slice = NULL, *read = NULL;
+    int n_threads = 1, lazy = 0, full = 0;
+
+    static char *kwlist[] = {"filename", "n_threads", "lazy", "filter",
+                             "filter_full", "slice", "read", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|iiOiOO", kwlist,
+                                     &filename, &n_threads, &lazy, &filter,
+                                     &full, &slice, &read))
+        return NULL;
+
+    if (filter && filter != Py_None && !PyCallable_Check(filter)) {
+        PyErr_SetString(PyExc_TypeError, "filter must be callable");
+        return NULL;
+    }
+    if (read && read != Py_None) {
+        if (!PyCallable_Check(read)) {
+            PyErr_SetString(PyExc_TypeError, "read must be callable");
+            return NULL;
+        }
+        return parseStream(read, format, n_threads, lazy, filter, full,
+                           slice);
+    }
+    return parseSource(filename, format, n_threads, lazy, filter, full,
+                       slice);
+}
+
+
+static PyObject *parseFasta(PyObject *self, PyObject *args,
+                            PyObject *kwargs) {
+
+    /* Parse sequences from FASTA formatted *filename*, see parseFormat. */
+
+    return parseFormat(args, kwargs, FORMAT_FASTA);
+}
+
+
+static PyObject *parseA3M(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    /* Parse sequences from A3M or A2M formatted *filename*, dropping lower
+       case residues and dots of insert states, see parseFormat. */
+
+    return parseFormat(args, kwargs, FORMAT_A3M);
+}
+
+
 static PyObject *writeFasta(PyObject *self, PyObject *args, PyObject *kwargs) {
 
     /* Write MSA where inputs are: labels in the form of Python lists
@@ -233,83 +1262,13 @@ static PyObject *writeFasta(PyObject *self, PyObject *args, PyObject *kwargs) {
     return Py_BuildValue("s", filename);
 }
 
-static PyObject *parseSelex(PyObject *self, PyObject *args) {
-
-    /* Parse sequences from *filename* into the the memory pointed by the
-       Numpy array passed as Python object.  */
-
-    char *filename;
-    PyArrayObject *msa;
-
-    if (!PyArg_ParseTuple(args, "sO", &filename, &msa))
-        return NULL;
-
-    long i = 0, beg = 0, end = 0;
-    long size = SELEXLINELEN + 1, iline = 0, seqlen = 0;
-    char errmsg[LENLABEL] = "failed to parse SELEX/Stockholm file at line ";
-
-    PyObject *labels = PyList_New(0), *mapping = PyDict_New();
-    if (!labels || !mapping)
-        return PyErr_NoMemory();
-    char *line = malloc(size * sizeof(char));
-    if (!line)
-        return PyErr_NoMemory();
-    char *data = (char *) PyArray_DATA(msa);
-    /* figure out where the sequence starts and ends in a line*/
-    FILE *file = fopen(filename, "rb");
-    while (fgets(line, size, file) != NULL) {
-        iline++;
-        if (line[0] == '#' || line[0] == '/' || line[0] == '%')
-            continue;
-        for (i = 0; i < size; i++)
-            if (line[i] == ' ')
-                break;
-        for (; i < size; i++)
-            if (line[i] != ' ')
-                break;
-        beg = i;
-        for (; i < size; i++)
-            if (line[i] < 32)
-                break;
-        end = i;
-        seqlen = end - beg;
-        break;
-    }
-    iline--;
-    fseek(file, - strlen(line), SEEK_CUR);
-
-    long index = 0, count = 0;
-
-    int space = beg - 1; /* index of space character before sequence */
-    while (fgets(line, size, file) != NULL) {
-        iline++;
-        if (line[0] == '#' || line[0] == '/' || line[0] == '%')
-            continue;
-
-        if (line[space] != ' ') {
-            free(line);
-            fclose(file);
-            PyErr_SetString(PyExc_IOError, intcat(errmsg, iline));
-            return NULL;
-        }
-
-        count += parseLabel(labels, mapping, line, space);
+static PyObject *parseSelex(PyObject *self, PyObject *args,
+                            PyObject *kwargs) {
 
-        for (i = beg; i < end; i++)
-            data[index++] = line[i];
-    }
-    fclose(file);
-    free(line);
-    npy_intp dims[2] = {index / seqlen, seqlen};
-    PyArray_Dims arr_dims;
-    arr_dims.ptr = dims;
-    arr_dims.len = 2;
-    PyArray_Resize(msa, &arr_dims, 0, NPY_CORDER);
-    PyObject *result = Py_BuildValue("(OOOi)", msa, labels, mapping, count);
-    Py_DECREF(labels);
-    Py_DECREF(mapping);
+    /* Parse sequences from SELEX or Stockholm formatted *filename*, which
+       may be interleaved in blocks, see parseFormat. */
 
-    return result;
+    return parseFormat(args, kwargs, FORMAT_SELEX);
 }
 
 
@@ -393,22 +1352,141 @@ static PyObject *writeSelex(PyObject *self, PyObject *args, PyObject *kwargs) {
 }
 
 
+static npy_uint64 hashKey(const char *key, long length) {
+
+    /* Return FNV-1a hash of *length* characters of *key*. */
+
+    npy_uint64 hash = 14695981039346656037ULL;
+    long i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static PyObject *indexLabels(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+
+    /* Fill an open addressing hash *table* of rows keyed by identifiers of
+       labels in a buffer returned by a lazy parse, and return the number of
+       distinct identifiers.  Rows with the same identifier follow one
+       another along the same probe sequence in increasing order. */
+
+    PyObject *buffer;
+    PyArrayObject *offsets, *keys, *table;
+
+    static char *kwlist[] = {"buffer", "offsets", "keys", "table", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO", kwlist,
+                                     &buffer, &offsets, &keys, &table))
+        return NULL;
+
+    char *data = PyBytes_AsString(buffer);
+    if (!data)
+        return NULL;
+    npy_intp *offs = (npy_intp *) PyArray_DATA(offsets),
+             *keylen = (npy_intp *) PyArray_DATA(keys),
+             *slots = (npy_intp *) PyArray_DATA(table);
+    long number = PyArray_DIMS(keys)[0], distinct = 0, k;
+    npy_uint64 mask = (npy_uint64) PyArray_DIMS(table)[0] - 1, h;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (h = 0; h <= mask; h++)
+        slots[h] = -1;
+    for (k = 0; k < number; k++) {
+        int seen = 0;
+        h = hashKey(data + offs[k], keylen[k]) & mask;
+        while (slots[h] >= 0) {
+            npy_intp j = slots[h];
+            if (!seen && keylen[j] == keylen[k] &&
+                !memcmp(data + offs[j], data + offs[k], keylen[k]))
+                seen = 1;
+            h = (h + 1) & mask;
+        }
+        slots[h] = k;
+        distinct += !seen;
+    }
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("l", distinct);
+}
+
+
+static PyObject *lookupLabel(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+
+    /* Return list of rows whose label identifier is *key*, a bytes object,
+       using a hash *table* filled by indexLabels. */
+
+    PyObject *buffer, *key;
+    PyArrayObject *offsets, *keys, *table;
+
+    static char *kwlist[] = {"buffer", "offsets", "keys", "table", "key",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOO", kwlist,
+                                     &buffer, &offsets, &keys, &table, &key))
+        return NULL;
+
+    char *data = PyBytes_AsString(buffer), *query = PyBytes_AsString(key);
+    if (!data || !query)
+        return NULL;
+    long length = (long) PyBytes_GET_SIZE(key);
+    npy_intp *offs = (npy_intp *) PyArray_DATA(offsets),
+             *keylen = (npy_intp *) PyArray_DATA(keys),
+             *slots = (npy_intp *) PyArray_DATA(table);
+    npy_uint64 mask = (npy_uint64) PyArray_DIMS(table)[0] - 1,
+               h = hashKey(query, length) & mask;
+
+    PyObject *rows = PyList_New(0);
+    if (!rows)
+        return NULL;
+    while (slots[h] >= 0) {
+        npy_intp j = slots[h];
+        if (keylen[j] == length && !memcmp(data + offs[j], query, length)) {
+            PyObject *row = PyLong_FromSsize_t(j);
+            if (!row || PyList_Append(rows, row) < 0) {
+                Py_XDECREF(row);
+                Py_DECREF(rows);
+                return NULL;
+            }
+            Py_DECREF(row);
+        }
+        h = (h + 1) & mask;
+    }
+    return rows;
+}
+
+
 static PyMethodDef msaio_methods[] = {
 
-    {"parseFasta",  (PyCFunction)parseFasta, METH_VARARGS,
-     "Return list of labels and a dictionary mapping labels to sequences \n"
-     "after parsing the sequences into empty numpy character array."},
+    {"parseFasta",  (PyCFunction)parseFasta, METH_VARARGS | METH_KEYWORDS,
+     "Return numpy character array of sequences, list of labels, and a\n"
+     "dictionary mapping labels to sequences parsed from FASTA file."},
 
     {"writeFasta",  (PyCFunction)writeFasta, METH_VARARGS | METH_KEYWORDS,
      "Return filename after writing MSA in FASTA format."},
 
-    {"parseSelex",  (PyCFunction)parseSelex, METH_VARARGS,
-     "Return list of labels and a dictionary mapping labels to sequences \n"
-     "after parsing the sequences into empty numpy character array."},
+    {"parseSelex",  (PyCFunction)parseSelex, METH_VARARGS | METH_KEYWORDS,
+     "Return numpy character array of sequences, list of labels, and a\n"
+     "dictionary mapping labels to sequences parsed from SELEX or\n"
+     "Stockholm file."},
+
+    {"parseA3M",  (PyCFunction)parseA3M, METH_VARARGS | METH_KEYWORDS,
+     "Return numpy character array of sequences, list of labels, and a\n"
+     "dictionary mapping labels to sequences parsed from A3M file."},
 
     {"writeSelex",  (PyCFunction)writeSelex, METH_VARARGS | METH_KEYWORDS,
     "Return filename after writing MSA in SELEX or Stockholm format."},
 
+    {"indexLabels",  (PyCFunction)indexLabels, METH_VARARGS | METH_KEYWORDS,
+     "Fill hash table of rows keyed by label identifiers in a buffer and\n"
+     "return number of distinct identifiers."},
+
+    {"lookupLabel",  (PyCFunction)lookupLabel, METH_VARARGS | METH_KEYWORDS,
+     "Return list of rows whose label identifier is given key."},
+
     {NULL, NULL, 0, NULL}
 };
 
@@ -0,0 +1,321 @@
+/* Asymmetric pseudolikelihood maximization (plmDCA) for rows of residue
+   indices, as calculated for Meff.  For each column r, fields h_r and
+   couplings J_ri of a Potts model of column r conditioned on all other
+   columns are fitted by minimizing weighted negative log pseudolikelihood
+   with L2 regularization using L-BFGS.  Columns are independent problems,
+   so they are fitted in parallel, and only their couplings are kept, in
+   single precision, until both columns of a pair are fitted to score it.
+   This file is included by msatools.c. */
+
+#define PLM_HISTORY 5
+#define PLM_STEPS 30
+#define PLM_FTOL 1e-7
+#define PLM_GTOL 1e-5
+
+
+static double plmObjective(double *x, double *g, double *logits,
+                           unsigned char *rows, double *w, long number,
+                           long stride, long l, int q, long r,
+                           double lambda_h, double lambda_j) {
+
+    /* Return objective and fill gradient *g* for column *r* at parameters
+       *x*, q fields followed by an l x q x q array of couplings, where
+       x[q + (i * q + b) * q + a] couples state a of column r with state b of
+       column i.  Couplings of column r with itself are zero and stay so.
+       *logits* is scratch of q elements. */
+
+    long n, i, dim = q + l * q * q;
+    int a, s;
+    double f = 0, z, top, wn, *h = x, *gh = g, *J = x + q, *gJ = g + q, *v;
+    unsigned char *row;
+
+    for (i = 0; i < dim; i++)
+        g[i] = 0;
+    for (n = 0; n < number; n++) {
+        wn = w[n];
+        if (wn == 0)
+            continue;
+        row = rows + n * stride;
+        for (a = 0; a < q; a++)
+            logits[a] = h[a];
+        for (i = 0; i < l; i++) {
+            if (i == r)
+                continue;
+            v = J + (i * q + row[i]) * q;
+            for (a = 0; a < q; a++)
+                logits[a] += v[a];
+        }
+        s = row[r];
+        top = logits[0];
+        for (a = 1; a < q; a++)
+            if (logits[a] > top)
+                top = logits[a];
+        f -= wn * (logits[s] - top);
+        z = 0;
+        for (a = 0; a < q; a++) {
+            logits[a] = exp(logits[a] - top);
+            z += logits[a];
+        }
+        f += wn * log(z);
+
+        /*Gradient of -log P(s) with respect to logits is P - 1 for state s,
+          and it is added to the fields and each coupling used above.*/
+        for (a = 0; a < q; a++)
+            logits[a] *= wn / z;
+        logits[s] -= wn;
+        for (a = 0; a < q; a++)
+            gh[a] += logits[a];
+        for (i = 0; i < l; i++) {
+            if (i == r)
+                continue;
+            v = gJ + (i * q + row[i]) * q;
+            for (a = 0; a < q; a++)
+                v[a] += logits[a];
+        }
+    }
+
+    for (a = 0; a < q; a++) {
+        f += lambda_h * h[a] * h[a];
+        gh[a] += 2 * lambda_h * h[a];
+    }
+    for (i = 0; i < l * q * q; i++) {
+        f += lambda_j * J[i] * J[i];
+        gJ[i] += 2 * lambda_j * J[i];
+    }
+    return f;
+}
+
+
+static double plmDot(double *x, double *y, long dim) {
+
+    long i;
+    double sum = 0;
+    for (i = 0; i < dim; i++)
+        sum += x[i] * y[i];
+    return sum;
+}
+
+
+static long fitColumn(double *x, double *work, double *logits,
+                      unsigned char *rows, double *w, long number,
+                      long stride, long l, int q, long r, double lambda_h,
+                      double lambda_j, int max_iter) {
+
+    /* Minimize objective for column *r* starting from *x* using L-BFGS with
+       PLM_HISTORY correction pairs and backtracking line search.  *work* is
+       scratch of (4 + 2 * PLM_HISTORY) * dim elements.  Return number of
+       iterations. */
+
+    long i, k, dim = q + l * q * q;
+    int iter, step, used = 0, last = -1;
+    double f, fold, t, gd, sy, gamma = 0, top;
+    double rho[PLM_HISTORY], alpha[PLM_HISTORY];
+    double *g = work, *d = g + dim, *xold = d + dim, *gold = xold + dim;
+    double *s = gold + dim, *y = s + PLM_HISTORY * dim;
+
+    f = plmObjective(x, g, logits, rows, w, number, stride, l, q, r,
+                     lambda_h, lambda_j);
+    for (iter = 0; iter < max_iter; iter++) {
+        top = 0;
+        for (i = 0; i < dim; i++)
+            if (fabs(g[i]) > top)
+                top = fabs(g[i]);
+        if (top < PLM_GTOL)
+            break;
+
+        /*Two-loop recursion, from the newest correction pair to the oldest
+          and back.  The first step is scaled to unit gradient length.*/
+        for (i = 0; i < dim; i++)
+            d[i] = -g[i];
+        for (k = 0; k < used; k++) {
+            long m = (last - k + PLM_HISTORY) % PLM_HISTORY;
+            alpha[m] = rho[m] * plmDot(s + m * dim, d, dim);
+            for (i = 0; i < dim; i++)
+                d[i] -= alpha[m] * y[m * dim + i];
+        }
+        if (!used)
+            gamma = 1 / sqrt(plmDot(g, g, dim));
+        for (i = 0; i < dim; i++)
+            d[i] *= gamma;
+        for (k = used - 1; k >= 0; k--) {
+            long m = (last - k + PLM_HISTORY) % PLM_HISTORY;
+            t = alpha[m] - rho[m] * plmDot(y + m * dim, d, dim);
+            for (i = 0; i < dim; i++)
+                d[i] += t * s[m * dim + i];
+        }
+        gd = plmDot(g, d, dim);
+        if (gd >= 0) {
+            used = 0;
+            gamma = 1 / sqrt(plmDot(g, g, dim));
+            for (i = 0; i < dim; i++)
+                d[i] = -gamma * g[i];
+            gd = plmDot(g, d, dim);
+        }
+
+        memcpy(xold, x, dim * sizeof(double));
+        memcpy(gold, g, dim * sizeof(double));
+        fold = f;
+        t = 1;
+        for (step = 0; step < PLM_STEPS; step++) {
+            for (i = 0; i < dim; i++)
+                x[i] = xold[i] + t * d[i];
+            f = plmObjective(x, g, logits, rows, w, number, stride, l, q, r,
+                             lambda_h, lambda_j);
+            if (f <= fold + 1e-4 * t * gd)
+                break;
+            t *= 0.5;
+        }
+        if (step == PLM_STEPS) {
+            memcpy(x, xold, dim * sizeof(double));
+            memcpy(g, gold, dim * sizeof(double));
+            f = fold;
+            break;
+        }
+
+        /*Correction pairs that do not keep the Hessian approximation
+          positive definite are skipped.*/
+        last = (last + 1) % PLM_HISTORY;
+        for (i = 0; i < dim; i++) {
+            s[last * dim + i] = x[i] - xold[i];
+            y[last * dim + i] = g[i] - gold[i];
+        }
+        sy = plmDot(s + last * dim, y + last * dim, dim);
+        if (sy > 1e-10) {
+            rho[last] = 1 / sy;
+            gamma = sy / plmDot(y + last * dim, y + last * dim, dim);
+            if (used < PLM_HISTORY)
+                used++;
+        } else
+            last = (last - 1 + PLM_HISTORY) % PLM_HISTORY;
+
+        top = fabs(fold) > fabs(f) ? fabs(fold) : fabs(f);
+        if (fold - f <= PLM_FTOL * (top > 1 ? top : 1))
+            break;
+    }
+    return iter;
+}
+
+
+static double plmPairNorm(float *first, float *second, int q) {
+
+    /* Return Frobenius norm of couplings of a pair of columns, fitted once
+       with each column, as *first* and *second* (q x q), averaged and
+       shifted to zero-sum gauge, excluding gap state 0. */
+
+    int a, b, size = q * q;
+    double pair[NUMCHARS * NUMCHARS], rowmean[NUMCHARS];
+    double colmean[NUMCHARS], mean = 0, sum = 0, v;
+    for (a = 0; a < q; a++) {
+        rowmean[a] = 0;
+        colmean[a] = 0;
+    }
+    for (a = 0; a < q; a++)
+        for (b = 0; b < q; b++) {
+            v = 0.5 * ((double) first[a * q + b] + second[a * q + b]);
+            pair[a * q + b] = v;
+            rowmean[a] += v / q;
+            colmean[b] += v / q;
+            mean += v / size;
+        }
+    for (a = 1; a < q; a++)
+        for (b = 1; b < q; b++) {
+            v = pair[a * q + b] - rowmean[a] - colmean[b] + mean;
+            sum += v * v;
+        }
+    return sqrt(sum);
+}
+
+
+static int plmDCA(double *norm, unsigned char *rows, double *w, long number,
+                  long stride, long l, int q, double lambda_h,
+                  double lambda_j, int max_iter, int n_threads) {
+
+    /* Fill *norm* (l x l) with Frobenius norms of couplings of each pair of
+       columns fitted by pseudolikelihood maximization, using normalized
+       sequence weights *w*, see plmPairNorm.  Couplings of a pair fitted
+       with the first of its columns are kept, in single precision, until
+       the other column is fitted and the norm of the pair is calculated.
+       When columns are fitted in order, at most about a quarter of pairs
+       are pending.  Return 0 on memory allocation failure. */
+
+    long i, dim = q + l * q * q, size = q * q;
+    int failed = 0;
+    float **pending = calloc((size_t) l * l, sizeof(float *));
+    if (!pending)
+        return 0;
+    for (i = 0; i < l; i++)
+        norm[i * l + i] = 0;
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+    long r, c, k;
+    int a, b;
+    float *half, *other;
+    double *work = NULL, *logits = NULL;
+    double *x = malloc(((5 + 2 * PLM_HISTORY) * dim + q) * sizeof(double));
+    if (x) {
+        work = x + dim;
+        logits = work + (4 + 2 * PLM_HISTORY) * dim;
+    } else {
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        failed = 1;
+    }
+
+    #ifdef _OPENMP
+    #pragma omp for schedule(dynamic,1)
+    #endif
+    for (r = 0; r < l; r++) {
+        if (!x)
+            continue;
+        for (k = 0; k < dim; k++)
+            x[k] = 0;
+        fitColumn(x, work, logits, rows, w, number, stride, l, q, r,
+                  lambda_h, lambda_j, max_iter);
+        for (c = 0; c < l; c++) {
+            if (c == r)
+                continue;
+
+            /*Halves are indexed by states of the lower column first, and
+              x[q + (c * q + b) * q + a] couples state a of r with state b
+              of c.*/
+            half = malloc(size * sizeof(float));
+            if (!half) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                failed = 1;
+                break;
+            }
+            for (a = 0; a < q; a++)
+                for (b = 0; b < q; b++)
+                    half[a * q + b] = (float) (r < c ?
+                        x[q + (c * q + b) * q + a] :
+                        x[q + (c * q + a) * q + b]);
+            k = r < c ? r * l + c : c * l + r;
+            #ifdef _OPENMP
+            #pragma omp critical (plmpending)
+            #endif
+            {
+            other = pending[k];
+            pending[k] = other ? NULL : half;
+            }
+            if (other) {
+                norm[r * l + c] = norm[c * l + r] =
+                    plmPairNorm(other, half, q);
+                free(other);
+                free(half);
+            }
+        }
+    }
+    free(x);
+    }
+
+    for (i = 0; i < l * l; i++)
+        free(pending[i]);
+    free(pending);
+    return !failed;
+}
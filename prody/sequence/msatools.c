@@ -3,109 +3,358 @@
 #include "Python.h"
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include "numpy/arrayobject.h"
+#include "msacodes.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #define NUMCHARS 27
+#define TILESIZE 16
+#define BLOCKSIZE 8
+#define CHUNKSIZE 4096
+/* pair statistics calculated by blocked kernels */
+#define PAIR_MI 0
+#define PAIR_NORMMI 1
+#define PAIR_OMES 2
+#define PAIR_JOINTENT 3
+#define PAIR_STATS 4
 const int twenty[20] = {1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13,
                         14, 16, 17, 18, 19, 20, 22, 23, 25};
 const int unambiguous[23] = {0, 1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13, 14,
                              15, 16, 17, 18, 19, 20, 21, 22, 23, 25};
 
 
-static PyObject *msaentropy(PyObject *self, PyObject *args, PyObject *kwargs) {
+static int resolveThreads(int n_threads) {
+
+    /* Return number of threads to use, all processors for n_threads < 1. */
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    return n_threads;
+    #else
+    return 1;
+    #endif
+}
 
-    PyArrayObject *msa, *entropy;
-    int ambiguity = 1, omitgaps = 0;
 
-    static char *kwlist[] = {"msa", "entropy", "ambiguity", "omitgaps", NULL};
+static double *normWeights(PyObject *weights, long number, double *wsum) {
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|ii", kwlist,
-                                     &msa, &entropy, &ambiguity, &omitgaps))
+    /* Return a copy of sequence *weights* normalized to sum to one and set
+       *wsum* to their sum, return NULL on memory allocation failure. */
+
+    long k;
+    double *w = (double *) PyArray_DATA((PyArrayObject *) weights);
+    double *norm = malloc(number * sizeof(double));
+    if (!norm)
         return NULL;
+    *wsum = 0;
+    for (k = 0; k < number; k++)
+        *wsum += w[k];
+    for (k = 0; k < number; k++)
+        norm[k] = w[k] / *wsum;
+    return norm;
+}
 
 
-    /* make sure to have a contiguous and well-behaved array */
-    msa = PyArray_GETCONTIGUOUS(msa);
+/* conservation scores calculated from column counts */
+#define CONS_ENTROPY 0
+#define CONS_RELENT 1
+#define CONS_JSD 2
+#define CONS_PROPENT 3
+#define CONS_SCORES 4
+#define CONSBLOCK 1024
+#define PROPERTIES 7
 
-    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
 
-    char *seq = (char *) PyArray_DATA(msa);
-    double *ent = (double *) PyArray_DATA(entropy);
+static void ambiguityTable(double *table, int ambiguity) {
 
-    /* start here */
-    long size = number * length;
-    double count[128]; /* number of ASCII characters*/
-    double shannon = 0, probability = 0, numgap = 0, denom = number;
-    long i = 0, j = 0;
+    /* Fill NUMCHARSxNUMCHARS *table* with fractions of counts of each
+       character code allocated to each character code, distributing
+       ambiguous amino acids if requested. */
+
+    int k, l;
+    for (k = 0; k < NUMCHARS * NUMCHARS; k++)
+        table[k] = 0;
+    for (k = 0; k < NUMCHARS; k++)
+        table[k * NUMCHARS + k] = 1;
+    if (!ambiguity)
+        return;
+    table[2 * NUMCHARS + 2] = 0; /* B -> D, N  */
+    table[2 * NUMCHARS + 4] = table[2 * NUMCHARS + 14] = 0.5;
+    table[10 * NUMCHARS + 10] = 0; /* J -> I, L  */
+    table[10 * NUMCHARS + 9] = table[10 * NUMCHARS + 12] = 0.5;
+    table[26 * NUMCHARS + 26] = 0; /* Z -> E, Q  */
+    table[26 * NUMCHARS + 5] = table[26 * NUMCHARS + 17] = 0.5;
+    table[24 * NUMCHARS + 24] = 0; /* X -> 20 AA */
+    for (l = 0; l < 20; l++)
+        table[24 * NUMCHARS + twenty[l]] = 0.05;
+}
 
-    double ambiguous = 0;
-    int twenty[20] = {65, 67, 68, 69, 70, 71, 72, 73, 75, 76,
-                      77, 78, 80, 81, 82, 83, 84, 86, 87, 89};
-    for (i = 0; i < length; i++) {
 
-        /* zero counters */
-        for (j = 65; j < 91; j++)
-            count[j] = 0;
-        for (j = 97; j < 123; j++)
-            count[j] = 0;
+/* property classes of twenty standard amino acids in order of *twenty*,
+   aliphatic, aromatic, polar, positive, negative, glycine, and proline */
+const int property[20] = {0, 0, 4, 4, 1, 5, 1, 0, 3, 0,
+                          0, 2, 6, 2, 3, 2, 2, 0, 1, 1};
+
+
+static void countBlock(double *counts, char *seq, long number, long length,
+                       long cbeg, long cend, double *weights) {
+
+    /* Count characters of columns from *cbeg* to *cend* of a row-major MSA
+       into NUMCHARS *counts* per column, reading the part of each sequence
+       in the block contiguously.  Letters are counted case insensitively
+       and other characters as gaps.  Sequences are weighted by *weights*
+       when it is not NULL. */
+
+    long i, k, width = cend - cbeg;
+    char *row;
+    double *count, w;
+    unsigned char code[256];
+
+    for (k = 0; k < 256; k++)
+        code[k] = ((k >= 'A' && k <= 'Z') || (k >= 'a' && k <= 'z')) ?
+                  (k & CODEMASK) : 0;
+    memset(counts, 0, width * NUMCHARS * sizeof(double));
+    for (k = 0; k < number; k++) {
+        row = seq + k * length + cbeg;
+        count = counts;
+        if (weights) {
+            w = weights[k];
+            for (i = 0; i < width; i++, count += NUMCHARS)
+                count[code[(unsigned char) row[i]]] += w;
+        } else
+            for (i = 0; i < width; i++, count += NUMCHARS)
+                count[code[(unsigned char) row[i]]]++;
+    }
+}
 
-        /* count characters in a column*/
-        for (j = i; j < size; j += length)
-            count[(int) seq[j]]++;
-        for (j = 65; j < 91; j++)
-            count[j] += count[j + 32];
 
-        /* handle ambiguous amino acids */
-        if (ambiguity) {
-            if (count[66]) {
-                ambiguous = count[66] / 2.; /* B */
-                count[66] = 0;
-                count[68] += ambiguous; /* D */
-                count[78] += ambiguous; /* N */
-            }
-            if (count[90]) {
-                ambiguous = count[90] / 2.; /* Z */
-                count[90] = 0;
-                count[69] += ambiguous; /* E */
-                count[81] += ambiguous; /* Q */
-            }
-            if (count[74]) {
-                ambiguous = count[74] / 2.; /* J */
-                count[74] = 0;
-                count[73] += ambiguous; /* I */
-                count[76] += ambiguous; /* L */
+static void scoreBlock(double **scores, double *counts, double total,
+                       long cbeg, long cend, double *table,
+                       double *background, int omitgaps) {
+
+    /* Calculate conservation scores of columns from *cbeg* to *cend* into
+       arrays of *scores* that are not NULL, indexed by CONS_ENTROPY,
+       CONS_RELENT, CONS_JSD, and CONS_PROPENT, from *counts* of a block of
+       columns that sum to *total*.  Counts are allocated to characters
+       using ambiguity *table*.  Shannon entropy includes gaps unless
+       *omitgaps* is true.  Other scores are calculated for the twenty
+       standard amino acids, relative entropy and Jensen-Shannon divergence
+       with respect to *background* probabilities of them. */
+
+    long i;
+    int a, b;
+    double *count, prob[NUMCHARS], aa[20], prop[PROPERTIES];
+    double probability, shannon, denom, sum, half;
+
+    for (i = 0; i < cend - cbeg; i++) {
+        count = counts + i * NUMCHARS;
+        for (b = 0; b < NUMCHARS; b++)
+            prob[b] = 0;
+        for (a = 1; a < NUMCHARS; a++)
+            if (count[a])
+                for (b = 1; b < NUMCHARS; b++)
+                    prob[b] += count[a] * table[a * NUMCHARS + b];
+
+        if (scores[CONS_ENTROPY]) {
+            shannon = 0;
+            denom = total;
+            if (omitgaps)
+                denom = total - count[0];
+            else if (count[0]) {
+                probability = count[0] / total;
+                shannon += probability * log(probability);
             }
-            if (count[88]) {
-                ambiguous = count[88] / 20.; /* X */
-                count[88] = 0;
-                for (j = 0; j < 20; j++)
-                    count[twenty[j]] += ambiguous;
+            for (b = 1; b < NUMCHARS; b++) {
+                if (prob[b] > 0) {
+                    probability = prob[b] / denom;
+                    shannon += probability * log(probability);
+                }
             }
+            scores[CONS_ENTROPY][cbeg + i] = -shannon;
         }
-        /* non-gap counts */
-        numgap = number;
-        for (j = 65; j < 91; j++)
-            numgap -= count[j];
 
-        shannon = 0;
-        denom = number;
-        if (omitgaps)
-            denom = number - numgap;
-        else if (numgap > 0) {
-            probability = numgap / number;
-            shannon += probability * log(probability);
+        if (!scores[CONS_RELENT] && !scores[CONS_JSD] &&
+            !scores[CONS_PROPENT])
+            continue;
+
+        /*Scores of columns without standard amino acids are zero.*/
+        sum = 0;
+        for (b = 0; b < 20; b++)
+            sum += aa[b] = prob[twenty[b]];
+        for (b = 0; b < 20; b++)
+            aa[b] = sum > 0 ? aa[b] / sum : 0;
+
+        if (scores[CONS_RELENT]) {
+            shannon = 0;
+            for (b = 0; b < 20; b++)
+                if (aa[b] > 0)
+                    shannon += aa[b] * log(aa[b] / background[b]);
+            scores[CONS_RELENT][cbeg + i] = shannon;
+        }
+        if (scores[CONS_JSD]) {
+            shannon = 0;
+            if (sum > 0)
+                for (b = 0; b < 20; b++) {
+                    half = (aa[b] + background[b]) / 2;
+                    if (aa[b] > 0)
+                        shannon += aa[b] * log2(aa[b] / half);
+                    if (background[b] > 0)
+                        shannon += background[b] *
+                                   log2(background[b] / half);
+                }
+            scores[CONS_JSD][cbeg + i] = shannon / 2;
+        }
+        if (scores[CONS_PROPENT]) {
+            for (b = 0; b < PROPERTIES; b++)
+                prop[b] = 0;
+            for (b = 0; b < 20; b++)
+                prop[property[b]] += aa[b];
+            shannon = 0;
+            for (b = 0; b < PROPERTIES; b++)
+                if (prop[b] > 0)
+                    shannon += prop[b] * log(prop[b]);
+            scores[CONS_PROPENT][cbeg + i] = -shannon;
         }
+    }
+}
 
-        for (j = 65; j < 91; j++) {
-            if (count[j] > 0) {
-                probability = count[j] / denom;
-                shannon += probability * log(probability);
-            }
+
+static int calcConservation(double **scores, char *seq, long number,
+                            long length, int ambiguity, int omitgaps,
+                            double *weights, double *background,
+                            int n_threads) {
+
+    /* Calculate conservation scores, see scoreBlock, for a row-major MSA.
+       Columns are split into blocks of up to CONSBLOCK columns, at least
+       one per thread, whose counts stay in cache while sequences stream
+       through.  Sequences are weighted by normalized *weights* when it is
+       not NULL.  GIL must be released by the caller.  Return 0 on memory
+       allocation failure. */
+
+    int failed = 0;
+    long width = (length + n_threads - 1) / n_threads, nblocks;
+    double table[NUMCHARS * NUMCHARS];
+    ambiguityTable(table, ambiguity);
+    if (width > CONSBLOCK)
+        width = CONSBLOCK;
+    if (width < 1)
+        width = 1;
+    nblocks = (length + width - 1) / width;
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long t, cbeg, cend;
+        double *counts = malloc(width * NUMCHARS * sizeof(double));
+        if (!counts) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic,1)
+        #endif
+        for (t = 0; t < nblocks; t++) {
+            if (!counts)
+                continue;
+            cbeg = t * width;
+            cend = cbeg + width < length ? cbeg + width : length;
+            countBlock(counts, seq, number, length, cbeg, cend, weights);
+            scoreBlock(scores, counts, weights ? 1 : number, cbeg, cend,
+                       table, background, omitgaps);
         }
-        ent[i] = -shannon;
+        free(counts);
     }
+    return !failed;
+}
+
+
+static PyObject *msaentropy(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *entropy;
+    int ambiguity = 1, omitgaps = 0, n_threads = 1, filled;
+
+    static char *kwlist[] = {"msa", "entropy", "ambiguity", "omitgaps",
+                             "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iii", kwlist,
+                                     &msa, &entropy, &ambiguity, &omitgaps,
+                                     &n_threads))
+        return NULL;
+
+
+    /* make sure to have a contiguous and well-behaved array */
+    msa = PyArray_GETCONTIGUOUS(msa);
+
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+
+    char *seq = (char *) PyArray_DATA(msa);
+    double *scores[CONS_SCORES] = {NULL, NULL, NULL, NULL};
+    scores[CONS_ENTROPY] = (double *) PyArray_DATA(entropy);
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    filled = calcConservation(scores, seq, number, length, ambiguity,
+                              omitgaps, NULL, NULL, n_threads);
+    Py_END_ALLOW_THREADS
+    Py_XDECREF(msa);
+    if (!filled)
+        return PyErr_NoMemory();
     return Py_BuildValue("O", entropy);
 }
 
 
+static PyObject *msaconserv(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *background;
+    PyObject *arrays[CONS_SCORES] = {Py_None, Py_None, Py_None, Py_None};
+    PyObject *weights = Py_None;
+    int ambiguity = 1, omitgaps = 1, n_threads = 1, filled, score;
+
+    static char *kwlist[] = {"msa", "background", "entropy", "relent", "jsd",
+                             "propent", "ambiguity", "omitgaps", "weights",
+                             "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|OOOOiiOi", kwlist,
+                                     &msa, &background,
+                                     &arrays[CONS_ENTROPY],
+                                     &arrays[CONS_RELENT], &arrays[CONS_JSD],
+                                     &arrays[CONS_PROPENT], &ambiguity,
+                                     &omitgaps, &weights, &n_threads))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    double *scores[CONS_SCORES], *norm_weights = NULL, wsum;
+    for (score = 0; score < CONS_SCORES; score++)
+        scores[score] = arrays[score] == Py_None ? NULL :
+            (double *) PyArray_DATA((PyArrayObject *) arrays[score]);
+    if (weights != Py_None) {
+        norm_weights = normWeights(weights, number, &wsum);
+        if (!norm_weights) {
+            Py_XDECREF(msa);
+            return PyErr_NoMemory();
+        }
+    }
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    filled = calcConservation(scores, (char *) PyArray_DATA(msa), number,
+                              length, ambiguity, omitgaps, norm_weights,
+                              (double *) PyArray_DATA(background), n_threads);
+    Py_END_ALLOW_THREADS
+    Py_XDECREF(msa);
+    free(norm_weights);
+    if (!filled)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+
 static void sortJoint(double **joint) {
 
     /* Sort probability of ambiguous amino acids. */
@@ -380,33 +629,57 @@ static void zeroJoint(double **joint) {
 }
 
 
-static double calcMI(double **joint, double **probs, long i, long j, int dbg) {
+static double **allocJoint(void) {
+
+    /* Allocate a NUMCHARSxNUMCHARS joint array, return NULL on failure. */
+
+    int k, l;
+    double **joint = malloc(NUMCHARS * sizeof(double *));
+    if (!joint)
+        return NULL;
+    for (k = 0; k < NUMCHARS; k++) {
+        joint[k] = malloc(NUMCHARS * sizeof(double));
+        if (!joint[k]) {
+            for (l = 0; l < k; l++)
+                free(joint[l]);
+            free(joint);
+            return NULL;
+        }
+    }
+    return joint;
+}
+
+
+static void freeJoint(double **joint) {
+
+    /* Free memory allocated using allocJoint. */
+
+    int k;
+    if (!joint)
+        return;
+    for (k = 0; k < NUMCHARS; k++)
+        free(joint[k]);
+    free(joint);
+}
+
+
+static double calcMI(double **joint, double **probs, long i, long j) {
 
     /* Calculate mutual information for a pair of columns in MSA. */
 
     int k, l;
     double *jrow, *iprb = probs[i], *jprb = probs[j], jp, mi = 0, inside;
-    /*double isum = 0, jsum = 0, sum = 0;*/
     for (k = 0; k < NUMCHARS; k++) {
         jrow = joint[k];
-        /*isum += iprb[k];
-        jsum += jprb[k];*/
         for (l = 0; l < NUMCHARS; l++) {
             jp = jrow[l];
-            /*sum += jp;*/
             if (jp > 0) {
                 inside = jp / iprb[k] / jprb[l];
                 if (inside != 1)
                     mi += jp * log(inside);
             }
-            /*if (dbg && jp > 0)
-                printf("(%li,%li) %c%c %.4f / %.4f / %.4f\n",
-                        i, j, (char)k+64, (char)l+64, jp, iprb[k], jprb[l]);*/
         }
     }
-    /*if (dbg)
-        if (sum != 1.00000 || isum != 1.00000 || jsum != 1.00000)
-            printf("(%li,%li) %f/%f/%f\n", i, j, sum, isum, jsum);*/
     return mi;
 }
 
@@ -428,6 +701,26 @@ static double jointEntropy(double **joint){
 }
 
 
+static double calcOMES(double **joint, double **probs, long i, long j,
+                       double n) {
+
+    /* Calculate OMES for a pair of columns in MSA. */
+
+    int k, l;
+    double *jrow, *iprb = probs[i], *jprb = probs[j], jp, omes = 0, inside;
+    for (k = 0; k < NUMCHARS; k++) {
+        jrow = joint[k];
+        for (l = 0; l < NUMCHARS; l++) {
+            jp = jrow[l];
+            inside = iprb[k] * jprb[l];
+            if (inside != 0)
+                omes += n * (jp - inside) * (jp - inside) / inside;
+        }
+    }
+    return omes;
+}
+
+
 static void printJoint(double **joint, long k, long l) {
 
     /* Print joint probability matrix for debugging purposes. */
@@ -483,370 +776,841 @@ static void printProbs(double **probs, long length) {
 }
 
 
-static PyObject *msamutinfo(PyObject *self, PyObject *args, PyObject *kwargs) {
-
-    PyArrayObject *msa, *mutinfo;
-    int ambiguity = 1, turbo = 1, debug = 0, norm = 0;
+static double **allocProbs(long length) {
 
-    static char *kwlist[] = {"msa", "mutinfo",
-                             "ambiguity", "turbo", "norm", "debug", NULL};
+    /* Allocate a lengthxNUMCHARS probability array filled with zeros,
+       return NULL on failure. */
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiii", kwlist,
-                                     &msa, &mutinfo,
-                                     &ambiguity, &turbo, &norm, &debug))
+    long i, j;
+    double **probs = malloc(length * sizeof(double *));
+    if (!probs)
         return NULL;
+    for (i = 0; i < length; i++) {
+        probs[i] = calloc(NUMCHARS, sizeof(double));
+        if (!probs[i]) {
+            for (j = 0; j < i; j++)
+                free(probs[j]);
+            free(probs);
+            return NULL;
+        }
+    }
+    return probs;
+}
 
-    /* make sure to have a contiguous and well-behaved array */
-    msa = PyArray_GETCONTIGUOUS(msa);
 
-    /* check dimensions */
-    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+static void freeProbs(double **probs, long length) {
 
-    /* get pointers to data */
-    char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
-    double *mut = (double *) PyArray_DATA(mutinfo);
+    /* Free memory allocated using allocProbs. */
 
+    long i;
+    if (!probs)
+        return;
+    for (i = 0; i < length; i++)
+        free(probs[i]);
+    free(probs);
+}
 
-    long i, j;
-    /* allocate memory */
-    unsigned char *iseq = malloc(number * sizeof(unsigned char));
-    if (!iseq)
-        return PyErr_NoMemory();
 
-    /* hold transpose of the sorted character array */
-    unsigned char **trans = malloc(length * sizeof(unsigned char *));
-    if (!trans) {
-        turbo = 0;
+static void spreadProbs(double *prow) {
+
+    /* Distribute probabilities of ambiguous amino acids in a column. */
+
+    long l;
+    double prb;
+    prb = prow[2];
+    if (prb > 0) { /* B -> D, N  */
+        prb = prb / 2.;
+        prow[4] += prb;
+        prow[14] += prb;
+        prow[2] = 0;
+    }
+    prb = prow[10];
+    if (prb > 0) { /* J -> I, L  */
+        prb = prb / 2.;
+        prow[9] += prb;
+        prow[12] += prb;
+        prow[10] = 0;
+    }
+    prb = prow[26];
+    if (prb > 0) { /* Z -> E, Q  */
+        prb = prb / 2.;
+        prow[5] += prb;
+        prow[17] += prb;
+        prow[26] = 0;
     }
+    if (prow[24] > 0) { /* X -> 20 AA */
+        prb = prow[24] / 20.;
+        for (l = 0; l < 20; l++)
+            prow[twenty[l]] += prb;
+        prow[24] = 0;
+    }
+}
 
-    if (turbo) {
-        /* allocate rows that will store columns of MSA */
-        trans[0] = iseq;
-        for (i = 1; i < length; i++) {
-            trans[i] = malloc(number * sizeof(unsigned char));
-            if (!trans[i]) {
-                for (j = 1; j < i; j++)
-                    free(trans[j]);
-                free(trans);
-                turbo = 0;
-            }
+
+static void calcProbs(double **probs, unsigned char **trans, long number,
+                      long length, int ambiguity, double *weights) {
+
+    /* Calculate probability of observing characters in each column of
+       an encoded MSA, and distribute ambiguous amino acids if requested.
+       Sequences are weighted by normalized *weights* when it is not NULL. */
+
+    long i, k, count[CODEMASK + 1];
+    unsigned char *col;
+    double *prow;
+    for (i = 0; i < length; i++) {
+        prow = probs[i];
+        col = trans[i];
+        if (weights) {
+            for (k = 0; k < NUMCHARS; k++)
+                prow[k] = 0;
+            for (k = 0; k < number; k++)
+                prow[col[k] & CODEMASK] += weights[k];
+        } else {
+            for (k = 0; k <= CODEMASK; k++)
+                count[k] = 0;
+            for (k = 0; k < number; k++)
+                count[col[k] & CODEMASK]++;
+            for (k = 0; k < NUMCHARS; k++)
+                prow[k] = count[k] ? (double) count[k] / number : 0;
         }
+        if (ambiguity)
+            spreadProbs(prow);
     }
-    unsigned char *jseq = iseq; /* so that we don't get uninitialized warning*/
+}
 
-    /* length*27, a row for each column in the MSA */
-    double **probs = malloc(length * sizeof(double *)), *prow;
-    if (!probs) {
-        if (turbo)
-            for (j = 1; j < length; j++)
-                free(trans[j]);
-        free(trans);
-        free(iseq);
-        return PyErr_NoMemory();
+
+/* Pair heaps keep the *size* highest scoring pairs of columns that are at
+   least *separation* apart, with the lowest scoring pair at the root, for
+   top-k output instead of dense matrices.  Ties are broken by column
+   indices, so that results do not depend on the order pairs are pushed. */
+
+typedef struct {
+    double *values;
+    long *rows, *cols, size, count, separation;
+} pairheap;
+
+
+static int lowerPair(pairheap *heap, long a, double value, long i, long j) {
+
+    /* Return true when pair *a* in *heap* ranks below given pair. */
+
+    if (heap->values[a] != value)
+        return heap->values[a] < value;
+    if (heap->rows[a] != i)
+        return heap->rows[a] > i;
+    return heap->cols[a] > j;
+}
+
+
+static void setPair(pairheap *heap, long a, double value, long i, long j) {
+
+    heap->values[a] = value;
+    heap->rows[a] = i;
+    heap->cols[a] = j;
+}
+
+
+static void siftPair(pairheap *heap, long a, long count) {
+
+    /* Move pair *a* down to its place among first *count* pairs. */
+
+    double value = heap->values[a];
+    long i = heap->rows[a], j = heap->cols[a], child;
+    while ((child = 2 * a + 1) < count) {
+        if (child + 1 < count &&
+            lowerPair(heap, child + 1, heap->values[child],
+                      heap->rows[child], heap->cols[child]))
+            child++;
+        if (!lowerPair(heap, child, value, i, j))
+            break;
+        setPair(heap, a, heap->values[child], heap->rows[child],
+                heap->cols[child]);
+        a = child;
     }
+    setPair(heap, a, value, i, j);
+}
 
-    /* 27x27, alphabet characters and a gap*/
-    double **joint = malloc(NUMCHARS * sizeof(double *)), *jrow;
-    if (!joint) {
-        if (turbo)
-            for (j = 1; j < length; j++)
-                free(trans[j]);
-        free(trans);
-        free(iseq);
-        free(probs);
-        return PyErr_NoMemory();
+
+static void pushPair(pairheap *heap, double value, long i, long j) {
+
+    /* Add a pair to *heap* if it ranks among the highest scoring pairs.
+       Pairs closer than separation and NaN values are skipped. */
+
+    long a, parent;
+    if (!heap->size || j - i < heap->separation || value != value)
+        return;
+    if (heap->count == heap->size) {
+        if (!lowerPair(heap, 0, value, i, j))
+            return;
+        setPair(heap, 0, value, i, j);
+        siftPair(heap, 0, heap->count);
+        return;
+    }
+    a = heap->count++;
+    while (a > 0) {
+        parent = (a - 1) / 2;
+        if (lowerPair(heap, parent, value, i, j))
+            break;
+        setPair(heap, a, heap->values[parent], heap->rows[parent],
+                heap->cols[parent]);
+        a = parent;
     }
+    setPair(heap, a, value, i, j);
+}
 
-    for (i = 0; i < length; i++) {
-        prow = malloc(NUMCHARS * sizeof(double));
-        if (!prow) {
-            for (j = 0; j < i; j++)
-                free(probs[j]);
-            free(probs);
-            free(joint);
-            if (turbo)
-                for (j = 1; j < length; j++)
-                    free(trans[j]);
-            free(trans);
-            free(iseq);
-            return PyErr_NoMemory();
-        }
-        probs[i] = prow;
-        for (j = 0; j < NUMCHARS; j++)
-            prow[j] = 0;
+
+static int allocHeaps(pairheap *heaps, pairheap *like, int number) {
+
+    /* Allocate empty *heaps* with sizes and separations of *like* heaps,
+       return 0 on memory allocation failure. */
+
+    int k, failed = 0;
+    for (k = 0; k < number; k++) {
+        heaps[k] = like[k];
+        heaps[k].count = 0;
+        heaps[k].values = malloc((like[k].size + 1) * sizeof(double));
+        heaps[k].rows = malloc((like[k].size + 1) * sizeof(long));
+        heaps[k].cols = malloc((like[k].size + 1) * sizeof(long));
+        if (!heaps[k].values || !heaps[k].rows || !heaps[k].cols)
+            failed = 1;
     }
+    return !failed;
+}
 
-    for (i = 0; i < NUMCHARS; i++)  {
-        joint[i] = malloc(NUMCHARS * sizeof(double));
-        if (!joint[i]) {
-            for (j = 0; j < i; j++)
-                free(joint[j]);
-            free(joint);
-            for (j = 0; j < length; j++)
-                free(probs[j]);
-            free(probs);
-            if (turbo)
-                for (j = 1; j < length; j++)
-                    free(trans[j]);
-            free(trans);
-            free(iseq);
-            return PyErr_NoMemory();
-        }
+
+static void mergeHeaps(pairheap *heaps, pairheap *from, int number) {
+
+    /* Push pairs of *from* heaps into *heaps*, and free *from* arrays. */
+
+    int k;
+    long a;
+    for (k = 0; k < number; k++) {
+        if (heaps[k].values && from[k].values && from[k].rows &&
+            from[k].cols)
+            for (a = 0; a < from[k].count; a++)
+                pushPair(heaps + k, from[k].values[a], from[k].rows[a],
+                         from[k].cols[a]);
+        free(from[k].values);
+        free(from[k].rows);
+        free(from[k].cols);
     }
+}
 
-    if (debug)
-        printProbs(probs, length);
 
-    unsigned char a, b;
-    long k, l, diff, offset;
-    double p_incr = 1. / number, prb = 0;
-    prow = probs[0];
+static long sortHeap(pairheap *heap) {
 
+    /* Sort pairs in *heap* from highest to lowest score, and return their
+       number.  Heap order is lost. */
 
-    /* START mutinfo calculation */
-    /* calculate first row of MI matrix and all column probabilities */
-    i = 0;
-    mut[0] = 0;
-    for (j = 1; j < length; j++) {
-        mut[j * length + j] = 0; /* using empty, so needed for diagonal */
-        jrow = probs[j];
-        zeroJoint(joint);
-        diff = j - 1;
-        if (turbo) /* in turbo mode, there is a row for refined sequences */
-            jseq = trans[j];
-        for (k = 0; k < number; k++) {
-            offset = k * length;
-            if (diff) {
-                a = iseq[k];
-            } else {
-                a = (unsigned char) seq[offset + i];
-                if (a > 90)
-                    a -= 96;
-                else
-                    a -= 64;
-                if (a < 1 || a > 26)
-                    a = 0; /* gap character */
-                iseq[k] = a;
-                prow[a] += p_incr;
-            }
+    long count = heap->count;
+    double value;
+    long i, j;
+    while (count > 1) {
+        count--;
+        value = heap->values[count];
+        i = heap->rows[count];
+        j = heap->cols[count];
+        setPair(heap, count, heap->values[0], heap->rows[0], heap->cols[0]);
+        setPair(heap, 0, value, i, j);
+        siftPair(heap, 0, count);
+    }
+    return heap->count;
+}
 
-            b = (unsigned char) seq[offset + j];
-            if (b > 90)
-                b -= 96;
-            else
-                b -= 64;
-            if (b < 1 || b > 26)
-                b = 0; /* gap character */
-            if (turbo)  /* we keep the refined chars for all sequences*/
-                jseq[k] = b;
-            joint[a][b] += p_incr;
-            jrow[b] += p_incr;
-        }
 
-        if (ambiguity) {
+static void wrapHeap(pairheap *heap, PyObject *arrays, long separation) {
 
-            if (debug)
-                printProbs(probs, length);
-            if (diff)
-                k = j;
-            else
-                k = 0;
-            for (; k <= j; k++) {
-                prow = probs[k];
-                prb = prow[2];
-                if (prb > 0) { /* B -> D, N  */
-                    prb = prb / 2.;
-                    prow[4] += prb;
-                    prow[14] += prb;
-                    prow[2] = 0;
-                }
-                prb = prow[10];
-                if (prb > 0) { /* J -> I, L  */
-                    prb = prb / 2.;
-                    prow[9] += prb;
-                    prow[12] += prb;
-                    prow[10] = 0;
-                }
-                prb = prow[26];
-                if (prb > 0) { /* Z -> E, Q  */
-                    prb = prb / 2.;
-                    prow[5] += prb;
-                    prow[17] += prb;
-                    prow[26] = 0;
-                }
-                if (prow[24] > 0) { /* X -> 20 AA */
-                    prb = prow[24] / 20.;
-                    for (l = 0; l < 20; l++)
-                        prow[twenty[l]] += prb;
-                    prow[24] = 0;
-                }
-            }
+    /* Set *heap* to use (rows, cols, values) tuple of *arrays* as storage,
+       or make it empty when *arrays* is not a tuple. */
 
-            if (debug)
-                printProbs(probs, length);
-            if (debug)
-                printJoint(joint, i, j);
-            sortJoint(joint);
-            if (debug)
-                printJoint(joint, i, j);
-        }
-        if (norm)
-            mut[j] = mut[length * j] = calcMI(joint, probs, i, j, debug) /
-                                      jointEntropy(joint);
-        else
-            mut[j] = mut[length * j] = calcMI(joint, probs, i, j, debug);
+    heap->size = heap->count = 0;
+    heap->separation = separation;
+    if (!PyTuple_Check(arrays))
+        return;
+    heap->rows = (long *) PyArray_DATA((PyArrayObject *)
+                                       PyTuple_GET_ITEM(arrays, 0));
+    heap->cols = (long *) PyArray_DATA((PyArrayObject *)
+                                       PyTuple_GET_ITEM(arrays, 1));
+    heap->values = (double *) PyArray_DATA((PyArrayObject *)
+                                           PyTuple_GET_ITEM(arrays, 2));
+    heap->size = PyArray_DIMS((PyArrayObject *)
+                              PyTuple_GET_ITEM(arrays, 2))[0];
+}
+
+
+/* Pair histograms are counted as integers into HISTLANES flat arrays of
+   HISTSIZE counts indexed by PAIRINDEX, consecutive sequences going into
+   different lanes so that repeated pairs in conserved columns do not wait
+   on the same counter.  Counting order does not matter for integers, so
+   all variants give identical results. */
+
+#define HISTLANES 4
+#define HISTSIZE (NUMCHARS << 5)
+#define PAIRINDEX(a, b) ((((a) & CODEMASK) << 5) | ((b) & CODEMASK))
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_AVX2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SIMD_NEON
+#endif
+
+
+static void scatterPairs(unsigned int *counts, unsigned short *index,
+                         long size) {
+
+    /* Increment counts for *size* pair indices, size is a multiple of 4. */
+
+    long t;
+    for (t = 0; t < size; t += 4) {
+        counts[index[t]]++;
+        counts[HISTSIZE + index[t + 1]]++;
+        counts[2 * HISTSIZE + index[t + 2]]++;
+        counts[3 * HISTSIZE + index[t + 3]]++;
     }
-    if (debug)
-        printProbs(probs, length);
-    if (turbo)
-        free(iseq);
+}
 
 
-    /* calculate rest of MI matrix */
-    long ioffset;
-    for (i = 1; i < length; i++) {
-        ioffset = i * length;
-        if (turbo)
-            iseq = trans[i];
+static long countPairsScalar(unsigned int *counts, unsigned char *iseq,
+                             unsigned char *jseq, long number) {
 
-        for (j = i + 1; j < length; j++) {
-            zeroJoint(joint);
+    /* Count character pairs in a pair of encoded columns, return number of
+       sequences counted, which is *number*. */
 
-            if (turbo) {
-                jseq = trans[j];
-                for (k = 0; k < number; k++)
-                    joint[iseq[k]][jseq[k]] += p_incr;
+    long k;
+    for (k = 0; k + 4 <= number; k += 4) {
+        counts[PAIRINDEX(iseq[k], jseq[k])]++;
+        counts[HISTSIZE + PAIRINDEX(iseq[k + 1], jseq[k + 1])]++;
+        counts[2 * HISTSIZE + PAIRINDEX(iseq[k + 2], jseq[k + 2])]++;
+        counts[3 * HISTSIZE + PAIRINDEX(iseq[k + 3], jseq[k + 3])]++;
+    }
+    for (; k < number; k++)
+        counts[PAIRINDEX(iseq[k], jseq[k])]++;
+    return number;
+}
 
-            } else {
-                diff = j - i - 1;
-                for (k = 0; k < number; k++) {
-                    offset = k * length;
-                    if (diff) {
-                        a = iseq[k];
-                    } else {
-                        a = (unsigned char) seq[offset + i];
-                        if (a > 90)
-                            a -= 96;
-                        else
-                            a -= 64;
-                        if (a < 1 || a > 26)
-                            a = 0; /* gap character */
-                        iseq[k] = a;
-                    }
 
-                    b = (unsigned char) seq[offset + j];
-                    if (b > 90)
-                        b -= 96;
-                    else
-                        b -= 64;
-                    if (b < 1 || b > 26)
-                        b = 0; /* gap character */
-                    joint[a][b] += p_incr;
-                }
-            }
-            if (ambiguity)
-                sortJoint(joint);
-        if (norm)
-            mut[ioffset + j] = mut[i + length * j] =
-                calcMI(joint, probs, i, j, debug) / jointEntropy(joint);
-        else
-            mut[ioffset + j] = mut[i + length * j] =
-                calcMI(joint, probs, i, j, debug);
-        }
+#ifdef SIMD_AVX2
+__attribute__((target("avx2")))
+static long countPairsAVX2(unsigned int *counts, unsigned char *iseq,
+                           unsigned char *jseq, long number) {
+
+    /* Count character pairs using AVX2 to calculate pair indices for 32
+       sequences at a time.  Bytes of the two columns are interleaved and
+       multiply-added with (1, 32), which gives 32 * a + b. */
+
+    long k;
+    unsigned short index[32] __attribute__((aligned(32)));
+    const __m256i mask = _mm256_set1_epi8(CODEMASK);
+    const __m256i mult = _mm256_set1_epi16(32 << 8 | 1);
+    __m256i a, b;
+    for (k = 0; k + 32 <= number; k += 32) {
+        a = _mm256_and_si256(_mm256_loadu_si256((__m256i *) (iseq + k)),
+                             mask);
+        b = _mm256_and_si256(_mm256_loadu_si256((__m256i *) (jseq + k)),
+                             mask);
+        _mm256_store_si256((__m256i *) index,
+            _mm256_maddubs_epi16(_mm256_unpacklo_epi8(b, a), mult));
+        _mm256_store_si256((__m256i *) (index + 16),
+            _mm256_maddubs_epi16(_mm256_unpackhi_epi8(b, a), mult));
+        scatterPairs(counts, index, 32);
+    }
+    _mm256_zeroupper(); /* avoid AVX-SSE transition penalty in libm calls */
+    return k + countPairsScalar(counts, iseq + k, jseq + k, number - k);
+}
+#endif
+
+
+#ifdef SIMD_NEON
+static long countPairsNEON(unsigned int *counts, unsigned char *iseq,
+                           unsigned char *jseq, long number) {
+
+    /* Count character pairs using NEON to calculate pair indices for 16
+       sequences at a time. */
+
+    long k;
+    unsigned short index[16];
+    const uint8x16_t mask = vdupq_n_u8(CODEMASK);
+    uint8x16_t a, b;
+    for (k = 0; k + 16 <= number; k += 16) {
+        a = vandq_u8(vld1q_u8(iseq + k), mask);
+        b = vandq_u8(vld1q_u8(jseq + k), mask);
+        vst1q_u16(index, vorrq_u16(vshll_n_u8(vget_low_u8(a), 5),
+                                   vmovl_u8(vget_low_u8(b))));
+        vst1q_u16(index + 8, vorrq_u16(vshll_n_u8(vget_high_u8(a), 5),
+                                       vmovl_u8(vget_high_u8(b))));
+        scatterPairs(counts, index, 16);
     }
+    return k + countPairsScalar(counts, iseq + k, jseq + k, number - k);
+}
+#endif
 
-    /* free memory */
-    for (i = 0; i < length; i++){
-        free(probs[i]);
+
+/* Sequence comparison kernels count mismatching positions between two
+   rows of residue indices, padded with zeros to a multiple of 32, and
+   stop early once *maxdiff* mismatches are found.  Indices are smaller
+   than 128, so adding 0x7f to a byte of XORed words sets its high bit
+   only when the byte is not zero, without carrying into the next byte. */
+
+#define ROWPAD 32
+#define LOWBITS 0x0101010101010101ULL
+
+
+static long countDiffsScalar(unsigned char *irow, unsigned char *jrow,
+                             long stride, long maxdiff) {
+
+    /* Count mismatches 8 positions at a time. */
+
+    long k, diff = 0;
+    unsigned long long x, y;
+    for (k = 0; k < stride; k += 8) {
+        memcpy(&x, irow + k, 8);
+        memcpy(&y, jrow + k, 8);
+        x = ((x ^ y) + 0x7f * LOWBITS) & (0x80 * LOWBITS);
+        diff += (long) (((x >> 7) * LOWBITS) >> 56);
+        if (diff >= maxdiff)
+            break;
     }
-    free(probs);
-    for (i = 0; i < NUMCHARS; i++){
-        free(joint[i]);
+    return diff;
+}
+
+
+#ifdef SIMD_AVX2
+__attribute__((target("avx2,popcnt")))
+static long countDiffsAVX2(unsigned char *irow, unsigned char *jrow,
+                           long stride, long maxdiff) {
+
+    /* Count mismatches 32 positions at a time using AVX2. */
+
+    long k, diff = 0;
+    __m256i x, y;
+    for (k = 0; k < stride; k += 32) {
+        x = _mm256_loadu_si256((__m256i *) (irow + k));
+        y = _mm256_loadu_si256((__m256i *) (jrow + k));
+        diff += 32 - __builtin_popcount(
+            (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (diff >= maxdiff)
+            break;
     }
-    free(joint);
-    if (turbo)
-        for (j = 1; j < length; j++)
-            free(trans[j]);
-    free(trans);
+    _mm256_zeroupper();
+    return diff;
+}
+#endif
 
-    return Py_BuildValue("O", mutinfo);
+
+#if defined(SIMD_NEON) && defined(__aarch64__)
+static long countDiffsNEON(unsigned char *irow, unsigned char *jrow,
+                           long stride, long maxdiff) {
+
+    /* Count mismatches 16 positions at a time using NEON. */
+
+    long k, diff = 0;
+    uint8x16_t eq;
+    for (k = 0; k < stride; k += 16) {
+        eq = vceqq_u8(vld1q_u8(irow + k), vld1q_u8(jrow + k));
+        diff += 16 - vaddvq_u8(vshrq_n_u8(eq, 7));
+        if (diff >= maxdiff)
+            break;
+    }
+    return diff;
 }
+#endif
 
 
-static PyObject *msaocc(PyObject *self, PyObject *args, PyObject *kwargs) {
+#include "msaunique.h"
+
+
+/* pair counting kernel selected for the running processor on import */
+static long (*countPairs)(unsigned int *, unsigned char *, unsigned char *,
+                          long) = countPairsScalar;
+
+/* sequence comparison kernel selected for the running processor on import */
+static long (*countDiffs)(unsigned char *, unsigned char *, long,
+                          long) = countDiffsScalar;
+
+
+/* Direct information engines for double and single precision correlation
+   matrices, and for processors with AVX2 and FMA instructions. */
+#define REAL double
+#define DIRECT(name) name##Double
+#define DIVECTOR 16
+#define DITARGET
+#include "msadirect.h"
+#define REAL float
+#define DIRECT(name) name##Float
+#define DIVECTOR 16
+#define DITARGET
+#include "msadirect.h"
+#ifdef SIMD_AVX2
+#define REAL double
+#define DIRECT(name) name##DoubleAVX2
+#define DIVECTOR 32
+#define DITARGET __attribute__((target("avx2,fma")))
+#include "msadirect.h"
+#define REAL float
+#define DIRECT(name) name##FloatAVX2
+#define DIVECTOR 32
+#define DITARGET __attribute__((target("avx2,fma")))
+#include "msadirect.h"
+#endif
 
-    PyArrayObject *msa, *occ;
-    int dim;
-    int count = 0;
+/* direct information engines selected for the running processor on import,
+   indexed by single precision flag */
+static int (*directInfo[2])(double *, pairheap *, unsigned char *, double *,
+                            long, long, long, int, double, double, int *,
+                            int) = {directInfoDouble, directInfoFloat};
 
-    static char *kwlist[] = {"msa", "occ", "dim", "count", NULL};
+/* pseudolikelihood maximization engine */
+#include "msaplm.h"
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOi|i", kwlist,
-                                     &msa, &occ, &dim, &count))
-        return NULL;
 
-    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
-    char *seq = (char *) PyArray_DATA(msa), *row, ch;
-    double *cnt = (double *) PyArray_DATA(occ);
+static void selectKernels(void) {
 
-    long i, j, *k;
-    if (dim)
-        k = &j;
-    else
-        k = &i;
+    /* Select SIMD variants of kernels supported by the processor. */
 
-    for (i = 0; i < number; i++) {
-        row = seq + i * length;
-        for (j = 0; j < length; j++) {
-            ch = row[j];
-            if ((64 < ch && ch < 91) || (96 < ch && ch < 123))
-                cnt[*k]++;
+    selectUniqueKernel();
+    #ifdef SIMD_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        countPairs = countPairsAVX2;
+        countDiffs = countDiffsAVX2;
+        if (__builtin_cpu_supports("fma")) {
+            directInfo[0] = directInfoDoubleAVX2;
+            directInfo[1] = directInfoFloatAVX2;
         }
     }
+    #endif
+    #ifdef SIMD_NEON
+    countPairs = countPairsNEON;
+    #ifdef __aarch64__
+    countDiffs = countDiffsNEON;
+    #endif
+    #endif
+}
 
-    if (!count) {
-        double divisor;
-        if (dim)
-            divisor = 1. * number;
-        else
-            divisor = 1. * length;
-        for (i = 0; i < PyArray_DIMS(msa)[dim]; i++)
-            cnt[i] /= divisor;
-    }
-    return Py_BuildValue("O", occ);
+
+static unsigned int *allocCounts(void) {
+
+    /* Allocate pair count lanes, return NULL on failure. */
+
+    return malloc(HISTLANES * HISTSIZE * sizeof(unsigned int));
 }
 
 
-static double calcOMES(double **joint, double **probs, long i, long j, int n) {
+static void countsToJoint(double **joint, unsigned int *counts, long number,
+                          int ambiguity) {
 
-    /* Calculate OMES for a pair of columns in MSA. */
+    /* Convert pair count lanes to joint probability array. */
 
     int k, l;
-    double *jrow, *iprb = probs[i], *jprb = probs[j], jp, omes = 0, inside;
+    unsigned int count, *lane;
+    double *jrow;
     for (k = 0; k < NUMCHARS; k++) {
         jrow = joint[k];
+        lane = counts + (k << 5);
         for (l = 0; l < NUMCHARS; l++) {
-            jp = jrow[l];
-            inside = iprb[k] * jprb[l];
-            if (inside != 0)
-                omes += n * (jp - inside) * (jp - inside) / inside;
+            count = lane[l] + lane[HISTSIZE + l] + lane[2 * HISTSIZE + l] +
+                    lane[3 * HISTSIZE + l];
+            jrow[l] = count ? (double) count / number : 0;
         }
     }
-    return omes;
+    if (ambiguity)
+        sortJoint(joint);
 }
 
 
-static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
+static void fillJoint(double **joint, unsigned int *counts,
+                      double *weights, unsigned char *iseq,
+                      unsigned char *jseq, long number, int ambiguity) {
 
-    PyArrayObject *msa, *omes;
-    int ambiguity = 1, turbo = 1, debug = 0;
+    /* Calculate joint probability array for a pair of encoded columns.
+       Characters pairs are counted into *counts* and converted to
+       probabilities once, or normalized *weights* of sequences are summed
+       when it is not NULL. */
+
+    long k;
+    if (weights) {
+        zeroJoint(joint);
+        for (k = 0; k < number; k++)
+            joint[iseq[k] & CODEMASK][jseq[k] & CODEMASK] += weights[k];
+        if (ambiguity)
+            sortJoint(joint);
+        return;
+    }
+    memset(counts, 0, HISTLANES * HISTSIZE * sizeof(unsigned int));
+    countPairs(counts, iseq, jseq, number);
+    countsToJoint(joint, counts, number, ambiguity);
+}
 
-    static char *kwlist[] = {"msa", "omes",
-                             "ambiguity", "turbo", "debug", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iii", kwlist,
-                                     &msa, &omes,
-                                     &ambiguity, &turbo, &debug))
+static double calcMutinfoPair(double **joint, unsigned int *counts,
+                              double *weights, double **probs,
+                              unsigned char *iseq, unsigned char *jseq,
+                              long number, long i, long j,
+                              int ambiguity, int norm, int debug) {
+
+    /* Calculate mutual information for a pair of encoded columns. */
+
+    fillJoint(joint, counts, weights, iseq, jseq, number, ambiguity);
+    if (debug)
+        printJoint(joint, i, j);
+    if (norm)
+        return calcMI(joint, probs, i, j) / jointEntropy(joint);
+    else
+        return calcMI(joint, probs, i, j);
+}
+
+
+static void storePairStats(double **data, pairheap *heaps, double **joint,
+                           double **probs, long i, long j, long length,
+                           double n) {
+
+    /* Store statistics of a pair of columns from a joint probability array
+       into matrices of *data* that are not NULL, indexed by PAIR_MI,
+       PAIR_NORMMI, PAIR_OMES and PAIR_JOINTENT, or push them into *heaps*
+       of nonzero size when it is not NULL.  MI and joint entropy are
+       calculated once when more than one of them is needed.  *n* is the
+       number of sequences for OMES. */
+
+    double mi = 0, ent = 0;
+    #define wanted(stat) (heaps ? heaps[stat].size > 0 : data[stat] != NULL)
+    #define store(stat, value) if (wanted(stat)) { \
+        if (heaps) \
+            pushPair(heaps + stat, (value), i, j); \
+        else \
+            data[stat][i * length + j] = data[stat][i + length * j] = \
+                (value); }
+    if (heaps && j - i < heaps[0].separation)
+        return;
+    if (wanted(PAIR_MI) || wanted(PAIR_NORMMI))
+        mi = calcMI(joint, probs, i, j);
+    if (wanted(PAIR_NORMMI) || wanted(PAIR_JOINTENT))
+        ent = jointEntropy(joint);
+    store(PAIR_MI, mi);
+    store(PAIR_NORMMI, mi / ent);
+    store(PAIR_OMES, calcOMES(joint, probs, i, j, n));
+    store(PAIR_JOINTENT, ent);
+    #undef store
+    #undef wanted
+}
+
+
+static int fillPairTiles(double **data, pairheap *tops, double **probs,
+                         double *weights, double wsum, unsigned char **trans,
+                         long number, long length, int ambiguity,
+                         int n_threads) {
+
+    /* Calculate pair statistics for all column pairs using *n_threads*
+       workers, see storePairStats.  The triangle is split into TILESIZE wide
+       tiles that are distributed dynamically, each worker uses its own joint
+       array, and its own heaps that are merged into *tops* at the end when
+       it is not NULL.  When normalized *weights* are given, *wsum* is used
+       as the number of sequences for OMES.  GIL must be released by the
+       caller.  Return 0 on memory allocation failure. */
+
+    int failed = 0;
+    long ntiles = (length + TILESIZE - 1) / TILESIZE;
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long t, i, j, ibeg, iend, jbeg, jend;
+        double **joint = allocJoint();
+        unsigned int *counts = allocCounts();
+        pairheap heaps[PAIR_STATS];
+        int ready = !tops || allocHeaps(heaps, tops, PAIR_STATS);
+        if (!joint || !counts || !ready) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (t = 0; t < ntiles * ntiles; t++) {
+            if (!joint || !counts || !ready || t / ntiles > t % ntiles)
+                continue;
+            ibeg = (t / ntiles) * TILESIZE;
+            iend = ibeg + TILESIZE < length ? ibeg + TILESIZE : length;
+            jbeg = (t % ntiles) * TILESIZE;
+            jend = jbeg + TILESIZE < length ? jbeg + TILESIZE : length;
+            for (i = ibeg; i < iend; i++)
+                for (j = i + 1 > jbeg ? i + 1 : jbeg; j < jend; j++) {
+                    fillJoint(joint, counts, weights, trans[i], trans[j],
+                              number, ambiguity);
+                    storePairStats(data, tops ? heaps : NULL, joint, probs,
+                                   i, j, length, weights ? wsum : number);
+                }
+        }
+        if (tops) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            mergeHeaps(tops, heaps, PAIR_STATS);
+        }
+        freeJoint(joint);
+        free(counts);
+    }
+    return !failed;
+}
+
+
+static int fillBlocked(double **data, pairheap *tops, double **probs,
+                       unsigned char **trans, long number, long length,
+                       int ambiguity, int n_threads) {
+
+    /* Calculate pair statistics for all column pairs into matrices of *data*,
+       see storePairStats, using blocked
+       histogramming.  For BLOCKSIZE columns for i and for j, joint counts
+       of all pairs are accumulated over CHUNKSIZE sequences at a time, so
+       that chunks of columns are reused from cache instead of streaming
+       whole columns from memory once per pair.  Blocks are distributed
+       over *n_threads* workers, with their own heaps that are merged into
+       *tops* when it is not NULL.  GIL must be released by the caller.
+       Return 0 on memory allocation failure. */
+
+    int failed = 0;
+    long nblocks = (length + BLOCKSIZE - 1) / BLOCKSIZE;
+    size_t lanes = HISTLANES * HISTSIZE;
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long t, i, j, ibeg, iend, jbeg, jend, kbeg, kend;
+        double **joint = allocJoint();
+        unsigned int *block = malloc(BLOCKSIZE * BLOCKSIZE * lanes *
+                                     sizeof(unsigned int));
+        #define block(x,y) (block + ((x) * BLOCKSIZE + (y)) * lanes)
+        pairheap heaps[PAIR_STATS];
+        int ready = !tops || allocHeaps(heaps, tops, PAIR_STATS);
+        if (!joint || !block || !ready) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (t = 0; t < nblocks * nblocks; t++) {
+            if (!joint || !block || !ready || t / nblocks > t % nblocks)
+                continue;
+            ibeg = (t / nblocks) * BLOCKSIZE;
+            iend = ibeg + BLOCKSIZE < length ? ibeg + BLOCKSIZE : length;
+            jbeg = (t % nblocks) * BLOCKSIZE;
+            jend = jbeg + BLOCKSIZE < length ? jbeg + BLOCKSIZE : length;
+            memset(block, 0, BLOCKSIZE * BLOCKSIZE * lanes *
+                   sizeof(unsigned int));
+            for (kbeg = 0; kbeg < number; kbeg += CHUNKSIZE) {
+                kend = kbeg + CHUNKSIZE < number ? kbeg + CHUNKSIZE : number;
+                for (i = ibeg; i < iend; i++)
+                    for (j = i + 1 > jbeg ? i + 1 : jbeg; j < jend; j++)
+                        countPairs(block(i - ibeg, j - jbeg), trans[i] + kbeg,
+                                   trans[j] + kbeg, kend - kbeg);
+            }
+            for (i = ibeg; i < iend; i++)
+                for (j = i + 1 > jbeg ? i + 1 : jbeg; j < jend; j++) {
+                    countsToJoint(joint, block(i - ibeg, j - jbeg), number,
+                                  ambiguity);
+                    storePairStats(data, tops ? heaps : NULL, joint, probs,
+                                   i, j, length, number);
+                }
+        }
+        #undef block
+        if (tops) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            mergeHeaps(tops, heaps, PAIR_STATS);
+        }
+        freeJoint(joint);
+        free(block);
+    }
+    return !failed;
+}
+
+
+static int calcMutinfoCodes(double *mut, unsigned char *codes, long number,
+                            long length, int ambiguity, int norm, int debug,
+                            int n_threads, int blocked, double *weights) {
+
+    /* Calculate mutual information matrix for an encoded MSA, sequences
+       are weighted by normalized *weights* when it is not NULL.  Return 0
+       on memory allocation failure. */
+
+    long i, j;
+    int filled = 1;
+    double *data[PAIR_STATS] = {NULL};
+    unsigned char **trans = malloc(length * sizeof(unsigned char *));
+    double **probs = allocProbs(length);
+    double **joint = allocJoint();
+    unsigned int *counts = allocCounts();
+    if (!trans || !probs || !joint || !counts) {
+        free(trans);
+        freeProbs(probs, length);
+        freeJoint(joint);
+        free(counts);
+        return 0;
+    }
+    for (i = 0; i < length; i++) {
+        trans[i] = codes + i * number;
+        mut[i * length + i] = 0;
+    }
+
+    calcProbs(probs, trans, number, length, ambiguity, weights);
+    if (debug)
+        printProbs(probs, length);
+
+    n_threads = resolveThreads(n_threads);
+    data[norm ? PAIR_NORMMI : PAIR_MI] = mut;
+    if (blocked && !debug && !weights) {
+        Py_BEGIN_ALLOW_THREADS
+        filled = fillBlocked(data, NULL, probs, trans, number, length,
+                             ambiguity, n_threads);
+        Py_END_ALLOW_THREADS
+    } else if (n_threads > 1 && !debug) {
+        Py_BEGIN_ALLOW_THREADS
+        filled = fillPairTiles(data, NULL, probs, weights, 1, trans, number,
+                               length, ambiguity, n_threads);
+        Py_END_ALLOW_THREADS
+    } else {
+        for (i = 0; i < length; i++)
+            for (j = i + 1; j < length; j++)
+                mut[i * length + j] = mut[i + length * j] =
+                    calcMutinfoPair(joint, counts, weights, probs, trans[i],
+                                    trans[j], number, i, j, ambiguity, norm,
+                                    debug);
+    }
+
+    free(trans);
+    freeProbs(probs, length);
+    freeJoint(joint);
+    free(counts);
+    return filled;
+}
+
+
+static PyObject *msamutinfo(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *mutinfo;
+    PyObject *codes = Py_None, *weights = Py_None;
+    int ambiguity = 1, turbo = 1, debug = 0, norm = 0, n_threads = 1;
+    int blocked = 0;
+
+    static char *kwlist[] = {"msa", "mutinfo", "ambiguity", "turbo", "norm",
+                             "debug", "n_threads", "codes", "blocked",
+                             "weights", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiiiiOiO", kwlist,
+                                     &msa, &mutinfo, &ambiguity, &turbo,
+                                     &norm, &debug, &n_threads, &codes,
+                                     &blocked, &weights))
         return NULL;
 
     /* make sure to have a contiguous and well-behaved array */
@@ -854,10 +1618,47 @@ static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
 
     /* check dimensions */
     long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
 
     /* get pointers to data */
     char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
-    double *data = (double *) PyArray_DATA(omes);
+    double *mut = (double *) PyArray_DATA(mutinfo);
+
+    /* weighted statistics are calculated for encoded MSA only */
+    double wsum, *norm_weights = NULL;
+    if (weights != Py_None) {
+        norm_weights = normWeights(weights, number, &wsum);
+        if (!norm_weights)
+            return PyErr_NoMemory();
+    }
+
+    /* in turbo mode, MSA is encoded once unless codes are provided */
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    else if (turbo || norm_weights) {
+        enc = malloc(number * length * sizeof(unsigned char));
+        if (enc)
+            encodeMSA(seq, enc, number, length);
+    }
+    if (enc) {
+        int filled = calcMutinfoCodes(mut, enc, number, length, ambiguity,
+                                      norm, debug, n_threads, blocked,
+                                      norm_weights);
+        if (codes == Py_None)
+            free(enc);
+        free(norm_weights);
+        if (!filled)
+            return PyErr_NoMemory();
+        return Py_BuildValue("O", mutinfo);
+    }
+    if (norm_weights) {
+        free(norm_weights);
+        return PyErr_NoMemory();
+    }
 
     long i, j;
     /* allocate memory */
@@ -865,107 +1666,39 @@ static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
     if (!iseq)
         return PyErr_NoMemory();
 
-    /* hold transpose of the sorted character array */
-    unsigned char **trans = malloc(length * sizeof(unsigned char *));
-    if (!trans) {
-        turbo = 0;
-    }
-
-    if (turbo) {
-        /* allocate rows that will store columns of MSA */
-        trans[0] = iseq;
-        for (i = 1; i < length; i++) {
-            trans[i] = malloc(number * sizeof(unsigned char));
-            if (!trans[i]) {
-                for (j = 1; j < i; j++)
-                    free(trans[j]);
-                free(trans);
-                turbo = 0;
-            }
-        }
-    }
-    unsigned char *jseq = iseq; /* so that we don't get uninitialized warning*/
-
     /* length*27, a row for each column in the MSA */
-    double **probs = malloc(length * sizeof(double *)), *prow;
+    double **probs = allocProbs(length), *prow;
     if (!probs) {
-        if (turbo)
-            for (j = 1; j < length; j++)
-                free(trans[j]);
-        free(trans);
         free(iseq);
         return PyErr_NoMemory();
     }
 
     /* 27x27, alphabet characters and a gap*/
-    double **joint = malloc(NUMCHARS * sizeof(double *)), *jrow;
+    double **joint = allocJoint(), *jrow;
     if (!joint) {
-        if (turbo)
-            for (j = 1; j < length; j++)
-                free(trans[j]);
-        free(trans);
+        freeProbs(probs, length);
         free(iseq);
-        free(probs);
         return PyErr_NoMemory();
     }
 
-    for (i = 0; i < length; i++) {
-        prow = malloc(NUMCHARS * sizeof(double));
-        if (!prow) {
-            for (j = 0; j < i; j++)
-                free(probs[j]);
-            free(probs);
-            free(joint);
-            if (turbo)
-                for (j = 1; j < length; j++)
-                    free(trans[j]);
-            free(trans);
-            free(iseq);
-            return PyErr_NoMemory();
-        }
-        probs[i] = prow;
-        for (j = 0; j < NUMCHARS; j++)
-            prow[j] = 0;
-    }
-
-    for (i = 0; i < NUMCHARS; i++)  {
-        joint[i] = malloc(NUMCHARS * sizeof(double));
-        if (!joint[i]) {
-            for (j = 0; j < i; j++)
-                free(joint[j]);
-            free(joint);
-            for (j = 0; j < length; j++)
-                free(probs[j]);
-            free(probs);
-            if (turbo)
-                for (j = 1; j < length; j++)
-                    free(trans[j]);
-            free(trans);
-            free(iseq);
-            return PyErr_NoMemory();
-        }
-    }
-
     if (debug)
         printProbs(probs, length);
 
     unsigned char a, b;
     long k, l, diff, offset;
-    double p_incr = 1. / number;
-    double prb = 0;
+    double p_incr = 1. / number, prb = 0;
     prow = probs[0];
 
-    /* START OMES calculation */
-    /* calculate first row of OMES matrix and all column probabilities */
+
+    /* START mutinfo calculation */
+    /* calculate first row of MI matrix and all column probabilities */
     i = 0;
-    data[0] = 0;
+    mut[0] = 0;
     for (j = 1; j < length; j++) {
-        data[j * length + j] = 0; /* using empty, so needed for diagonal */
+        mut[j * length + j] = 0; /* using empty, so needed for diagonal */
         jrow = probs[j];
         zeroJoint(joint);
         diff = j - 1;
-        if (turbo) /* in turbo mode, there is a row for refined sequences */
-            jseq = trans[j];
         for (k = 0; k < number; k++) {
             offset = k * length;
             if (diff) {
@@ -989,8 +1722,6 @@ static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
                 b -= 64;
             if (b < 1 || b > 26)
                 b = 0; /* gap character */
-            if (turbo)  /* we keep the refined chars for all sequences*/
-                jseq[k] = b;
             joint[a][b] += p_incr;
             jrow[b] += p_incr;
         }
@@ -1042,158 +1773,1062 @@ static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
             if (debug)
                 printJoint(joint, i, j);
         }
-        data[j] = data[length * j] = calcOMES(joint, probs, i, j, number);
+        if (norm)
+            mut[j] = mut[length * j] = calcMI(joint, probs, i, j) /
+                                      jointEntropy(joint);
+        else
+            mut[j] = mut[length * j] = calcMI(joint, probs, i, j);
     }
     if (debug)
         printProbs(probs, length);
-    if (turbo)
-        free(iseq);
 
-    /* calculate rest of OMES matrix */
+    /* calculate rest of MI matrix */
     long ioffset;
     for (i = 1; i < length; i++) {
         ioffset = i * length;
-        if (turbo)
-            iseq = trans[i];
 
         for (j = i + 1; j < length; j++) {
             zeroJoint(joint);
-
-            if (turbo) {
-                jseq = trans[j];
-                for (k = 0; k < number; k++)
-                    joint[iseq[k]][jseq[k]] += p_incr;
-
-            } else {
-                diff = j - i - 1;
-                for (k = 0; k < number; k++) {
-                    offset = k * length;
-                    if (diff) {
-                        a = iseq[k];
-                    } else {
-                        a = (unsigned char) seq[offset + i];
-                        if (a > 90)
-                            a -= 96;
-                        else
-                            a -= 64;
-                        if (a < 1 || a > 26)
-                            a = 0; /* gap character */
-                        iseq[k] = a;
-                    }
-
-                    b = (unsigned char) seq[offset + j];
-                    if (b > 90)
-                        b -= 96;
+            diff = j - i - 1;
+            for (k = 0; k < number; k++) {
+                offset = k * length;
+                if (diff) {
+                    a = iseq[k];
+                } else {
+                    a = (unsigned char) seq[offset + i];
+                    if (a > 90)
+                        a -= 96;
                     else
-                        b -= 64;
-                    if (b < 1 || b > 26)
-                        b = 0; /* gap character */
-                    joint[a][b] += p_incr;
+                        a -= 64;
+                    if (a < 1 || a > 26)
+                        a = 0; /* gap character */
+                    iseq[k] = a;
                 }
+
+                b = (unsigned char) seq[offset + j];
+                if (b > 90)
+                    b -= 96;
+                else
+                    b -= 64;
+                if (b < 1 || b > 26)
+                    b = 0; /* gap character */
+                joint[a][b] += p_incr;
             }
             if (ambiguity)
                 sortJoint(joint);
-        data[ioffset + j] = data[i + length * j] =
-        calcOMES(joint, probs, i, j, number);
+            if (norm)
+                mut[ioffset + j] = mut[i + length * j] =
+                    calcMI(joint, probs, i, j) / jointEntropy(joint);
+            else
+                mut[ioffset + j] = mut[i + length * j] =
+                    calcMI(joint, probs, i, j);
         }
     }
 
     /* free memory */
-    for (i = 0; i < length; i++){
-        free(probs[i]);
+    freeProbs(probs, length);
+    freeJoint(joint);
+    free(iseq);
+
+    return Py_BuildValue("O", mutinfo);
+}
+
+
+static PyObject *msaocc(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *occ;
+    int dim;
+    int count = 0;
+
+    static char *kwlist[] = {"msa", "occ", "dim", "count", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOi|i", kwlist,
+                                     &msa, &occ, &dim, &count))
+        return NULL;
+
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    char *seq = (char *) PyArray_DATA(msa), *row, ch;
+    double *cnt = (double *) PyArray_DATA(occ);
+
+    long i, j, *k;
+    if (dim)
+        k = &j;
+    else
+        k = &i;
+
+    for (i = 0; i < number; i++) {
+        row = seq + i * length;
+        for (j = 0; j < length; j++) {
+            ch = row[j];
+            if ((64 < ch && ch < 91) || (96 < ch && ch < 123))
+                cnt[*k]++;
+        }
     }
-    free(probs);
-    for (i = 0; i < NUMCHARS; i++){
-        free(joint[i]);
+
+    if (!count) {
+        double divisor;
+        if (dim)
+            divisor = 1. * number;
+        else
+            divisor = 1. * length;
+        for (i = 0; i < PyArray_DIMS(msa)[dim]; i++)
+            cnt[i] /= divisor;
     }
-    free(joint);
-    if (turbo)
-        for (j = 1; j < length; j++)
-            free(trans[j]);
-    free(trans);
+    return Py_BuildValue("O", occ);
+}
 
-    return Py_BuildValue("O", omes);
+
+static int refineRows(_Bool *rows, _Bool *cols, char *seq, long number,
+                      long length, double rowocc, double seqid,
+                      double colocc, long index, long *counts,
+                      int n_threads) {
+
+    /* Refine *rows* and *cols* masks of a row-major MSA, initially marking
+       all rows and columns selected by label, in three passes over selected
+       characters: rows with occupancy less than *rowocc* in selected
+       columns are deselected, then rows sharing *seqid* or more identity
+       with a row kept before them, except row *index*, and then columns
+       with occupancy less than *colocc* in kept rows.  Negative values
+       skip a step, and *index* is -1 when no row is kept regardless of
+       identity.  Numbers of rows after the first two steps and columns
+       after the last step are set to *counts*.  Selected characters of
+       kept rows are encoded once for identity calculations.  GIL must be
+       released by the caller.  Return 0 on memory allocation failure. */
+
+    long i, j, ncols = 0, nrows = 0, *cindex, *kept, *occ;
+    unsigned char code[256], letter[256], *enc = NULL;
+    int failed = 0;
+
+    for (i = 0; i < 256; i++) {
+        code[i] = ((i >= 'A' && i <= 'Z') || (i >= 'a' && i <= 'z')) ?
+                  (i & CODEMASK) : 0;
+        letter[i] = code[i] != 0;
+    }
+    cindex = malloc((length + 1) * sizeof(long));
+    kept = malloc((number + 1) * sizeof(long));
+    occ = calloc(length + 1, sizeof(long));
+    if (!cindex || !kept || !occ) {
+        free(cindex);
+        free(kept);
+        free(occ);
+        return 0;
+    }
+    for (j = 0; j < length; j++)
+        if (cols[j])
+            cindex[ncols++] = j;
+
+    /*Occupancy is counted over whole rows, read contiguously, and masked by
+      selected columns.*/
+    if (rowocc >= 0) {
+        #ifdef _OPENMP
+        #pragma omp parallel for num_threads(n_threads) schedule(static)
+        #endif
+        for (i = 0; i < number; i++) {
+            long k, count = 0;
+            char *row = seq + i * length;
+            for (k = 0; k < length; k++)
+                count += letter[(unsigned char) row[k]] & cols[k];
+            if ((double) count / ncols < rowocc)
+                rows[i] = 0;
+        }
+    }
+    for (i = 0; i < number; i++)
+        if (rows[i])
+            kept[nrows++] = i;
+    counts[0] = nrows;
+
+    /*Selected characters of kept rows are encoded once for comparison.*/
+    if (seqid >= 0 && nrows) {
+        long stride, *nonzero = malloc(nrows * sizeof(long));
+        _Bool *unq = malloc(nrows * sizeof(_Bool));
+        enc = nonzero && unq ? uniqueRowCodes(seq, length, kept, nrows,
+                                              cindex, ncols, &stride,
+                                              nonzero) : NULL;
+        if (enc) {
+            for (i = 0; i < nrows; i++)
+                unq[i] = 1;
+            uniqueRows(unq, enc, nonzero, nrows, stride, seqid, n_threads);
+            for (i = 0; i < nrows; i++)
+                if (!unq[i] && kept[i] != index)
+                    rows[kept[i]] = 0;
+            nrows = 0;
+            for (i = 0; i < counts[0]; i++)
+                if (rows[kept[i]])
+                    kept[nrows++] = kept[i];
+        } else
+            failed = 1;
+        free(enc);
+        free(unq);
+        free(nonzero);
+    }
+    counts[1] = nrows;
+
+    if (colocc >= 0 && !failed) {
+        #ifdef _OPENMP
+        #pragma omp parallel num_threads(n_threads)
+        #endif
+        {
+            long k, *count = calloc(length + 1, sizeof(long));
+            char *row;
+            if (!count) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                failed = 1;
+            }
+            #ifdef _OPENMP
+            #pragma omp for schedule(static)
+            #endif
+            for (i = 0; i < nrows; i++) {
+                if (!count)
+                    continue;
+                row = seq + kept[i] * length;
+                for (k = 0; k < length; k++)
+                    count[k] += letter[(unsigned char) row[k]];
+            }
+            if (count) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                for (k = 0; k < length; k++)
+                    occ[k] += count[k];
+            }
+            free(count);
+        }
+        for (j = 0; j < length; j++)
+            if (cols[j] && (double) occ[j] / nrows < colocc)
+                cols[j] = 0;
+    }
+    counts[2] = 0;
+    for (j = 0; j < length; j++)
+        counts[2] += cols[j];
+    free(cindex);
+    free(kept);
+    free(occ);
+    return !failed;
 }
 
 
-static PyObject *msasca(PyObject *self, PyObject *args, PyObject *kwargs) {
+static PyObject *msarefine(PyObject *self, PyObject *args, PyObject *kwargs) {
 
-    PyArrayObject *msa, *scainfo;
-    int turbo = 1;
-    static char *kwlist[] = {"msa", "sca", "turbo", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", kwlist,
-                                     &msa, &scainfo, &turbo))
+    PyArrayObject *msa, *rows, *cols;
+    double rowocc = -1, seqid = -1, colocc = -1;
+    long index = -1, counts[3];
+    int n_threads = 1, filled;
+
+    static char *kwlist[] = {"msa", "rows", "cols", "rowocc", "seqid",
+                             "colocc", "index", "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|dddli", kwlist,
+                                     &msa, &rows, &cols, &rowocc, &seqid,
+                                     &colocc, &index, &n_threads))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    filled = refineRows((_Bool *) PyArray_DATA(rows),
+                        (_Bool *) PyArray_DATA(cols),
+                        (char *) PyArray_DATA(msa), number, length, rowocc,
+                        seqid, colocc, index, counts, n_threads);
+    Py_END_ALLOW_THREADS
+    Py_XDECREF(msa);
+    if (!filled)
+        return PyErr_NoMemory();
+    return Py_BuildValue("(lll)", counts[0], counts[1], counts[2]);
+}
+
+
+static PyObject *msatake(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    /* Copy rows *rows* and columns *cols* of *msa* into *out*, a contiguous
+       character array of shape (len(rows), len(cols)). */
+
+    PyObject *arg_rows, *arg_cols;
+    PyArrayObject *msa, *out, *rows = NULL, *cols = NULL;
+
+    static char *kwlist[] = {"msa", "rows", "cols", "out", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!OOO!", kwlist,
+                                     &PyArray_Type, &msa, &arg_rows,
+                                     &arg_cols, &PyArray_Type, &out))
+        return NULL;
+
+    rows = (PyArrayObject *) PyArray_FROMANY(arg_rows, NPY_INTP, 1, 1,
+                                             NPY_ARRAY_IN_ARRAY);
+    cols = (PyArrayObject *) PyArray_FROMANY(arg_cols, NPY_INTP, 1, 1,
+                                             NPY_ARRAY_IN_ARRAY);
+    if (!rows || !cols) {
+        Py_XDECREF(rows);
+        Py_XDECREF(cols);
         return NULL;
+    }
+    npy_intp nrows = PyArray_DIMS(rows)[0], ncols = PyArray_DIMS(cols)[0];
+    if (PyArray_NDIM(msa) != 2 || PyArray_ITEMSIZE(msa) != 1 ||
+        PyArray_NDIM(out) != 2 || PyArray_ITEMSIZE(out) != 1 ||
+        !PyArray_IS_C_CONTIGUOUS(out) || PyArray_DIMS(out)[0] != nrows ||
+        PyArray_DIMS(out)[1] != ncols) {
+        Py_DECREF(rows);
+        Py_DECREF(cols);
+        PyErr_SetString(PyExc_ValueError, "msa and out must be 2D character "
+                        "arrays, and out must be contiguous with a row for "
+                        "each row index and a column for each column index");
+        return NULL;
+    }
+
+    npy_intp number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    npy_intp *ridx = (npy_intp *) PyArray_DATA(rows);
+    npy_intp *cidx = (npy_intp *) PyArray_DATA(cols);
+    npy_intp i, k;
+    for (i = 0; i < nrows; i++)
+        if (ridx[i] < 0 || ridx[i] >= number)
+            break;
+    for (k = 0; k < ncols; k++)
+        if (cidx[k] < 0 || cidx[k] >= length)
+            break;
+    if (i < nrows || k < ncols) {
+        Py_DECREF(rows);
+        Py_DECREF(cols);
+        PyErr_SetString(PyExc_IndexError, "row or column index out of range");
+        return NULL;
+    }
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    char *seq = (char *) PyArray_DATA(msa), *dst = (char *) PyArray_DATA(out);
+    npy_intp nruns = 0, *runs = malloc(2 * (ncols + 1) * sizeof(npy_intp));
+    char *row;
+    if (!runs) {
+        Py_DECREF(msa);
+        Py_DECREF(rows);
+        Py_DECREF(cols);
+        return PyErr_NoMemory();
+    }
+
+    /* consecutive columns are copied at once, as runs of start and size */
+    for (k = 0; k < ncols; nruns++) {
+        runs[2 * nruns] = cidx[k];
+        runs[2 * nruns + 1] = 1;
+        while (++k < ncols && cidx[k] == cidx[k - 1] + 1)
+            runs[2 * nruns + 1]++;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < nrows; i++) {
+        row = seq + ridx[i] * length;
+        for (k = 0; k < nruns; k++) {
+            memcpy(dst, row + runs[2 * k], runs[2 * k + 1]);
+            dst += runs[2 * k + 1];
+        }
+    }
+    Py_END_ALLOW_THREADS
+    free(runs);
+    Py_DECREF(msa);
+    Py_DECREF(rows);
+    Py_DECREF(cols);
+    return Py_BuildValue("O", out);
+}
+
+
+static int calcOMESCodes(double *data, unsigned char *codes, long number,
+                         long length, int ambiguity, int debug, int blocked,
+                         double *weights, double wsum) {
+
+    /* Calculate OMES matrix for an encoded MSA.  When *weights* is not NULL,
+       sequences are weighted by normalized weights and sum of weights *wsum*
+       is used as the number of sequences.  Return 0 on memory allocation
+       failure. */
+
+    long i, j;
+    unsigned char **trans = malloc(length * sizeof(unsigned char *));
+    double **probs = allocProbs(length);
+    double **joint = allocJoint();
+    unsigned int *counts = allocCounts();
+    if (!trans || !probs || !joint || !counts) {
+        free(trans);
+        freeProbs(probs, length);
+        freeJoint(joint);
+        free(counts);
+        return 0;
+    }
+    for (i = 0; i < length; i++) {
+        trans[i] = codes + i * number;
+        data[i * length + i] = 0;
+    }
+
+    calcProbs(probs, trans, number, length, ambiguity, weights);
+    if (debug)
+        printProbs(probs, length);
+
+    if (blocked && !debug && !weights) {
+        int filled;
+        double *stats[PAIR_STATS] = {NULL};
+        stats[PAIR_OMES] = data;
+        Py_BEGIN_ALLOW_THREADS
+        filled = fillBlocked(stats, NULL, probs, trans, number, length,
+                             ambiguity, 1);
+        Py_END_ALLOW_THREADS
+        free(trans);
+        freeProbs(probs, length);
+        freeJoint(joint);
+        free(counts);
+        return filled;
+    }
+
+    for (i = 0; i < length; i++) {
+        for (j = i + 1; j < length; j++) {
+            fillJoint(joint, counts, weights, trans[i], trans[j], number,
+                      ambiguity);
+            if (debug)
+                printJoint(joint, i, j);
+            data[i * length + j] = data[i + length * j] =
+                calcOMES(joint, probs, i, j, weights ? wsum : number);
+        }
+    }
+
+    free(trans);
+    freeProbs(probs, length);
+    freeJoint(joint);
+    free(counts);
+    return 1;
+}
+
+
+static PyObject *msaomes(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *omes;
+    PyObject *codes = Py_None, *weights = Py_None;
+    int ambiguity = 1, turbo = 1, debug = 0, blocked = 0;
+
+    static char *kwlist[] = {"msa", "omes", "ambiguity", "turbo", "debug",
+                             "codes", "blocked", "weights", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiiOiO", kwlist,
+                                     &msa, &omes, &ambiguity, &turbo,
+                                     &debug, &codes, &blocked, &weights))
+        return NULL;
+
     /* make sure to have a contiguous and well-behaved array */
     msa = PyArray_GETCONTIGUOUS(msa);
+
     /* check dimensions */
     long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+
     /* get pointers to data */
     char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
-    double *sca = (double *) PyArray_DATA(scainfo);
+    double *data = (double *) PyArray_DATA(omes);
 
-    long i, j, k;
-    double q[NUMCHARS] = {0., 0.073, 0., 0.025, 0.05, 0.061, 0.042, 0.072,
-        0.023, 0.053, 0., 0.064, 0.089, 0.023, 0.043, 0., 0.052, 0.04, 0.052,
-        0.073, 0.056, 0., 0.063, 0.013, 0., 0.033, 0.};
-    int qlist[21] = {0, 1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13,
-                        14, 16, 17, 18, 19, 20, 22, 23, 25};
+    /* weighted statistics are calculated for encoded MSA only */
+    double wsum = 0, *norm_weights = NULL;
+    if (weights != Py_None) {
+        norm_weights = normWeights(weights, number, &wsum);
+        if (!norm_weights)
+            return PyErr_NoMemory();
+    }
 
-    /* weighted probability matrix length*27 */
-    double **wprob = malloc(length * sizeof(double *));
-    if (!wprob)
+    /* in turbo mode, MSA is encoded once unless codes are provided */
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    else if (turbo || norm_weights) {
+        enc = malloc(number * length * sizeof(unsigned char));
+        if (enc)
+            encodeMSA(seq, enc, number, length);
+    }
+    if (enc) {
+        int filled = calcOMESCodes(data, enc, number, length, ambiguity,
+                                   debug, blocked, norm_weights, wsum);
+        if (codes == Py_None)
+            free(enc);
+        free(norm_weights);
+        if (!filled)
+            return PyErr_NoMemory();
+        return Py_BuildValue("O", omes);
+    }
+    if (norm_weights) {
+        free(norm_weights);
+        return PyErr_NoMemory();
+    }
+
+    long i, j;
+    /* allocate memory */
+    unsigned char *iseq = malloc(number * sizeof(unsigned char));
+    if (!iseq)
+        return PyErr_NoMemory();
+
+    /* length*27, a row for each column in the MSA */
+    double **probs = allocProbs(length), *prow;
+    if (!probs) {
+        free(iseq);
         return PyErr_NoMemory();
+    }
+
+    /* 27x27, alphabet characters and a gap*/
+    double **joint = allocJoint(), *jrow;
+    if (!joint) {
+        freeProbs(probs, length);
+        free(iseq);
+        return PyErr_NoMemory();
+    }
+
+    if (debug)
+        printProbs(probs, length);
+
+    unsigned char a, b;
+    long k, l, diff, offset;
+    double p_incr = 1. / number;
+    double prb = 0;
+    prow = probs[0];
+
+    /* START OMES calculation */
+    /* calculate first row of OMES matrix and all column probabilities */
+    i = 0;
+    data[0] = 0;
+    for (j = 1; j < length; j++) {
+        data[j * length + j] = 0; /* using empty, so needed for diagonal */
+        jrow = probs[j];
+        zeroJoint(joint);
+        diff = j - 1;
+        for (k = 0; k < number; k++) {
+            offset = k * length;
+            if (diff) {
+                a = iseq[k];
+            } else {
+                a = (unsigned char) seq[offset + i];
+                if (a > 90)
+                    a -= 96;
+                else
+                    a -= 64;
+                if (a < 1 || a > 26)
+                    a = 0; /* gap character */
+                iseq[k] = a;
+                prow[a] += p_incr;
+            }
+
+            b = (unsigned char) seq[offset + j];
+            if (b > 90)
+                b -= 96;
+            else
+                b -= 64;
+            if (b < 1 || b > 26)
+                b = 0; /* gap character */
+            joint[a][b] += p_incr;
+            jrow[b] += p_incr;
+        }
+
+        if (ambiguity) {
+
+            if (debug)
+                printProbs(probs, length);
+            if (diff)
+                k = j;
+            else
+                k = 0;
+            for (; k <= j; k++) {
+                prow = probs[k];
+                prb = prow[2];
+                if (prb > 0) { /* B -> D, N  */
+                    prb = prb / 2.;
+                    prow[4] += prb;
+                    prow[14] += prb;
+                    prow[2] = 0;
+                }
+                prb = prow[10];
+                if (prb > 0) { /* J -> I, L  */
+                    prb = prb / 2.;
+                    prow[9] += prb;
+                    prow[12] += prb;
+                    prow[10] = 0;
+                }
+                prb = prow[26];
+                if (prb > 0) { /* Z -> E, Q  */
+                    prb = prb / 2.;
+                    prow[5] += prb;
+                    prow[17] += prb;
+                    prow[26] = 0;
+                }
+                if (prow[24] > 0) { /* X -> 20 AA */
+                    prb = prow[24] / 20.;
+                    for (l = 0; l < 20; l++)
+                        prow[twenty[l]] += prb;
+                    prow[24] = 0;
+                }
+            }
+
+            if (debug)
+                printProbs(probs, length);
+            if (debug)
+                printJoint(joint, i, j);
+            sortJoint(joint);
+            if (debug)
+                printJoint(joint, i, j);
+        }
+        data[j] = data[length * j] = calcOMES(joint, probs, i, j, number);
+    }
+    if (debug)
+        printProbs(probs, length);
+
+    /* calculate rest of OMES matrix */
+    long ioffset;
+    for (i = 1; i < length; i++) {
+        ioffset = i * length;
+
+        for (j = i + 1; j < length; j++) {
+            zeroJoint(joint);
+            diff = j - i - 1;
+            for (k = 0; k < number; k++) {
+                offset = k * length;
+                if (diff) {
+                    a = iseq[k];
+                } else {
+                    a = (unsigned char) seq[offset + i];
+                    if (a > 90)
+                        a -= 96;
+                    else
+                        a -= 64;
+                    if (a < 1 || a > 26)
+                        a = 0; /* gap character */
+                    iseq[k] = a;
+                }
+
+                b = (unsigned char) seq[offset + j];
+                if (b > 90)
+                    b -= 96;
+                else
+                    b -= 64;
+                if (b < 1 || b > 26)
+                    b = 0; /* gap character */
+                joint[a][b] += p_incr;
+            }
+            if (ambiguity)
+                sortJoint(joint);
+            data[ioffset + j] = data[i + length * j] =
+                calcOMES(joint, probs, i, j, number);
+        }
+    }
+
+    /* free memory */
+    freeProbs(probs, length);
+    freeJoint(joint);
+    free(iseq);
 
-    /* each row of weighted probability */
+    return Py_BuildValue("O", omes);
+}
+
+
+static int calcCoevolCodes(double **data, pairheap *tops, double *entropy,
+                           unsigned char *codes, long number, long length,
+                           int ambiguity, int omitgaps, int n_threads,
+                           int blocked, double *weights, double wsum) {
+
+    /* Calculate pair statistics requested by matrices of *data* that are
+       not NULL, or by *tops* heaps of nonzero size when it is not NULL, see
+       storePairStats, and column entropies when *entropy* is not NULL, for
+       an encoded MSA.  Joint probabilities of each pair are calculated once
+       for all statistics, and pairs in heaps are sorted by score.  Return 0
+       on memory allocation failure. */
+
+    long i, k;
+    int stat, filled;
+    double p, gaps, ent;
+    unsigned char **trans = malloc(length * sizeof(unsigned char *));
+    double **probs = allocProbs(length);
+    if (!trans || !probs) {
+        free(trans);
+        freeProbs(probs, length);
+        return 0;
+    }
     for (i = 0; i < length; i++) {
-        wprob[i] = malloc(NUMCHARS * sizeof(double));
-        if (!wprob[i]) {
-            for (j = 0; j < i; j++)
-                free(wprob[j]);
-            free(wprob);
+        trans[i] = codes + i * number;
+        for (stat = 0; stat < PAIR_STATS; stat++)
+            if (data[stat] && !tops)
+                data[stat][i * length + i] = 0;
+    }
+    calcProbs(probs, trans, number, length, ambiguity, weights);
+
+    /* gap probability is excluded and others are adjusted for *omitgaps* */
+    if (entropy)
+        for (i = 0; i < length; i++) {
+            gaps = omitgaps ? probs[i][0] : 0;
+            ent = 0;
+            for (k = omitgaps ? 1 : 0; k < NUMCHARS; k++) {
+                p = probs[i][k];
+                if (p > 0) {
+                    p /= 1 - gaps;
+                    ent -= p * log(p);
+                }
+            }
+            entropy[i] = ent;
+        }
+
+    filled = 1;
+    for (stat = 0; stat < PAIR_STATS; stat++)
+        if (tops ? tops[stat].size > 0 : data[stat] != NULL)
+            break;
+    if (stat < PAIR_STATS) {
+        n_threads = resolveThreads(n_threads);
+        Py_BEGIN_ALLOW_THREADS
+        if (blocked && !weights)
+            filled = fillBlocked(data, tops, probs, trans, number, length,
+                                 ambiguity, n_threads);
+        else
+            filled = fillPairTiles(data, tops, probs, weights, wsum, trans,
+                                   number, length, ambiguity, n_threads);
+        if (tops)
+            for (stat = 0; stat < PAIR_STATS; stat++)
+                sortHeap(tops + stat);
+        Py_END_ALLOW_THREADS
+    }
+
+    free(trans);
+    freeProbs(probs, length);
+    return filled;
+}
+
+
+static PyObject *msacoevol(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa;
+    PyObject *codes = Py_None, *weights = Py_None, *entropy = Py_None;
+    PyObject *arrays[PAIR_STATS] = {Py_None, Py_None, Py_None, Py_None};
+    int ambiguity = 1, omitgaps = 1, n_threads = 1, blocked = 0, stat;
+    long separation = 1;
+
+    static char *kwlist[] = {"msa", "mutinfo", "normmi", "omes", "jointent",
+                             "entropy", "ambiguity", "omitgaps", "n_threads",
+                             "codes", "blocked", "weights", "separation",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOOOOiiiOiOl", kwlist,
+                                     &msa, &arrays[PAIR_MI],
+                                     &arrays[PAIR_NORMMI], &arrays[PAIR_OMES],
+                                     &arrays[PAIR_JOINTENT], &entropy,
+                                     &ambiguity, &omitgaps, &n_threads,
+                                     &codes, &blocked, &weights, &separation))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+    double *data[PAIR_STATS], *ent = NULL, wsum = 0, *norm_weights = NULL;
+
+    /* a statistic is given a matrix, or (rows, cols, values) arrays for the
+       highest scoring pairs, in which case all are given such arrays */
+    pairheap tops[PAIR_STATS], *top = NULL;
+    for (stat = 0; stat < PAIR_STATS; stat++) {
+        data[stat] = NULL;
+        wrapHeap(tops + stat, arrays[stat], separation);
+        if (PyTuple_Check(arrays[stat]))
+            top = tops;
+        else if (arrays[stat] != Py_None)
+            data[stat] = (double *) PyArray_DATA((PyArrayObject *)
+                                                 arrays[stat]);
+    }
+    if (entropy != Py_None)
+        ent = (double *) PyArray_DATA((PyArrayObject *) entropy);
+    if (weights != Py_None) {
+        norm_weights = normWeights(weights, number, &wsum);
+        if (!norm_weights) {
+            Py_XDECREF(msa);
             return PyErr_NoMemory();
         }
-        for (j = 0; j < NUMCHARS; j++)
-            wprob[i][j] = 0;
     }
 
-    /* single column probability */
-    double *prob;
+    /* MSA is encoded once unless codes are provided */
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    else {
+        enc = malloc(number * length * sizeof(unsigned char));
+        if (enc)
+            encodeMSA((char *) PyArray_DATA(msa), enc, number, length);
+    }
+    Py_XDECREF(msa);
+    int filled = enc && calcCoevolCodes(data, top, ent, enc, number, length,
+                                        ambiguity, omitgaps, n_threads,
+                                        blocked, norm_weights, wsum);
+    if (codes == Py_None)
+        free(enc);
+    free(norm_weights);
+    if (!filled)
+        return PyErr_NoMemory();
+    return Py_BuildValue("(llll)", tops[PAIR_MI].count,
+                         tops[PAIR_NORMMI].count, tops[PAIR_OMES].count,
+                         tops[PAIR_JOINTENT].count);
+}
 
-    /* weighted x~ matrix array */
-    double **wx = malloc(length * sizeof(double *));
-    if (!turbo)
-        free(wx);
-    if (!wx)
-        turbo = 0;
-    if (turbo) {
+
+/* Coevolution counts keep integer counts of character pairs of each pair
+   of columns, (i, j) with i < j at row TRIANGLE(i, j, length), and of
+   characters of each column, so that sequences can be added or removed
+   and statistics recalculated without the sequences counted before. */
+
+#define TRIANGLE(i, j, l) ((i) * (l) - (i) * ((i) + 1) / 2 + (j) - (i) - 1)
+
+
+static int addPairCounts(unsigned int *pairs, unsigned int *columns,
+                         unsigned char *codes, long number, long length,
+                         int remove, int n_threads) {
+
+    /* Add counts of an encoded MSA to *pairs* and *columns*, or subtract
+       them when *remove* is true.  Rows of the triangle are distributed
+       over *n_threads* workers.  GIL must be released by the caller.
+       Return 0 on memory allocation failure. */
+
+    long i, k;
+    int failed = 0;
+    unsigned int *col;
+    for (i = 0; i < length; i++) {
+        col = columns + i * NUMCHARS;
+        for (k = 0; k < number; k++)
+            if (remove)
+                col[codes[i * number + k] & CODEMASK]--;
+            else
+                col[codes[i * number + k] & CODEMASK]++;
+    }
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long i, j, a, b;
+        unsigned int *counts = allocCounts(), *lane, *pair, count;
+        if (!counts) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic,1)
+        #endif
         for (i = 0; i < length; i++) {
-            wx[i] = malloc(number * sizeof(double));
-            if (!wx[i]) {
-                for (j = 0; j < i; j++)
-                    free(wx[j]);
-                free(wx);
-                turbo = 0;
+            if (!counts)
+                continue;
+            for (j = i + 1; j < length; j++) {
+                memset(counts, 0, HISTLANES * HISTSIZE *
+                       sizeof(unsigned int));
+                countPairs(counts, codes + i * number, codes + j * number,
+                           number);
+                pair = pairs + TRIANGLE(i, j, length) * NUMCHARS * NUMCHARS;
+                for (a = 0; a < NUMCHARS; a++) {
+                    lane = counts + (a << 5);
+                    for (b = 0; b < NUMCHARS; b++) {
+                        count = lane[b] + lane[HISTSIZE + b] +
+                                lane[2 * HISTSIZE + b] +
+                                lane[3 * HISTSIZE + b];
+                        if (remove)
+                            pair[a * NUMCHARS + b] -= count;
+                        else
+                            pair[a * NUMCHARS + b] += count;
+                    }
+                }
             }
         }
+        free(counts);
+    }
+    return !failed;
+}
+
+
+static int fillCountStats(double **data, unsigned int *pairs,
+                          unsigned int *columns, long number, long length,
+                          int ambiguity, int n_threads) {
+
+    /* Calculate pair statistics requested by matrices of *data* that are
+       not NULL, see storePairStats, from counts of *number* sequences.
+       Rows of the triangle are distributed over *n_threads* workers.  GIL
+       must be released by the caller.  Return 0 on memory allocation
+       failure. */
+
+    long i, k;
+    int stat, failed = 0;
+    double **probs = allocProbs(length);
+    if (!probs)
+        return 0;
+    for (i = 0; i < length; i++) {
+        for (k = 0; k < NUMCHARS; k++)
+            probs[i][k] = columns[i * NUMCHARS + k] ?
+                (double) columns[i * NUMCHARS + k] / number : 0;
+        if (ambiguity)
+            spreadProbs(probs[i]);
+        for (stat = 0; stat < PAIR_STATS; stat++)
+            if (data[stat])
+                data[stat][i * length + i] = 0;
+    }
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long i, j, a, b;
+        unsigned int *pair, count;
+        double **joint = allocJoint();
+        if (!joint) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic,1)
+        #endif
+        for (i = 0; i < length; i++) {
+            if (!joint)
+                continue;
+            for (j = i + 1; j < length; j++) {
+                pair = pairs + TRIANGLE(i, j, length) * NUMCHARS * NUMCHARS;
+                for (a = 0; a < NUMCHARS; a++)
+                    for (b = 0; b < NUMCHARS; b++) {
+                        count = pair[a * NUMCHARS + b];
+                        joint[a][b] = count ? (double) count / number : 0;
+                    }
+                if (ambiguity)
+                    sortJoint(joint);
+                storePairStats(data, NULL, joint, probs, i, j, length,
+                               number);
+            }
+        }
+        freeJoint(joint);
+    }
+    freeProbs(probs, length);
+    return !failed;
+}
+
+
+static PyObject *msapaircounts(PyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+
+    PyArrayObject *msa, *pairs, *columns;
+    PyObject *codes = Py_None;
+    int remove = 0, n_threads = 1, filled;
+
+    static char *kwlist[] = {"msa", "pairs", "columns", "remove", "codes",
+                             "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|iOi", kwlist,
+                                     &msa, &pairs, &columns, &remove, &codes,
+                                     &n_threads))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
     }
+    unsigned int *pcounts = (unsigned int *) PyArray_DATA(pairs);
+    unsigned int *ccounts = (unsigned int *) PyArray_DATA(columns);
+
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    else {
+        enc = malloc(number * length * sizeof(unsigned char));
+        if (enc)
+            encodeMSA((char *) PyArray_DATA(msa), enc, number, length);
+    }
+    Py_XDECREF(msa);
+    if (!enc)
+        return PyErr_NoMemory();
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    filled = addPairCounts(pcounts, ccounts, enc, number, length, remove,
+                           n_threads);
+    Py_END_ALLOW_THREADS
+    if (codes == Py_None)
+        free(enc);
+    if (!filled)
+        return PyErr_NoMemory();
+    return Py_BuildValue("l", number);
+}
+
+
+static PyObject *msacountstats(PyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+
+    PyArrayObject *pairs, *columns;
+    PyObject *arrays[PAIR_STATS] = {Py_None, Py_None, Py_None, Py_None};
+    long number;
+    int ambiguity = 1, n_threads = 1, stat, filled;
+
+    static char *kwlist[] = {"pairs", "columns", "number", "mutinfo",
+                             "normmi", "omes", "jointent", "ambiguity",
+                             "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOl|OOOOii", kwlist,
+                                     &pairs, &columns, &number,
+                                     &arrays[PAIR_MI], &arrays[PAIR_NORMMI],
+                                     &arrays[PAIR_OMES],
+                                     &arrays[PAIR_JOINTENT], &ambiguity,
+                                     &n_threads))
+        return NULL;
+
+    long length = PyArray_DIMS(columns)[0];
+    double *data[PAIR_STATS];
+    for (stat = 0; stat < PAIR_STATS; stat++)
+        data[stat] = arrays[stat] == Py_None ? NULL :
+            (double *) PyArray_DATA((PyArrayObject *) arrays[stat]);
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    filled = fillCountStats(data, (unsigned int *) PyArray_DATA(pairs),
+                            (unsigned int *) PyArray_DATA(columns), number,
+                            length, ambiguity, n_threads);
+    Py_END_ALLOW_THREADS
+    if (!filled)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+
+static void calcSCATable(double *table, double *mean, char *seq,
+                         unsigned char *enc, long number, long length,
+                         double *w, double wsum) {
+
+    /* Fill *table* (length x NUMCHARS) with weighted conservation values x~
+       of each residue code in each column, and *mean* with their weighted
+       average over sequences when it is not NULL.  Sequences are weighted
+       by *w* that sum to *wsum*, or counted once when *w* is NULL.  Encoded
+       MSA *enc* is used when it is not NULL. */
+
+    #define code(x,y) ((enc ? enc[(y) * number + (x)] : \
+                        encodeChar(seq[(x) * length + (y)])) & CODEMASK)
+
+    long i, j, k;
+    double q[NUMCHARS] = {0., 0.073, 0., 0.025, 0.05, 0.061, 0.042, 0.072,
+        0.023, 0.053, 0., 0.064, 0.089, 0.023, 0.043, 0., 0.052, 0.04, 0.052,
+        0.073, 0.056, 0., 0.063, 0.013, 0., 0.033, 0.};
+    int qlist[21] = {0, 1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13,
+                        14, 16, 17, 18, 19, 20, 22, 23, 25};
 
     /* build weighted probability prob */
     for (i = 0; i < length; i++){
-        prob = wprob[i];
-        double phi[NUMCHARS];
+        double *prob = table + i * NUMCHARS;
+        double phi[NUMCHARS], freq[NUMCHARS];
         for (j = 0; j < NUMCHARS; j++){
             prob[j] = 0.0;
-            phi[i] = 0.0;
+            phi[j] = 0.0;
         }
         for (j=0; j<number; j++){
-            int temp = seq[j * length + i];
-            temp = (temp > 96) ?  temp - 97 : temp - 65;
-            if ((temp >= 0) && (temp <= 25))
-                prob[temp + 1] += 1.0 ;
+            int temp = code(j, i);
+            if (temp)
+                prob[temp] += w ? w[j] : 1.0 ;
         }
+        /* dividing sums of weights keeps conserved columns at exactly 1 */
         for (j=0; j<NUMCHARS; j++){
-            prob[j] = prob[j] / number;
+            prob[j] = prob[j] / wsum;
+            freq[j] = prob[j];
         }
         if (prob[2] > 0){ /* B -> D, N  */
             prob[4] += prob[2] / 2.;
@@ -1245,15 +2880,91 @@ static PyObject *msasca(PyObject *self, PyObject *args, PyObject *kwargs) {
             sum += prob[twenty[k]];
         sum = sum / 20.0;
         prob[24] = sum;
-        if (turbo){
-            for (j = 0; j < number; j++){
-                int temp = seq[j * length + i];
-                temp = (temp > 96) ? temp - 97 : temp - 65;
-                if (temp >= 0 && temp <= 25)
-                    wx[i][j] = prob[temp + 1];
-                else
-                    wx[i][j] = 0.0;
+
+        /* gaps have value 0, and are left out of the average */
+        if (mean) {
+            mean[i] = 0.0;
+            for (j = 1; j < NUMCHARS; j++)
+                mean[i] += freq[j] * prob[j];
+        }
+    }
+    #undef code
+}
+
+
+static PyObject *msasca(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *scainfo;
+    PyObject *codes = Py_None, *weights = Py_None;
+    int turbo = 1;
+    static char *kwlist[] = {"msa", "sca", "turbo", "codes", "weights", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iOO", kwlist,
+                                     &msa, &scainfo, &turbo, &codes,
+                                     &weights))
+        return NULL;
+    /* make sure to have a contiguous and well-behaved array */
+    msa = PyArray_GETCONTIGUOUS(msa);
+    /* check dimensions */
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+    /* get pointers to data */
+    char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
+    double *sca = (double *) PyArray_DATA(scainfo);
+
+    /* sequences are weighted by normalized weights, or by 1 / number */
+    double wsum = number, *w = NULL, *pw = NULL;
+    if (weights != Py_None) {
+        w = (double *) PyArray_DATA((PyArrayObject *) weights);
+        pw = normWeights(weights, number, &wsum);
+        if (!pw)
+            return PyErr_NoMemory();
+    }
+
+    /* in turbo mode, MSA is encoded once unless codes are provided */
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    else if (turbo) {
+        enc = malloc(number * length * sizeof(unsigned char));
+        if (enc)
+            encodeMSA(seq, enc, number, length);
+    }
+    #define code(x,y) ((enc ? enc[(y) * number + (x)] : \
+                        encodeChar(seq[(x) * length + (y)])) & CODEMASK)
+
+    long i, j, k;
+
+    /* weighted probability matrix length*27 */
+    double *table = malloc(length * NUMCHARS * sizeof(double));
+    if (!table) {
+        if (codes == Py_None)
+            free(enc);
+        free(pw);
+        return PyErr_NoMemory();
+    }
+    calcSCATable(table, NULL, seq, enc, number, length, w, wsum);
+
+    /* weighted x~ matrix array */
+    double **wx = malloc(length * sizeof(double *));
+    if (!turbo)
+        free(wx);
+    if (!wx)
+        turbo = 0;
+    if (turbo) {
+        for (i = 0; i < length; i++) {
+            wx[i] = malloc(number * sizeof(double));
+            if (!wx[i]) {
+                for (j = 0; j < i; j++)
+                    free(wx[j]);
+                free(wx);
+                turbo = 0;
+                break;
             }
+            for (j = 0; j < number; j++)
+                wx[i][j] = table[i * NUMCHARS + code(j, i)];
         }
     }
 
@@ -1264,30 +2975,34 @@ static PyObject *msasca(PyObject *self, PyObject *args, PyObject *kwargs) {
             if (turbo){
                 icol=wx[i];
                 jcol=wx[j];
-                for (k=0; k< number; k++){
-                    sumi += icol[k];
-                    sumj += jcol[k];
-                    sum += icol[k]*jcol[k];
-                }
+                if (pw)
+                    for (k=0; k< number; k++){
+                        sumi += pw[k]*icol[k];
+                        sumj += pw[k]*jcol[k];
+                        sum += pw[k]*icol[k]*jcol[k];
+                    }
+                else
+                    for (k=0; k< number; k++){
+                        sumi += icol[k];
+                        sumj += jcol[k];
+                        sum += icol[k]*jcol[k];
+                    }
             }
             else{
                 for (k = 0; k < number; k++){
-                    int tempi = (seq[k*length + i] > 96) ?
-                    seq[k * length + i] - 97 : seq[k * length + i] - 65;
-                    double xi = (tempi >= 0 && tempi <= 25) ?
-                        wprob[i][tempi + 1] : wprob[i][0];
-                    int tempj = (seq[k * length + j] > 96) ?
-                        seq[k * length + j] - 97 : seq[k * length + j] - 65;
-                    double xj = (tempj >= 0 && tempj <= 25) ?
-                        wprob[j][tempj + 1] : wprob[j][0];
-                    sumi += xi;
-                    sumj += xj;
-                    sum += xi * xj;
+                    double xi = table[i * NUMCHARS + code(k, i)];
+                    double xj = table[j * NUMCHARS + code(k, j)];
+                    double wk = pw ? pw[k] : 1.0;
+                    sumi += wk * xi;
+                    sumj += wk * xj;
+                    sum += wk * xi * xj;
                 }
             }
-            sum /= number;
-            sumj /= number;
-            sumi /= number;
+            if (!pw) {
+                sum /= number;
+                sumj /= number;
+                sumi /= number;
+            }
             sum = sum - sumi * sumj;
             sum = sum >= 0 ? sum : -sum ;
             sca[i * length + j] = sca[j * length + i] = sum;
@@ -1295,130 +3010,607 @@ static PyObject *msasca(PyObject *self, PyObject *args, PyObject *kwargs) {
     }
 
     /* free memory */
-    for (j = 1; j < length; j++)
-        free(wprob[j]);
-    free(wprob);
+    free(table);
     if (turbo){
-        for (j = 1; j < length; j++)
+        for (j = 0; j < length; j++)
             free(wx[j]);
         free(wx);
     }
+    if (codes == Py_None)
+        free(enc);
+    free(pw);
+    #undef code
 
     return Py_BuildValue("O", scainfo);
 }
 
 
-static PyObject *msameff(PyObject *self, PyObject *args, PyObject *kwargs) {
+static PyObject *msascatable(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
 
-    PyArrayObject *msa,*pythonw;
-    double theta = 0.0;
-    int meff_only = 1, refine = 0;
-    int alignlist[26] = {1, 0, 2, 3, 4, 5, 6, 7, 8, 0, 9, 10, 11, 12,
-             0, 13, 14, 15, 16, 17, 0, 18, 19, 0, 20, 0};
-    static char *kwlist[] = {"msa", "theta", "meff_only", "refine", "w", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Odii|O", kwlist,
-                                     &msa, &theta, &meff_only, &refine,
-                                     &pythonw))
+    PyArrayObject *msa, *table, *mean;
+    PyObject *codes = Py_None, *weights = Py_None;
+    static char *kwlist[] = {"msa", "table", "mean", "codes", "weights",
+                             NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO|OO", kwlist,
+                                     &msa, &table, &mean, &codes, &weights))
+        return NULL;
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long k, number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+    double wsum = number, *w = NULL;
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    if (weights != Py_None) {
+        w = (double *) PyArray_DATA((PyArrayObject *) weights);
+        wsum = 0;
+        for (k = 0; k < number; k++)
+            wsum += w[k];
+    }
+
+    calcSCATable((double *) PyArray_DATA(table),
+                 (double *) PyArray_DATA(mean), (char *) PyArray_DATA(msa),
+                 enc, number, length, w, wsum);
+
+    Py_XDECREF(msa);
+    return Py_BuildValue("OO", table, mean);
+}
+
+
+static PyObject *msascarows(PyObject *self, PyObject *args,
+                            PyObject *kwargs) {
+
+    PyArrayObject *msa, *table, *mean, *chunk;
+    PyObject *codes = Py_None, *scale = Py_None;
+    long start = 0;
+    static char *kwlist[] = {"msa", "table", "mean", "chunk", "start",
+                             "codes", "scale", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOO|lOO", kwlist,
+                                     &msa, &table, &mean, &chunk, &start,
+                                     &codes, &scale))
         return NULL;
-    /* make sure to have a contiguous and well-behaved array */
     msa = PyArray_GETCONTIGUOUS(msa);
-    /* check dimensions */
     long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
-    long i, j, k, l = 0;
-    /* get pointers to data */
-    char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+    long size = PyArray_DIMS(chunk)[1], count, i, k;
+    char *seq = (char *) PyArray_DATA(msa);
+    double *tab = (double *) PyArray_DATA(table);
+    double *avg = (double *) PyArray_DATA(mean), *sc = NULL, *row;
+    float *x = (float *) PyArray_DATA(chunk), *col;
+    unsigned char *enc = NULL, *ecol;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    if (scale != Py_None)
+        sc = (double *) PyArray_DATA((PyArrayObject *) scale);
+
+    /* Columns of *chunk* (length x size) are filled with centered values of
+       sequences from *start*, scaled by square roots of normalized weights,
+       so that product of the chunk with its transpose is its contribution
+       to the covariance matrix. */
+    count = number - start < size ? number - start : size;
+    if (count < 0)
+        count = 0;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < length; i++) {
+        row = tab + i * NUMCHARS;
+        col = x + i * size;
+        if (enc) {
+            ecol = enc + i * number + start;
+            for (k = 0; k < count; k++)
+                col[k] = (float) (row[ecol[k] & CODEMASK] - avg[i]);
+        } else
+            for (k = 0; k < count; k++)
+                col[k] = (float) (row[encodeChar(seq[(start + k) * length +
+                                                      i]) & CODEMASK] -
+                                  avg[i]);
+        if (sc)
+            for (k = 0; k < count; k++)
+                col[k] *= (float) sc[start + k];
+        for (k = count; k < size; k++)
+            col[k] = 0;
+    }
+    Py_END_ALLOW_THREADS
+
+    Py_XDECREF(msa);
+    return Py_BuildValue("l", count);
+}
 
-    /*Set ind and get l first.*/
-    int *ind = malloc(length * sizeof(int));
-    if (!ind) {
-        return PyErr_NoMemory();
+
+static int upperIndex(char *seq, unsigned char *enc, long number,
+                      long length, long i, long j) {
+
+    /* Return alphabet index (0 for A) of the upper case character at row *i*
+       and column *j*, or -1 for all other characters.  Encoded MSA *enc* is
+       used when it is not NULL. */
+
+    if (enc) {
+        unsigned char c = enc[j * number + i];
+        return (c && !(c & CODELOWER)) ? c - 1 : -1;
+    } else {
+        char ch = seq[i * length + j];
+        return (ch >= 65 && ch <= 90) ? ch - 65 : -1;
     }
+}
 
-    if (!refine){
-        for (i = 0; i < length; i++){
-            l += 1;
-            ind[i] = l;
+
+static int countNeighbors(long *nbrs, unsigned char *rows, long number,
+                          long stride, long maxdiff, int n_threads) {
+
+    /* Count neighbors of each sequence, i.e. sequences that have fewer than
+       *maxdiff* mismatches.  Rows are compared by *n_threads* workers that
+       count neighbors in their own arrays, which are summed at the end.
+       GIL must be released by the caller.  Return 0 on memory allocation
+       failure. */
+
+    int failed = 0;
+    long n;
+    for (n = 0; n < number; n++)
+        nbrs[n] = 0;
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long i, j, *count = calloc(number, sizeof(long));
+        unsigned char *irow;
+        if (!count) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            failed = 1;
+        }
+
+        #ifdef _OPENMP
+        #pragma omp for schedule(dynamic, 16)
+        #endif
+        for (i = 0; i < number; i++) {
+            if (!count)
+                continue;
+            irow = rows + i * stride;
+            for (j = i + 1; j < number; j++)
+                if (countDiffs(irow, rows + j * stride, stride,
+                               maxdiff) < maxdiff) {
+                    count[i]++;
+                    count[j]++;
+                }
+        }
+
+        if (count) {
+            #ifdef _OPENMP
+            #pragma omp critical
+            #endif
+            for (i = 0; i < number; i++)
+                nbrs[i] += count[i];
+            free(count);
         }
     }
-    else{
-        for (i = 0; i < length; i++){
-            if (seq[i] <= 90 && seq[i] >= 65){
-                l += 1;
-                ind[i] = l;
+    return !failed;
+}
+
+
+/* Approximate neighbor counting hashes sequences into buckets by residues
+   at *band_size* randomly sampled positions, repeated for *bands* bands.
+   Only pairs sharing a bucket in at least one band are compared, and
+   identical sequences are compared once. */
+
+typedef struct {
+    unsigned long long key;
+    long index;
+} keyindex;
+
+
+static int compareKeys(const void *a, const void *b) {
+
+    /* Compare key and index pairs for sorting. */
+
+    const keyindex *x = (const keyindex *) a, *y = (const keyindex *) b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+
+static int comparePairs(const void *a, const void *b) {
+
+    /* Compare packed pairs of unique sequence indices for sorting. */
+
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : (x > y);
+}
+
+
+static unsigned long long hashBytes(unsigned long long hash,
+                                    unsigned char byte) {
+
+    /* Add a byte to FNV-1a hash. */
+
+    return (hash ^ byte) * 1099511628211ULL;
+}
+
+
+static unsigned long long nextRandom(unsigned long long *state) {
+
+    /* Return next number from xorshift64* generator. */
+
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+
+static long uniquePairs(unsigned long long *pairs, long npairs) {
+
+    /* Sort pairs and remove duplicates, return number of unique pairs. */
+
+    long n, m = 0;
+    qsort(pairs, npairs, sizeof(unsigned long long), comparePairs);
+    for (n = 0; n < npairs; n++)
+        if (!m || pairs[n] != pairs[m - 1])
+            pairs[m++] = pairs[n];
+    return m;
+}
+
+
+static long groupRows(long *group, long *uniq, long *mult, keyindex *keys,
+                      unsigned char *rows, long number, long stride, long l) {
+
+    /* Assign identical rows to the same group, and set index of the first
+       row in each group in *uniq* and number of rows in *mult*.  Return
+       number of groups. */
+
+    long i, j, k, n, nuniq = 0, first = 0;
+    unsigned long long key;
+    for (i = 0; i < number; i++) {
+        key = 14695981039346656037ULL;
+        for (k = 0; k < l; k++)
+            key = hashBytes(key, rows[i * stride + k]);
+        keys[i].key = key;
+        keys[i].index = i;
+    }
+    qsort(keys, number, sizeof(keyindex), compareKeys);
+    for (n = 0; n < number; n++) {
+        i = keys[n].index;
+        /* groups with the same hash start from index first */
+        if (!n || keys[n - 1].key != keys[n].key)
+            first = nuniq;
+        group[i] = -1;
+        for (j = first; j < nuniq; j++)
+            if (!memcmp(rows + uniq[j] * stride, rows + i * stride, l)) {
+                group[i] = j;
+                break;
             }
-            else
-                ind[i] = 0;
+        if (group[i] < 0) {
+            uniq[nuniq] = i;
+            mult[nuniq] = 0;
+            group[i] = nuniq++;
         }
+        mult[group[i]]++;
     }
+    return nuniq;
+}
 
-    /*Use l to set align and w size.*/
-    int *align = malloc(number * l * sizeof(int));
-    if (!align) {
-        free(ind);
-        return PyErr_NoMemory();
+
+static unsigned long long *collectPairs(long *npairs, keyindex *keys,
+                                        unsigned char *rows, long *uniq,
+                                        long nuniq, long stride, long l,
+                                        int bands, int band_size,
+                                        unsigned long long seed) {
+
+    /* Return sorted array of unique pairs of groups, packed as
+       first << 32 | second, that share a bucket in at least one band, and
+       set their number in *npairs*.  Return NULL on memory allocation
+       failure. */
+
+    long i, j, k, n, capacity = nuniq + 1024, count = 0;
+    int t;
+    unsigned long long key, state = seed ? seed : 1, *more;
+    unsigned long long *pairs = malloc(capacity * sizeof(unsigned long long));
+    long *pos = malloc((band_size > 0 ? band_size : 1) * sizeof(long));
+    if (!pairs || !pos) {
+        free(pairs);
+        free(pos);
+        return NULL;
     }
-    for (i = 0; i < number * l; i++){
-        align[i] = 0;
+
+    for (t = 0; t < bands; t++) {
+        for (k = 0; k < band_size; k++)
+            pos[k] = (long) (nextRandom(&state) % (unsigned long long) l);
+        for (n = 0; n < nuniq; n++) {
+            key = 14695981039346656037ULL;
+            for (k = 0; k < band_size; k++)
+                key = hashBytes(key, rows[uniq[n] * stride + pos[k]]);
+            keys[n].key = key;
+            keys[n].index = n;
+        }
+        qsort(keys, nuniq, sizeof(keyindex), compareKeys);
+        /* pairs within each bucket, i.e. run of equal keys */
+        for (n = 0; n < nuniq; n = j) {
+            for (j = n + 1; j < nuniq && keys[j].key == keys[n].key; j++)
+                ;
+            for (i = n; i < j; i++)
+                for (k = i + 1; k < j; k++) {
+                    if (count == capacity) {
+                        count = uniquePairs(pairs, count);
+                        if (count > capacity / 2) {
+                            more = realloc(pairs, 2 * capacity *
+                                           sizeof(unsigned long long));
+                            if (!more) {
+                                free(pairs);
+                                free(pos);
+                                return NULL;
+                            }
+                            pairs = more;
+                            capacity *= 2;
+                        }
+                    }
+                    pairs[count++] =
+                        (unsigned long long) keys[i].index << 32 |
+                        (unsigned long long) keys[k].index;
+                }
+        }
     }
-    double *w = malloc(number * sizeof(double));
-    if (!w) {
-        free(ind);
-        free(align);
-        return PyErr_NoMemory();
+    free(pos);
+    *npairs = uniquePairs(pairs, count);
+    return pairs;
+}
+
+
+static int countNeighborsLSH(long *nbrs, unsigned char *rows, long number,
+                             long stride, long l, long maxdiff, int bands,
+                             int band_size, unsigned long long seed,
+                             int n_threads) {
+
+    /* Count neighbors of each sequence among sequences that share a bucket
+       with it, see countNeighbors.  Identical sequences are neighbors of
+       each other.  GIL must be released by the caller.  Return 0 on memory
+       allocation failure. */
+
+    long i, nuniq, npairs = 0;
+    int failed = 0;
+    unsigned long long *pairs = NULL;
+    for (i = 0; i < number; i++)
+        nbrs[i] = 0;
+    if (maxdiff <= 0)
+        return 1;
+
+    keyindex *keys = malloc(number * sizeof(keyindex));
+    long *group = malloc(number * sizeof(long));
+    long *uniq = malloc(number * sizeof(long));
+    long *mult = malloc(number * sizeof(long));
+    long *count = calloc(number, sizeof(long));
+    if (!keys || !group || !uniq || !mult || !count) {
+        free(keys);
+        free(group);
+        free(uniq);
+        free(mult);
+        free(count);
+        return 0;
+    }
+
+    nuniq = groupRows(group, uniq, mult, keys, rows, number, stride, l);
+    pairs = collectPairs(&npairs, keys, rows, uniq, nuniq, stride, l,
+                         bands, band_size, seed);
+    free(keys);
+    if (!pairs)
+        failed = 1;
+    else {
+        #ifdef _OPENMP
+        #pragma omp parallel num_threads(n_threads)
+        #endif
+        {
+            long p, u, v, *local = calloc(nuniq, sizeof(long));
+            if (!local) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                failed = 1;
+            }
+
+            #ifdef _OPENMP
+            #pragma omp for schedule(dynamic, 1024)
+            #endif
+            for (p = 0; p < npairs; p++) {
+                if (!local)
+                    continue;
+                u = (long) (pairs[p] >> 32);
+                v = (long) (pairs[p] & 0xffffffffULL);
+                if (countDiffs(rows + uniq[u] * stride,
+                               rows + uniq[v] * stride, stride,
+                               maxdiff) < maxdiff) {
+                    local[u] += mult[v];
+                    local[v] += mult[u];
+                }
+            }
+
+            if (local) {
+                #ifdef _OPENMP
+                #pragma omp critical
+                #endif
+                for (p = 0; p < nuniq; p++)
+                    count[p] += local[p];
+                free(local);
+            }
+        }
+    }
+
+    if (!failed)
+        for (i = 0; i < number; i++)
+            nbrs[i] = mult[group[i]] - 1 + count[group[i]];
+    free(group);
+    free(uniq);
+    free(mult);
+    free(count);
+    free(pairs);
+    return !failed;
+}
+
+
+static unsigned char *buildRows(char *seq, unsigned char *enc, long number,
+                                long length, int refine, long *l,
+                                long *stride) {
+
+    /* Return rows of residue indices (1 for A to 20 for Y, and 0 for all
+       other characters) for sequences in *seq*, or NULL on memory allocation
+       failure.  When *refine* is true, columns that are not upper case in the
+       first sequence are skipped.  Number of columns is set to *l*, and rows
+       are padded with zeros to *stride* bytes, a multiple of ROWPAD. */
+
+    int upper;
+    int alignlist[26] = {1, 0, 2, 3, 4, 5, 6, 7, 8, 0, 9, 10, 11, 12,
+             0, 13, 14, 15, 16, 17, 0, 18, 19, 0, 20, 0};
+    long i, j;
+
+    /*Set ind and get l first.*/
+    int *ind = malloc(length * sizeof(int));
+    if (!ind)
+        return NULL;
+
+    *l = 0;
+    for (i = 0; i < length; i++){
+        if (!refine || upperIndex(seq, enc, number, length, 0, i) >= 0){
+            *l += 1;
+            ind[i] = *l;
+        }
+        else
+            ind[i] = 0;
     }
 
-    #define align(x,y) align[(x)*l+(y)]
+    /*Use l to set rows of residue indices, padded with zeros.*/
+    *stride = (*l + ROWPAD - 1) / ROWPAD * ROWPAD;
+    if (!*stride)
+        *stride = ROWPAD;
+    unsigned char *rows = calloc(number * *stride, sizeof(unsigned char));
+    if (!rows) {
+        free(ind);
+        return NULL;
+    }
 
-    /*Set align matrix*/
     for (i = 0; i < number; i++){
         for (j = 0; j < length; j++){
             if (ind[j] != 0){
-                if (seq[i*length+j] >= 65 && seq[i*length+j] <= 90)
-                    align(i,ind[j]-1) = alignlist[seq[i*length+j] - 65];
-                else
-                    align(i,ind[j]-1) = 0;
+                upper = upperIndex(seq, enc, number, length, i, j);
+                if (upper >= 0)
+                    rows[i * *stride + ind[j] - 1] = alignlist[upper];
             }
         }
     }
+    free(ind);
+    return rows;
+}
 
-    /*Calculate weight(w) for each sequence, sum of w is Meff*/
-    for (i = 0; i < number; i++)
-        w[i] = 1.;
-    for (i = 0; i < number; i++)
-        for (j = i+1; j < number; j++){
-            double temp = 0.;
-            for (k = 0; k < l; k++){
-                if (align(i,k) != align(j,k))
-                    temp += 1.;
-            }
-            temp /= l;
-            if (temp < theta){
-                w[i] += 1.;
-                w[j] += 1.;
-            }
+
+static double calcWeights(double *w, unsigned char *rows, long number,
+                          long stride, long l, double theta, int n_threads,
+                          int bands, int band_size, unsigned long long seed) {
+
+    /* Fill *w* with weights of sequences in *rows* and return their sum,
+       Meff, or -1 on memory allocation failure.  GIL must be released by
+       the caller. */
+
+    long i, *nbrs = malloc(number * sizeof(long));
+    int filled;
+    if (!nbrs)
+        return -1;
+
+    /*Sequences are similar when fraction of mismatches is less than theta,
+      i.e. when they have fewer than maxdiff mismatches.*/
+    long maxdiff = l + 1;
+    for (i = 0; i <= l; i++)
+        if ((double) i / l >= theta) {
+            maxdiff = i;
+            break;
         }
+    if (!l)
+        maxdiff = 0;
+
+    /*Calculate weight(w) for each sequence, sum of w is Meff.  Neighbors
+      are approximated using buckets of sequences when bands is given.*/
+    if (bands > 0)
+        filled = countNeighborsLSH(nbrs, rows, number, stride, l, maxdiff,
+                                   bands, band_size, seed, n_threads);
+    else
+        filled = countNeighbors(nbrs, rows, number, stride, maxdiff,
+                                n_threads);
+    if (!filled) {
+        free(nbrs);
+        return -1;
+    }
     double meff = 0.0;
     for (i = 0; i < number; i++){
-        w[i] = 1./ w[i];
+        w[i] = 1./ (1. + nbrs[i]);
         meff += w[i];
     }
+    free(nbrs);
+    return meff;
+}
+
+
+static PyObject *msameff(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa,*pythonw;
+    PyObject *codes = Py_None;
+    double theta = 0.0, meff;
+    int meff_only = 1, refine = 0, n_threads = 1;
+    int bands = 0, band_size = 0;
+    unsigned long long seed = 1;
+    static char *kwlist[] = {"msa", "theta", "meff_only", "refine", "w",
+                             "codes", "n_threads", "bands", "band_size",
+                             "seed", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Odii|OOiiiK", kwlist,
+                                     &msa, &theta, &meff_only, &refine,
+                                     &pythonw, &codes, &n_threads, &bands,
+                                     &band_size, &seed))
+        return NULL;
+    /* make sure to have a contiguous and well-behaved array */
+    msa = PyArray_GETCONTIGUOUS(msa);
+    /* check dimensions */
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
+    long i, l, stride;
+    /* get pointers to data */
+    char *seq = (char *) PyArray_DATA(msa); /*size: number x length */
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+
+    unsigned char *rows = buildRows(seq, enc, number, length, refine,
+                                    &l, &stride);
+    double *w = malloc(number * sizeof(double));
+    if (!rows || !w) {
+        free(rows);
+        free(w);
+        return PyErr_NoMemory();
+    }
 
-    #undef align
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    meff = calcWeights(w, rows, number, stride, l, theta, n_threads,
+                       bands, band_size, seed);
+    Py_END_ALLOW_THREADS
+    free(rows);
+    if (meff < 0) {
+        free(w);
+        return PyErr_NoMemory();
+    }
 
     /*Clean up memory.*/
-    free(ind);
     if (meff_only == 1){
-        free(align);
         free(w);
         return Py_BuildValue("d", meff);
     }
-    else if (meff_only == 2){
-        for (i = 0; i < number; i++)
-            w[i] /= meff;
-        return Py_BuildValue("dllll", meff, number, l , w, align);
-    }
     else {
-        free(align);
         pythonw = PyArray_GETCONTIGUOUS(pythonw);
         double *pw = (double *) PyArray_DATA(pythonw);
         for (i = 0; i < number; i++){
@@ -1432,16 +3624,24 @@ static PyObject *msameff(PyObject *self, PyObject *args, PyObject *kwargs) {
 
 static PyObject *msadipretest(PyObject *self, PyObject *args, PyObject *kwargs) {
     PyArrayObject *msa;
-    int refine = 0;
+    PyObject *codes = Py_None;
+    int refine = 0, upper;
     int alignlist[26] = {1, 0, 2, 3, 4, 5, 6, 7, 8, 0, 9, 10, 11, 12,
              0, 13, 14, 15, 16, 17, 0, 18, 19, 0, 20, 0};
-    static char *kwlist[] = {"msa", "refine", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi", kwlist,
-                                     &msa, &refine))
+    static char *kwlist[] = {"msa", "refine", "codes", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|O", kwlist,
+                                     &msa, &refine, &codes))
         return NULL;
     msa = PyArray_GETCONTIGUOUS(msa);
     long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
     char *seq = (char *) PyArray_DATA(msa);
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
     long i, j, k = 0, l = 0;
     int *ind = malloc(length * sizeof(int));
     if (!ind)
@@ -1453,7 +3653,7 @@ static PyObject *msadipretest(PyObject *self, PyObject *args, PyObject *kwargs)
     }
     else
         for (i = 0; i < length; i++)
-            if (seq[i] <= 90 && seq[i] >= 65){
+            if (upperIndex(seq, enc, number, length, 0, i) >= 0){
                 l += 1;
                 ind[i] = l;
             }
@@ -1461,218 +3661,200 @@ static PyObject *msadipretest(PyObject *self, PyObject *args, PyObject *kwargs)
                 ind[i] = 0;
     for (i = 0; i < number; i++)
         for (j = 0; j < length; j++)
-            if (ind[j])
-                if (seq[i*length+j] >= 65 && seq[i*length+j] <= 90)
-                    k = alignlist[seq[i*length+j]-65]>k?
-                        alignlist[seq[i*length+j]-65]:k;
+            if (ind[j]) {
+                upper = upperIndex(seq, enc, number, length, i, j);
+                if (upper >= 0)
+                    k = alignlist[upper]>k? alignlist[upper]:k;
+            }
     free(ind);
     return Py_BuildValue("ii",l,k);
 }
 
 
-static PyObject *msadirectinfo1(PyObject *self, PyObject *args, PyObject *kwargs) {
+static PyObject *msadirectinfo(PyObject *self, PyObject *args, PyObject *kwargs) {
 
-    PyArrayObject *msa, *cinfo, *pinfo;
-    double theta = 0.2, pseudocount_weight = 0.5;
-    int refine = 0, q = 0;
-    static char *kwlist[] = {"msa", "c", "prob", "theta", "pseudocount_weight",
-                             "refine", "q", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOddi|i", kwlist,
-                                     &msa, &cinfo, &pinfo, &theta,
-                                     &pseudocount_weight, &refine, &q))
+    PyArrayObject *msa;
+    PyObject *diinfo, *codes = Py_None, *iterations = Py_None;
+    double theta = 0.2, pseudocount_weight = 0.5, epsilon = 1e-4, meff;
+    int refine = 0, n_threads = 1, bands = 0, band_size = 0, single = 0;
+    int q = 1, status = 0, *iters = NULL;
+    long separation = 1;
+    unsigned long long seed = 1;
+    static char *kwlist[] = {"msa", "di", "theta", "pseudocount_weight",
+                             "refine", "codes", "n_threads", "bands",
+                             "band_size", "seed", "single", "epsilon",
+                             "iterations", "separation", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOddi|OiiiKidOl", kwlist,
+                                     &msa, &diinfo, &theta,
+                                     &pseudocount_weight, &refine, &codes,
+                                     &n_threads, &bands, &band_size, &seed,
+                                     &single, &epsilon, &iterations,
+                                     &separation))
         return NULL;
-    long i, j, k, k1, k2;
-    cinfo = PyArray_GETCONTIGUOUS(cinfo);
-    pinfo = PyArray_GETCONTIGUOUS(pinfo);
-    double *c = (double *) PyArray_DATA(cinfo);
-    double *prob = (double *) PyArray_DATA(pinfo);
-
-    /*Calculate meff, w and align.*/
-    double meff = -1.;
-    long number = 0, l = 0;
-    int *align = NULL;
-    double *w = NULL;
-    PyObject *meffinfo;
-    meffinfo = msameff(NULL, Py_BuildValue("(O)", msa),
-             Py_BuildValue("{s:d,s:i,s:i}", "theta", theta, "meff_only", 2,
-                 "refine", refine));
-    if (!PyArg_ParseTuple(meffinfo, "dllll", &meff, &number, &l, &w, &align))
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
         return NULL;
-
-    /*Build single probablity. use pseudocount_weight to weight it.*/
-    double pse_weight_val = pseudocount_weight / q;
-    double pro_weight = 1. - pseudocount_weight;
-    for (i = 0; i < q*l; i++)
-        prob[i] = pse_weight_val;
-    #define prob(x,y) prob[(x)*q + (y)]
-    #define align(x,y) align[(x)*l + (y)]
+    }
+    long i, j, l, stride;
+    char *seq = (char *) PyArray_DATA(msa);
+    double *di = NULL;
+    unsigned char *enc = NULL;
+
+    /* (rows, cols, values) arrays are filled with the highest pairs */
+    pairheap heap, *top = NULL;
+    wrapHeap(&heap, diinfo, separation);
+    if (PyTuple_Check(diinfo))
+        top = &heap;
+    else
+        di = (double *) PyArray_DATA((PyArrayObject *) diinfo);
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+    if (iterations != Py_None)
+        iters = (int *) PyArray_DATA((PyArrayObject *) iterations);
+
+    /*Residue indices and sequence weights are calculated as for Meff, and
+      the largest residue index present is the last state, q-1.*/
+    unsigned char *rows = buildRows(seq, enc, number, length, refine,
+                                    &l, &stride);
+    double *w = malloc(number * sizeof(double));
+    Py_XDECREF(msa);
+    if (!rows || !w) {
+        free(rows);
+        free(w);
+        return PyErr_NoMemory();
+    }
     for (i = 0; i < number; i++)
         for (j = 0; j < l; j++)
-            prob(j, align(i,j)) += pro_weight * w[i];
+            if (rows[i * stride + j] >= q)
+                q = rows[i * stride + j] + 1;
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    meff = calcWeights(w, rows, number, stride, l, theta, n_threads,
+                       bands, band_size, seed);
+    if (meff < 0)
+        status = DI_NOMEMORY;
+    else {
+        for (i = 0; i < number; i++)
+            w[i] /= meff;
+        status = directInfo[single ? 1 : 0](di, top, rows, w, number, stride,
+                                            l, q, pseudocount_weight, epsilon,
+                                            iters, n_threads);
+    }
+    Py_END_ALLOW_THREADS
+    free(rows);
+    free(w);
 
-    /*Calculate C matrix.*/
-    double *joint = malloc(q*q*sizeof(double));
-    if (!joint){
-        free(w);
-        free(align);
+    if (status == DI_NOMEMORY)
         return PyErr_NoMemory();
+    if (status == DI_NOTPD) {
+        PyErr_SetString(PyExc_ValueError, "correlation matrix is not "
+                        "positive definite, increase pseudo count weight");
+        return NULL;
     }
-    #define joint(x,y) joint[(x)*q + (y)]
-    #define c(x,y) c[(x)*l*(q-1) + (y)]
-    for (i = 0; i < l; i++){
-        for (j = i; j < l; j++){
-
-            if (i==j){
-                for (k = 0; k < q*q; k++)
-                    joint[k] = 0.;
-                pse_weight_val = pseudocount_weight / q;
-                for (k = 0; k < q; k++)
-                    joint(k,k) = pse_weight_val;
-            }
-            else{
-                pse_weight_val = pseudocount_weight / q / q;
-                for (k = 0; k < q*q; k++)
-                    joint[k] = pse_weight_val;
-            }
+    if (top)
+        return Py_BuildValue("dl", meff, heap.count);
+    return Py_BuildValue("dO", meff, diinfo);
+}
 
-            for (k = 0; k < number; k++){
-                joint(align(k,i), align(k,j)) += pro_weight * w[k];
-            }
 
-            for (k1 = 0; k1 < q-1; k1++){
-                for(k2 = 0; k2 < q-1; k2++){
-                    c((q-1)*j+k2, (q-1)*i+k1) = c((q-1)*i+k1, (q-1)*j+k2) = joint(k1,k2) - prob(i,k1) * prob(j,k2);
-                    // c((q-1)*j+k2, (q-1)*i+k1) = c((q-1)*i+k1, (q-1)*j+k2);
-                }
-            }
-        }
+static PyObject *msaplmdca(PyObject *self, PyObject *args, PyObject *kwargs) {
+
+    PyArrayObject *msa, *fnorm;
+    PyObject *codes = Py_None;
+    double theta = 0.2, lambda_h = 0.01, lambda_j = 0.01, meff;
+    int refine = 0, n_threads = 1, bands = 0, band_size = 0, max_iter = 500;
+    int q = 1, status = 1;
+    unsigned long long seed = 1;
+    static char *kwlist[] = {"msa", "norm", "theta", "lambda_h", "lambda_j",
+                             "refine", "codes", "n_threads", "bands",
+                             "band_size", "seed", "max_iter", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOdddi|OiiiKi", kwlist,
+                                     &msa, &fnorm, &theta, &lambda_h,
+                                     &lambda_j, &refine, &codes, &n_threads,
+                                     &bands, &band_size, &seed, &max_iter))
+        return NULL;
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
     }
-
+    long i, j, l, stride;
+    char *seq = (char *) PyArray_DATA(msa);
+    double *norm = (double *) PyArray_DATA(fnorm);
+    unsigned char *enc = NULL;
+    if (codes != Py_None)
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+
+    /*Residue indices and normalized sequence weights are calculated as for
+      direct information.*/
+    unsigned char *rows = buildRows(seq, enc, number, length, refine,
+                                    &l, &stride);
+    double *w = malloc(number * sizeof(double));
+    Py_XDECREF(msa);
+    if (!rows || !w) {
+        free(rows);
+        free(w);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < number; i++)
+        for (j = 0; j < l; j++)
+            if (rows[i * stride + j] >= q)
+                q = rows[i * stride + j] + 1;
+
+    n_threads = resolveThreads(n_threads);
+    Py_BEGIN_ALLOW_THREADS
+    meff = calcWeights(w, rows, number, stride, l, theta, n_threads,
+                       bands, band_size, seed);
+    if (meff < 0)
+        status = 0;
+    else {
+        for (i = 0; i < number; i++)
+            w[i] /= meff;
+        status = plmDCA(norm, rows, w, number, stride, l, q, lambda_h,
+                        lambda_j, max_iter, n_threads);
+    }
+    Py_END_ALLOW_THREADS
+    free(rows);
     free(w);
-    free(align);
-    free(joint);
-    #undef prob
-    #undef align
-    #undef joint
-    #undef c
-    return Py_BuildValue("dllOO", meff, number, l, cinfo, pinfo);
+
+    if (!status)
+        return PyErr_NoMemory();
+    return Py_BuildValue("dO", meff, fnorm);
 }
 
 
-static PyObject *msadirectinfo2(PyObject *self, PyObject *args, PyObject *kwargs) {
+static PyObject *msaencode(PyObject *self, PyObject *args, PyObject *kwargs) {
 
-    PyArrayObject *cinfo, *pinfo, *diinfo;
-    long number = 0, l = 0, q = 0;
-    static char *kwlist[] = {"n", "l", "c", "p", "di", "q", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "llOOOl", kwlist,
-                                     &number, &l, &cinfo, &pinfo, &diinfo, &q))
-        return NULL;
-    cinfo = PyArray_GETCONTIGUOUS(cinfo);
-    pinfo = PyArray_GETCONTIGUOUS(pinfo);
-    diinfo = PyArray_GETCONTIGUOUS(diinfo);
-    double *c = (double *) PyArray_DATA(cinfo);
-    double *prob = (double *) PyArray_DATA(pinfo);
-    double *di = (double *) PyArray_DATA(diinfo);
-
-    long i, j, k1, k2;
-    double *w = malloc(q * q * sizeof(double));
-    if (!w)
-        return NULL;
-    for (i = 0; i < q*q; i++){
-        w[i] = 0.0;
-    }
-
-    #define w(x,y) w[(x)*q+(y)]
-    #define c(x,y) c[(x)*l*(q-1) + (y)]
-    #define prob(x,y) prob[(x)*q + (y)]
-    #define di(x,y) di[(x)*l + (y)]
-
-    double epsilon = 1e-4, tiny = 1.0e-100;
-    double diff = 1.0, sum1 = 0.0, sum2 = 0.0, sumpdir = 0.0, sumdi = 0.0;
-    double *mu1 = malloc(q*sizeof(double)), *mu2 = malloc(q*sizeof(double));
-    double *scra1 = malloc(q*sizeof(double)), *scra2 = malloc(q*sizeof(double));
-    for (i = 0; i < l; i++){
-        di(i,i) = 0.0;
-        for (j = i+1; j < l; j++){
-            for (k1 = 0; k1 < q-1; k1++){
-                for (k2 = 0; k2 < q-1; k2++){
-                    w(k1,k2) = exp(- c((q-1)*i + k1, (q-1)*j + k2));
-                }
-            }
-            for (k1 = 0; k1 < q; k1++){
-                w(q-1, k1) = w(k1, q-1) = 1.;
-            }
-            for (k1 = 0; k1 < q; k1++){
-                mu1[k1] = 1./q;
-                mu2[k1] = 1./q;
-            }
-            diff = 1.0;
-            while (diff > epsilon){
-                for (k1 = 0; k1 < q; k1++){
-                    scra1[k1] = 0.0;
-                    scra2[k1] = 0.0;
-                }
-                for (k1 = 0; k1 < q; k1++){
-                    for (k2 = 0; k2 < q; k2++){
-                        scra1[k1] += mu2[k2] * w(k1, k2);
-                        scra2[k1] += mu1[k2] * w(k2, k1);
-                    }
-                }
-                sum1 = 0.0;
-                sum2 = 0.0;
-                for (k1 = 0; k1 < q; k1++){
-                    scra1[k1] = prob(i, k1) / scra1[k1];
-                    sum1 += scra1[k1];
-                    scra2[k1] = prob(j, k1) / scra2[k1];
-                    sum2 += scra2[k1];
-                }
-                for (k1 = 0; k1 < q; k1++){
-                    scra1[k1] /= sum1;
-                    scra2[k1] /= sum2;
-                }
-                diff = -1.0;
-                for (k1 = 0; k1 < q; k1++){
-                    if (fabs(mu1[k1] - scra1[k1]) > diff)
-                        diff = fabs(mu1[k1] - scra1[k1]);
-                    if (fabs(mu2[k1] - scra2[k1]) > diff)
-                        diff = fabs(mu2[k1] - scra2[k1]);
-                    mu1[k1] = scra1[k1];
-                    mu2[k1] = scra2[k1];
-                }
-            }
+    PyArrayObject *msa;
+    PyObject *codes;
 
-            sumpdir = 0.0;
-            for (k1 = 0; k1 < q; k1++){
-                for (k2 = 0; k2 < q; k2++){
-                    w(k1,k2) = w(k1, k2) * mu1[k1] * mu2[k2];
-                    sumpdir += w(k1,k2);
-                }
-            }
+    static char *kwlist[] = {"msa", "codes", NULL};
 
-            sumdi = 0.0;
-            for (k1 = 0; k1 < q; k1++){
-                for (k2 = 0; k2 < q; k2++){
-                    w(k1,k2) /= sumpdir;
-                    sumdi += w(k1,k2) * log((w(k1,k2) + tiny) / (prob(i,k1) * prob(j,k2) +tiny));
-                }
-            }
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO", kwlist,
+                                     &msa, &codes))
+        return NULL;
 
-            di(i,j) = di(j,i) = sumdi;
-        }
+    msa = PyArray_GETCONTIGUOUS(msa);
+
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (codes == Py_None || !checkCodes(codes, number, length)) {
+        if (codes == Py_None)
+            PyErr_SetString(PyExc_TypeError,
+                            "codes must be a C contiguous uint8 array");
+        Py_DECREF(msa);
+        return NULL;
     }
 
-    #undef w
-    #undef c
-    #undef prob
-    #undef di
-    free(w);
-    free(c);
-    free(prob);
-    free(mu1);
-    free(mu2);
-    free(scra1);
-    free(scra2);
-    return Py_BuildValue("O", diinfo);
+    encodeMSA((char *) PyArray_DATA(msa),
+              (unsigned char *) PyArray_DATA((PyArrayObject *) codes),
+              number, length);
+
+    Py_XDECREF(msa);
+    return Py_BuildValue("O", codes);
 }
 
 
@@ -1683,6 +3865,12 @@ static PyMethodDef msatools_methods[] = {
      "Return an Shannon entropy array calculated for given character \n"
      "array that contains an MSA."},
 
+    {"msaconserv",  (PyCFunction)msaconserv,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill any of Shannon entropy, relative entropy, Jensen-Shannon\n"
+     "divergence and property entropy arrays calculated for given character\n"
+     "array that contains an MSA."},
+
     {"msamutinfo",  (PyCFunction)msamutinfo, METH_VARARGS | METH_KEYWORDS,
      "Return mutual information matrix calculated for given character \n"
      "array that contains an MSA."},
@@ -1690,28 +3878,66 @@ static PyMethodDef msatools_methods[] = {
     {"msaocc",  (PyCFunction)msaocc, METH_VARARGS | METH_KEYWORDS,
      "Return occupancy (or count) array calculated for MSA rows or columns."},
 
+    {"msarefine",  (PyCFunction)msarefine, METH_VARARGS | METH_KEYWORDS,
+     "Refine row and column masks by row occupancy, sequence identity and\n"
+     "column occupancy, and return numbers of rows and columns kept."},
+
+    {"msatake",  (PyCFunction)msatake, METH_VARARGS | METH_KEYWORDS,
+     "Fill given character array with given rows and columns of an MSA."},
+
     {"msaomes",  (PyCFunction)msaomes, METH_VARARGS | METH_KEYWORDS,
      "Return OMES matrix calculated for given character array that contains\n"
      "an MSA."},
 
+    {"msacoevol",  (PyCFunction)msacoevol, METH_VARARGS | METH_KEYWORDS,
+     "Fill any of MI, normalized MI, OMES and joint entropy matrices, or\n"
+     "arrays of their highest scoring pairs, and column entropy array for\n"
+     "given character array that contains an MSA."},
+
+    {"msapaircounts",  (PyCFunction)msapaircounts,
+     METH_VARARGS | METH_KEYWORDS,
+     "Add character pair counts of each pair of columns and character counts\n"
+     "of each column of given character array that contains an MSA to\n"
+     "coevolution count arrays, or subtract them, and return number of\n"
+     "sequences."},
+
+    {"msacountstats",  (PyCFunction)msacountstats,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill any of MI, normalized MI, OMES and joint entropy matrices\n"
+     "calculated from coevolution count arrays."},
+
     {"msasca",  (PyCFunction)msasca, METH_VARARGS | METH_KEYWORDS,
      "Return SCA matrix calculated for given character array that contains\n"
      "an MSA."},
 
+    {"msascatable",  (PyCFunction)msascatable, METH_VARARGS | METH_KEYWORDS,
+     "Fill SCA conservation values of residues in each column and their\n"
+     "averages for given character array that contains an MSA."},
+
+    {"msascarows",  (PyCFunction)msascarows, METH_VARARGS | METH_KEYWORDS,
+     "Fill a chunk of centered SCA values of sequences and return number\n"
+     "of sequences filled."},
+
     {"msameff",  (PyCFunction)msameff, METH_VARARGS | METH_KEYWORDS,
      "Return Meff calculated for given character array that contains\n"
      "an MSA."},
 
-    {"msadirectinfo1",  (PyCFunction)msadirectinfo1, METH_VARARGS | METH_KEYWORDS,
-     "Return DI correlation matrix to python for matrix inverse calculated\n"
-     "for given character array that contains an MSA."},
+    {"msadirectinfo",  (PyCFunction)msadirectinfo, METH_VARARGS | METH_KEYWORDS,
+     "Return Meff and fill direct information matrix calculated for given\n"
+     "character array that contains an MSA, or return Meff and number of\n"
+     "pairs filled into arrays of highest scoring pairs."},
 
-    {"msadirectinfo2",  (PyCFunction)msadirectinfo2, METH_VARARGS | METH_KEYWORDS,
-     "Return DI correlation matrix from inversed matrix."},
+    {"msaplmdca",  (PyCFunction)msaplmdca, METH_VARARGS | METH_KEYWORDS,
+     "Return Meff and fill coupling norm matrix fitted by pseudolikelihood\n"
+     "maximization for given character array that contains an MSA."},
 
     {"msadipretest",  (PyCFunction)msadipretest, METH_VARARGS | METH_KEYWORDS,
      "Return some DI parameter to set array size."},
 
+    {"msaencode",  (PyCFunction)msaencode, METH_VARARGS | METH_KEYWORDS,
+     "Fill residue code array, that has a row for each column, for given\n"
+     "character array that contains an MSA."},
+
     {NULL, NULL, 0, NULL}
 };
 
@@ -1728,6 +3954,7 @@ static struct PyModuleDef msatools = {
 };
 PyMODINIT_FUNC PyInit_msatools(void) {
     import_array();
+    selectKernels();
     return PyModule_Create(&msatools);
 }
 #else
@@ -1737,5 +3964,6 @@ PyMODINIT_FUNC initmsatools(void) {
         "Multiple sequence alignment analysis tools.");
 
     import_array();
+    selectKernels();
 }
 #endif
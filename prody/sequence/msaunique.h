@@ -0,0 +1,254 @@
+/* Greedy selection of unique sequences.  Sequences are kept in order, and
+   a sequence sharing *unique* or more identity with a sequence kept before
+   it is dropped.  Identity is the number of positions where both sequences
+   have the same residue over the number of positions where either has a
+   residue, as calculated by msaeye.  Rows of residue codes are compared
+   with the representative in parallel, and a comparison stops as soon as
+   bounds on identity, from residues left in both rows, decide it.  Whole
+   rows are compared by the same kernels for identity matrices.  This file
+   is included by seqtools.c and msatools.c. */
+
+#ifndef MSAUNIQUE_H
+#define MSAUNIQUE_H
+
+#include "msacodes.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define UNIQUE_AVX2
+#endif
+
+#define UNIQUEPAD 32
+#define UNIQUECHECK 64
+
+
+static int decidePair(long score, long total, long ileft, long jleft,
+                      double unique) {
+
+    /* Return 1 when identity will reach *unique*, 0 when it cannot, and -1
+       when it is not decided, after *score* matches over *total* positions
+       with *ileft* and *jleft* residues left in the rows.  Division is
+       monotonic, so bounds give the same decision as the final ratio. */
+
+    long most = ileft < jleft ? ileft : jleft;
+    long least = ileft < jleft ? jleft : ileft;
+    if ((double) (score + most) / (total + least) < unique)
+        return 0;
+    if ((double) score / (total + ileft + jleft) >= unique)
+        return 1;
+    return -1;
+}
+
+
+static int similarRowsScalar(unsigned char *irow, unsigned char *jrow,
+                             long stride, long inz, long jnz,
+                             double unique) {
+
+    /* Return 1 when rows share *unique* or more identity.  *inz* and *jnz*
+       are numbers of residues in rows. */
+
+    long k, l, score = 0, total = 0, iseen = 0, jseen = 0;
+    int decided;
+    unsigned char a, b;
+    for (k = 0; k < stride; k += UNIQUECHECK) {
+        for (l = k; l < k + UNIQUECHECK && l < stride; l++) {
+            a = irow[l];
+            b = jrow[l];
+            iseen += a != 0;
+            jseen += b != 0;
+            total += (a | b) != 0;
+            score += a && a == b;
+        }
+        decided = decidePair(score, total, inz - iseen, jnz - jseen, unique);
+        if (decided >= 0)
+            return decided;
+    }
+    return (double) score / total >= unique;
+}
+
+
+#ifdef UNIQUE_AVX2
+__attribute__((target("avx2,popcnt")))
+static int similarRowsAVX2(unsigned char *irow, unsigned char *jrow,
+                           long stride, long inz, long jnz, double unique) {
+
+    /* Compare rows 32 positions at a time using AVX2, see
+       similarRowsScalar. */
+
+    long k, score = 0, total = 0, iseen = 0, jseen = 0;
+    int decided = -1;
+    unsigned int eq, ires, jres;
+    __m256i x, y, zero = _mm256_setzero_si256();
+    for (k = 0; k < stride; k += 32) {
+        x = _mm256_loadu_si256((__m256i *) (irow + k));
+        y = _mm256_loadu_si256((__m256i *) (jrow + k));
+        eq = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        ires = ~(unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(x, zero));
+        jres = ~(unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(y, zero));
+        score += __builtin_popcount(eq & ires);
+        total += __builtin_popcount(ires | jres);
+        iseen += __builtin_popcount(ires);
+        jseen += __builtin_popcount(jres);
+        if ((k + 32) % UNIQUECHECK == 0) {
+            decided = decidePair(score, total, inz - iseen, jnz - jseen,
+                                 unique);
+            if (decided >= 0)
+                break;
+        }
+    }
+    _mm256_zeroupper();
+    if (decided >= 0)
+        return decided;
+    return (double) score / total >= unique;
+}
+#endif
+
+
+static double rowIdentityScalar(unsigned char *irow, unsigned char *jrow,
+                                long stride) {
+
+    /* Return identity of rows, or 0 when neither has a residue. */
+
+    long k, score = 0, total = 0;
+    unsigned char a, b;
+    for (k = 0; k < stride; k++) {
+        a = irow[k];
+        b = jrow[k];
+        total += (a | b) != 0;
+        score += a && a == b;
+    }
+    return total ? (double) score / total : 0;
+}
+
+
+#ifdef UNIQUE_AVX2
+__attribute__((target("avx2,popcnt")))
+static double rowIdentityAVX2(unsigned char *irow, unsigned char *jrow,
+                              long stride) {
+
+    /* Return identity of rows comparing 32 positions at a time using AVX2,
+       see rowIdentityScalar. */
+
+    long k, score = 0, total = 0;
+    unsigned int eq, res;
+    __m256i x, y, zero = _mm256_setzero_si256();
+    for (k = 0; k < stride; k += 32) {
+        x = _mm256_loadu_si256((__m256i *) (irow + k));
+        y = _mm256_loadu_si256((__m256i *) (jrow + k));
+        eq = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        res = ~(unsigned int) _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_or_si256(x, y), zero));
+        score += __builtin_popcount(eq & res);
+        total += __builtin_popcount(res);
+    }
+    _mm256_zeroupper();
+    return total ? (double) score / total : 0;
+}
+#endif
+
+
+/* row comparison kernels selected for the running processor on import */
+static int (*similarRows)(unsigned char *, unsigned char *, long, long, long,
+                          double) = similarRowsScalar;
+static double (*rowIdentity)(unsigned char *, unsigned char *,
+                             long) = rowIdentityScalar;
+
+
+static void selectUniqueKernel(void) {
+
+    /* Select SIMD variants of row comparison supported by the processor. */
+
+    #ifdef UNIQUE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        similarRows = similarRowsAVX2;
+        rowIdentity = rowIdentityAVX2;
+    }
+    #endif
+}
+
+
+static void fillRowCodes(unsigned char *codes, char *seq, long length,
+                         long *rows, long number, long *cols, long width,
+                         long stride, long *nonzero) {
+
+    /* Fill *number* rows of *codes*, *stride* apart, with residue codes,
+       case insensitive and 0 for gaps, for rows *rows* and columns *cols*
+       of a row-major MSA, or for all of them when NULL.  Positions beyond
+       *width* are left as they are.  Numbers of residues in rows are set to
+       *nonzero*. */
+
+    long i, k, nz;
+    char *row;
+    unsigned char *code;
+    for (i = 0; i < number; i++) {
+        row = seq + (rows ? rows[i] : i) * length;
+        code = codes + i * stride;
+        nz = 0;
+        for (k = 0; k < width; k++) {
+            code[k] = encodeChar(row[cols ? cols[k] : k]) & CODEMASK;
+            nz += code[k] != 0;
+        }
+        nonzero[i] = nz;
+    }
+}
+
+
+static unsigned char *uniqueRowCodes(char *seq, long length, long *rows,
+                                     long number, long *cols, long width,
+                                     long *stride, long *nonzero) {
+
+    /* Return *number* rows of residue codes, see fillRowCodes, padded with
+       gaps to *stride*, a multiple of UNIQUEPAD.  Return NULL on memory
+       allocation failure. */
+
+    unsigned char *codes;
+    *stride = (width + UNIQUEPAD - 1) / UNIQUEPAD * UNIQUEPAD;
+    if (!*stride)
+        *stride = UNIQUEPAD;
+    codes = calloc((size_t) number * *stride, 1);
+    if (!codes)
+        return NULL;
+    fillRowCodes(codes, seq, length, rows, number, cols, width, *stride,
+                 nonzero);
+    return codes;
+}
+
+
+static void uniqueRows(_Bool *unq, unsigned char *codes, long *nonzero,
+                       long number, long stride, double unique,
+                       int n_threads) {
+
+    /* Mark rows of *codes* that are not unique False in *unq*, which is
+       initially True for rows to consider.  Each representative row is
+       compared with the following rows by *n_threads* workers, which all
+       see the same marks after each comparison.  GIL must be released by
+       the caller. */
+
+    #ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+    #endif
+    {
+        long i, j;
+        for (i = 0; i < number; i++) {
+            if (!unq[i])
+                continue;
+            #ifdef _OPENMP
+            #pragma omp for schedule(static)
+            #endif
+            for (j = i + 1; j < number; j++)
+                if (unq[j] && similarRows(codes + i * stride,
+                                          codes + j * stride, stride,
+                                          nonzero[i], nonzero[j], unique))
+                    unq[j] = 0;
+        }
+    }
+}
+
+#endif
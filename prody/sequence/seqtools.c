@@ -1,6 +1,8 @@
 #include "Python.h"
 #define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
 #include "numpy/arrayobject.h"
+#include "msacodes.h"
+#include "msaunique.h"
 #define NUMCHARS 27
 const int twenty[20] = {1, 3, 4, 5, 6, 7, 8, 9, 11, 12, 13,
                         14, 16, 17, 18, 19, 20, 22, 23, 25};
@@ -11,13 +13,14 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
                                    PyObject *kwargs) {
 
     PyArrayObject *msa, *array;
+    PyObject *codes = Py_None;
     double unique = 0;
     int turbo = 1;
 
-    static char *kwlist[] = {"msa", "array", "unique", "turbo", NULL};
+    static char *kwlist[] = {"msa", "array", "unique", "turbo", "codes", NULL};
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|di", kwlist,
-                                     &msa, &array, &unique, &turbo))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|diO", kwlist,
+                                     &msa, &array, &unique, &turbo, &codes))
         return NULL;
 
     /* make sure to have a contiguous and well-behaved array */
@@ -25,6 +28,10 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
 
     /* get dimensions */
     long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    if (!checkCodes(codes, number, length)) {
+        Py_DECREF(msa);
+        return NULL;
+    }
 
     /* get pointers to data */
     char *iraw, *jraw, *raw = (char *) PyArray_DATA(msa);
@@ -68,6 +75,16 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
     unsigned char a, b;
     long k, diff;
 
+    /* in turbo mode, rows can be copied from encoded MSA, which makes
+       refining characters while calculating the first row unnecessary */
+    unsigned char *enc = NULL;
+    if (turbo && codes != Py_None) {
+        enc = (unsigned char *) PyArray_DATA((PyArrayObject *) codes);
+        for (k = 0; k < length; k++)
+            for (i = 0; i < number; i++)
+                seq[i][k] = enc[k * number + i] & CODEMASK;
+    }
+
     /* zero sim array */
     if (unique) {
         for (i = 0; i < number; i++)
@@ -87,7 +104,7 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
     /* calculate first row of MI matrix and all column probabilities */
     i = 0;
     iraw = raw;
-    for (j = 1; j < number; j++) {
+    for (j = 1; j < number && !enc; j++) {
         ncols = score = 0.;
         jraw = raw + length * j;
         diff = j - 1;
@@ -133,11 +150,11 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
                 sim[j] = sim[number * j] = seqid;
     }
 
-    if (turbo)
+    if (turbo && !enc)
         free(iseq);
 
     /* calculate rest of identities */
-    for (i = 1; i < number; i++) {
+    for (i = enc ? 0 : 1; i < number; i++) {
 
         if (unique && !unq[i])
             continue;
@@ -208,11 +225,407 @@ static PyObject *msaeye(PyObject *self, PyObject *args,
     if (turbo)
         for (j = 1; j < number; j++)
             free(seq[j]);
+    if (enc)
+        free(seq[0]);
     free(seq);
 
     return Py_BuildValue("O", array);
 }
 
+static PyObject *msaunique(PyObject *self, PyObject *args,
+                           PyObject *kwargs) {
+
+    PyArrayObject *msa, *array;
+    double unique = 0.98;
+    int n_threads = 1;
+
+    static char *kwlist[] = {"msa", "array", "unique", "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|di", kwlist,
+                                     &msa, &array, &unique, &n_threads))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    long i, stride;
+    _Bool *unq = (_Bool *) PyArray_DATA(array);
+    long *nonzero = malloc((number + 1) * sizeof(long));
+    unsigned char *codes = NULL;
+    if (nonzero)
+        codes = uniqueRowCodes((char *) PyArray_DATA(msa), length, NULL,
+                               number, NULL, length, &stride, nonzero);
+    Py_XDECREF(msa);
+    if (!codes) {
+        free(nonzero);
+        return PyErr_NoMemory();
+    }
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    #else
+    n_threads = 1;
+    #endif
+    for (i = 0; i < number; i++)
+        unq[i] = 1;
+    Py_BEGIN_ALLOW_THREADS
+    uniqueRows(unq, codes, nonzero, number, stride, unique, n_threads);
+    Py_END_ALLOW_THREADS
+    free(codes);
+    free(nonzero);
+    return Py_BuildValue("O", array);
+}
+
+#define SEQIDTILE 64
+#define SEQID_DOUBLE 0
+#define SEQID_FLOAT 1
+#define SEQID_UINT16 2
+
+
+static void storeIdentity(void *out, int kind, long i, long j, long number,
+                          int packed, double seqid) {
+
+    /* Store identity of rows *i* <= *j* into a dense symmetric matrix, or
+       into the packed upper triangle, including the diagonal, in row
+       order.  *kind* selects double, float, or unsigned 16-bit integer
+       output that stores identity times 65535, rounded. */
+
+    size_t a, b;
+    if (packed) {
+        a = (size_t) i * number - (size_t) i * (i - 1) / 2 + (j - i);
+        b = a;
+    } else {
+        a = (size_t) i * number + j;
+        b = (size_t) j * number + i;
+    }
+    switch (kind) {
+        case SEQID_FLOAT:
+            ((float *) out)[a] = ((float *) out)[b] = (float) seqid;
+            break;
+        case SEQID_UINT16:
+            ((unsigned short *) out)[a] = ((unsigned short *) out)[b] =
+                (unsigned short) (seqid * 65535 + 0.5);
+            break;
+        default:
+            ((double *) out)[a] = ((double *) out)[b] = seqid;
+    }
+}
+
+
+static PyObject *msaseqid(PyObject *self, PyObject *args,
+                          PyObject *kwargs) {
+
+    PyArrayObject *msa, *array;
+    int kind = SEQID_DOUBLE, packed = 0, n_threads = 1;
+
+    static char *kwlist[] = {"msa", "array", "kind", "packed", "n_threads",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iii", kwlist,
+                                     &msa, &array, &kind, &packed,
+                                     &n_threads))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    long stride, ntiles = (number + SEQIDTILE - 1) / SEQIDTILE;
+    void *out = PyArray_DATA(array);
+    long *nonzero = malloc((number + 1) * sizeof(long));
+    unsigned char *codes = NULL;
+    if (nonzero)
+        codes = uniqueRowCodes((char *) PyArray_DATA(msa), length, NULL,
+                               number, NULL, length, &stride, nonzero);
+    Py_XDECREF(msa);
+    free(nonzero);
+    if (!codes)
+        return PyErr_NoMemory();
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    #else
+    n_threads = 1;
+    #endif
+
+    /* tiles of the upper triangle keep both blocks of rows in cache */
+    Py_BEGIN_ALLOW_THREADS
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+    #endif
+    for (long t = 0; t < ntiles * ntiles; t++) {
+        long i, j, ibeg, iend, jbeg, jend;
+        if (t / ntiles > t % ntiles)
+            continue;
+        ibeg = (t / ntiles) * SEQIDTILE;
+        iend = ibeg + SEQIDTILE < number ? ibeg + SEQIDTILE : number;
+        jbeg = (t % ntiles) * SEQIDTILE;
+        jend = jbeg + SEQIDTILE < number ? jbeg + SEQIDTILE : number;
+        for (i = ibeg; i < iend; i++) {
+            if (ibeg == jbeg)
+                storeIdentity(out, kind, i, i, number, packed, 1);
+            for (j = i + 1 > jbeg ? i + 1 : jbeg; j < jend; j++)
+                storeIdentity(out, kind, i, j, number, packed,
+                              rowIdentity(codes + i * stride,
+                                          codes + j * stride, stride));
+        }
+    }
+    Py_END_ALLOW_THREADS
+    free(codes);
+    return Py_BuildValue("O", array);
+}
+
+
+static PyObject *msaindex(PyObject *self, PyObject *args,
+                          PyObject *kwargs) {
+
+    PyArrayObject *msa, *codes, *nonzero;
+
+    static char *kwlist[] = {"msa", "codes", "nonzero", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOO", kwlist,
+                                     &msa, &codes, &nonzero))
+        return NULL;
+
+    msa = PyArray_GETCONTIGUOUS(msa);
+    long number = PyArray_DIMS(msa)[0], length = PyArray_DIMS(msa)[1];
+    fillRowCodes((unsigned char *) PyArray_DATA(codes),
+                 (char *) PyArray_DATA(msa), length, NULL, number, NULL,
+                 length, PyArray_DIMS(codes)[1],
+                 (long *) PyArray_DATA(nonzero));
+    Py_XDECREF(msa);
+    return Py_BuildValue("O", codes);
+}
+
+
+static double lengthBound(long inz, long jnz) {
+
+    /* Return upper bound on identity of rows with *inz* and *jnz* residues,
+       as matches cannot outnumber residues of the shorter row and positions
+       cannot be fewer than residues of the longer one. */
+
+    if (inz > jnz)
+        return lengthBound(jnz, inz);
+    return jnz ? (double) inz / jnz : 0;
+}
+
+
+static long lengthStart(long *nonzero, long number, long nz) {
+
+    /* Return position of the first of *number* ascending residue counts
+       that is not less than *nz*. */
+
+    long lo = 0, hi = number, mid;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (nonzero[mid] < nz)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+static PyObject *msasimilar(PyObject *self, PyObject *args,
+                            PyObject *kwargs) {
+
+    /* Find indexed rows sharing *seqid* or more identity with a query.
+       Only rows with residue counts allowing that much identity, which
+       form a contiguous range of rows sorted by residue counts, are
+       compared. */
+
+    PyArrayObject *codes, *nonzero, *order, *query, *index, *values;
+    long qnz;
+    double seqid;
+    int n_threads = 1;
+
+    static char *kwlist[] = {"codes", "nonzero", "order", "query", "qnz",
+                             "seqid", "index", "values", "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOldOO|i", kwlist,
+                                     &codes, &nonzero, &order, &query, &qnz,
+                                     &seqid, &index, &values, &n_threads))
+        return NULL;
+
+    long number = PyArray_DIMS(codes)[0], stride = PyArray_DIMS(codes)[1];
+    unsigned char *rows = (unsigned char *) PyArray_DATA(codes),
+                  *qrow = (unsigned char *) PyArray_DATA(query);
+    long *nz = (long *) PyArray_DATA(nonzero),
+         *ord = (long *) PyArray_DATA(order),
+         *idx = (long *) PyArray_DATA(index);
+    double *val = (double *) PyArray_DATA(values);
+    long j, lo = 0, hi = number, count = 0;
+
+    /* bounds fall off on both sides of the query residue count */
+    if (seqid > 0) {
+        j = lengthStart(nz, number, qnz);
+        for (lo = j; lo > 0 && lengthBound(nz[lo - 1], qnz) >= seqid; lo--);
+        for (hi = j; hi < number && lengthBound(nz[hi], qnz) >= seqid; hi++);
+    }
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    #else
+    n_threads = 1;
+    #endif
+
+    Py_BEGIN_ALLOW_THREADS
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(static)
+    #endif
+    for (long k = lo; k < hi; k++) {
+        unsigned char *row = rows + ord[k] * stride;
+        if (seqid <= 0 || similarRows(qrow, row, stride, qnz, nz[k], seqid))
+            val[k] = rowIdentity(qrow, row, stride);
+        else
+            val[k] = -1;
+    }
+    for (j = lo; j < hi; j++)
+        if (val[j] >= 0) {
+            idx[count] = ord[j];
+            val[count++] = val[j];
+        }
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("l", count);
+}
+
+
+static int worseHit(long *index, double *values, long a, long b) {
+
+    /* Return 1 when hit *a* ranks below hit *b*, i.e. it has lower identity
+       or the same identity and a greater row index. */
+
+    return values[a] < values[b] ||
+           (values[a] == values[b] && index[a] > index[b]);
+}
+
+
+static void siftHit(long *index, double *values, long size, long i) {
+
+    /* Restore min-heap order of *size* hits by moving hit *i* down. */
+
+    long child, itmp;
+    double dtmp;
+    while ((child = 2 * i + 1) < size) {
+        if (child + 1 < size && worseHit(index, values, child + 1, child))
+            child++;
+        if (!worseHit(index, values, child, i))
+            break;
+        itmp = index[i]; index[i] = index[child]; index[child] = itmp;
+        dtmp = values[i]; values[i] = values[child]; values[child] = dtmp;
+        i = child;
+    }
+}
+
+
+static void pushHit(long *index, double *values, long *size, long top,
+                    long j, double value) {
+
+    /* Keep *top* best hits in a min-heap, worst hit first. */
+
+    long i, parent, itmp;
+    double dtmp;
+    if (*size == top) {
+        if (value < values[0] || (value == values[0] && j > index[0]))
+            return;
+        index[0] = j;
+        values[0] = value;
+        siftHit(index, values, top, 0);
+        return;
+    }
+    i = (*size)++;
+    index[i] = j;
+    values[i] = value;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!worseHit(index, values, i, parent))
+            break;
+        itmp = index[i]; index[i] = index[parent]; index[parent] = itmp;
+        dtmp = values[i]; values[i] = values[parent]; values[parent] = dtmp;
+        i = parent;
+    }
+}
+
+
+static PyObject *msanearest(PyObject *self, PyObject *args,
+                            PyObject *kwargs) {
+
+    /* Find *top* indexed rows most identical to each query.  Rows are
+       visited in decreasing order of their identity bound from residue
+       counts, so that a query stops once no row left can rank among hits
+       found, and rows are compared with the worst of them as threshold.
+       Queries are distributed over threads. */
+
+    PyArrayObject *codes, *nonzero, *order, *queries, *qnonzero, *index,
+                  *values;
+    int n_threads = 1;
+
+    static char *kwlist[] = {"codes", "nonzero", "order", "queries", "qnz",
+                             "index", "values", "n_threads", NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOOOO|i", kwlist,
+                                     &codes, &nonzero, &order, &queries,
+                                     &qnonzero, &index, &values, &n_threads))
+        return NULL;
+
+    long number = PyArray_DIMS(codes)[0], stride = PyArray_DIMS(codes)[1];
+    long nqueries = PyArray_DIMS(index)[0], top = PyArray_DIMS(index)[1];
+    unsigned char *rows = (unsigned char *) PyArray_DATA(codes),
+                  *qrows = (unsigned char *) PyArray_DATA(queries);
+    long *nz = (long *) PyArray_DATA(nonzero),
+         *ord = (long *) PyArray_DATA(order),
+         *qnz = (long *) PyArray_DATA(qnonzero),
+         *idx = (long *) PyArray_DATA(index);
+    double *val = (double *) PyArray_DATA(values);
+
+    #ifdef _OPENMP
+    if (n_threads < 1)
+        n_threads = omp_get_max_threads();
+    #else
+    n_threads = 1;
+    #endif
+
+    Py_BEGIN_ALLOW_THREADS
+    #ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+    #endif
+    for (long q = 0; q < nqueries; q++) {
+        unsigned char *qrow = qrows + q * stride, *row;
+        long *hidx = idx + q * top, size = 0, j, i, itmp;
+        long lo = lengthStart(nz, number, qnz[q]), hi = lo;
+        double *hval = val + q * top, lbound, hbound, bound, dtmp;
+        while (lo > 0 || hi < number) {
+            lbound = lo > 0 ? lengthBound(nz[lo - 1], qnz[q]) : -1;
+            hbound = hi < number ? lengthBound(nz[hi], qnz[q]) : -1;
+            if (hbound >= lbound) {
+                j = hi++;
+                bound = hbound;
+            } else {
+                j = --lo;
+                bound = lbound;
+            }
+            if (size == top && bound < hval[0])
+                break;
+            row = rows + ord[j] * stride;
+            if (size == top && hval[0] > 0 &&
+                !similarRows(qrow, row, stride, qnz[q], nz[j], hval[0]))
+                continue;
+            pushHit(hidx, hval, &size, top, ord[j],
+                    rowIdentity(qrow, row, stride));
+        }
+        /* heap sort leaves hits in decreasing rank */
+        for (i = size - 1; i > 0; i--) {
+            itmp = hidx[0]; hidx[0] = hidx[i]; hidx[i] = itmp;
+            dtmp = hval[0]; hval[0] = hval[i]; hval[i] = dtmp;
+            siftHit(hidx, hval, i, 0);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    return Py_BuildValue("O", index);
+}
+
+
 static PyMethodDef seqtools_methods[] = {
 
     {"msaeye",  (PyCFunction)msaeye,
@@ -220,6 +633,31 @@ static PyMethodDef seqtools_methods[] = {
      "Return sequence identity matrix calculated for given character \n"
      "array that contains an MSA."},
 
+    {"msaunique",  (PyCFunction)msaunique,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill boolean array marking unique sequences of given character\n"
+     "array that contains an MSA, selected greedily in order."},
+
+    {"msaseqid",  (PyCFunction)msaseqid,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill sequence identity matrix, or its packed upper triangle, for\n"
+     "given character array that contains an MSA."},
+
+    {"msaindex",  (PyCFunction)msaindex,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill padded rows of residue codes and residue counts for given\n"
+     "character array that contains an MSA."},
+
+    {"msasimilar",  (PyCFunction)msasimilar,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill indices and identities of indexed sequences similar to a\n"
+     "query and return their number."},
+
+    {"msanearest",  (PyCFunction)msanearest,
+     METH_VARARGS | METH_KEYWORDS,
+     "Fill indices and identities of indexed sequences most identical\n"
+     "to each query."},
+
     {NULL, NULL, 0, NULL}
 };
 
@@ -236,6 +674,7 @@ static struct PyModuleDef seqtools = {
 };
 PyMODINIT_FUNC PyInit_seqtools(void) {
     import_array();
+    selectUniqueKernel();
     return PyModule_Create(&seqtools);
 }
 #else
@@ -245,5 +684,6 @@ PyMODINIT_FUNC initseqtools(void) {
         "Sequence similarity/identity analysis tools.");
 
     import_array();
+    selectUniqueKernel();
 }
 #endif
@@ -0,0 +1,65 @@
+"""Compare accuracy and runtime of approximate and exact Meff calculation.
+
+Run as::
+
+  python -m prody.tests.sequence.benchmark_meff [number] [length]
+
+A synthetic alignment of *number* sequences (default 20000) and *length*
+columns (default 150) is generated by mutating ancestral sequences, with
+duplicates of some sequences, and Meff is calculated for a few sequence
+identity thresholds using ``'exact'`` and ``'lsh'`` methods."""
+
+__author__ = 'Ahmet Bakan, Wenzhi Mao'
+
+import sys
+from time import time
+
+from numpy import array, abs
+from numpy.random import RandomState
+
+from prody import LOGGER, calcMeff
+
+ALPHABET = array(list('ACDEFGHIKLMNPQRSTVWY-'), '|S1')
+
+
+def buildAlignment(number, length, family=50, seed=0):
+    """Return a character array of *number* sequences that descend from
+    ancestral sequences, *family* sequences per ancestor on average."""
+
+    random = RandomState(seed)
+    ancestors = random.randint(0, len(ALPHABET),
+                               (number // family + 1, length))
+    msa = ancestors[random.randint(0, len(ancestors), number)]
+    rate = random.random_sample((number, 1)) * 0.4
+    mutate = random.random_sample((number, length)) < rate
+    msa[mutate] = random.randint(0, len(ALPHABET), mutate.sum())
+    msa[:number // 10] = msa[number // 10:2 * (number // 10)]
+    return ALPHABET[msa]
+
+
+def benchmark(number=20000, length=150, seqids=(.6, .8, .9)):
+    """Print runtime and errors of approximate Meff and weights."""
+
+    msa = buildAlignment(number, length)
+    print('{0} sequences, {1} columns'.format(number, length))
+    print('{0:>6s} {1:>10s} {2:>8s} {3:>10s} {4:>8s} {5:>10s} {6:>10s}'
+          .format('seqid', 'exact', 'time', 'lsh', 'time', 'rel. error',
+                  'max w err'))
+    for seqid in seqids:
+        start = time()
+        exact, weights = calcMeff(msa, seqid=seqid, weight=True)
+        exact_time = time() - start
+        start = time()
+        approx, approx_weights = calcMeff(msa, seqid=seqid, weight=True,
+                                          method='lsh')
+        approx_time = time() - start
+        print('{0:6.2f} {1:10.2f} {2:7.2f}s {3:10.2f} {4:7.2f}s {5:10.2e} '
+              '{6:10.2e}'.format(seqid, exact, exact_time, approx,
+                                 approx_time, (approx - exact) / exact,
+                                 abs(approx_weights - weights).max()))
+
+
+if __name__ == '__main__':
+
+    LOGGER.verbosity = None
+    benchmark(*[int(arg) for arg in sys.argv[1:3]])
@@ -1,8 +1,12 @@
 __author__ = 'Ahmet Bakan, Anindita Dutta, Wenzhi Mao'
 
-from prody.tests import TestCase
+import os
 
-from numpy import array, log, zeros, char, ones, fromfile
+from prody.tests import TestCase, TEMPDIR
+
+from numpy import array, log, zeros, char, ones, fromfile, vstack
+from numpy import sort, tril_indices, triu_indices, memmap, lexsort
+from numpy.random import RandomState
 from numpy.testing import assert_array_equal, assert_array_almost_equal
 
 from prody.tests.datafiles import *
@@ -10,7 +14,10 @@ from prody.tests.datafiles import *
 from prody import LOGGER, calcShannonEntropy, buildMutinfoMatrix, parseMSA
 from prody import calcMSAOccupancy, buildSeqidMatrix, uniqueSequences
 from prody import buildOMESMatrix, buildSCAMatrix, calcMeff
-from prody import buildDirectInfoMatrix
+from prody import buildDirectInfoMatrix, buildPLMDCAMatrix
+from prody import buildCoevolutionMatrices, CoevolutionAccumulator
+from prody import saveAccumulator, loadAccumulator, calcConservationScores
+from prody import SequenceIndex
 
 LOGGER.verbosity = None
 
@@ -19,6 +26,9 @@ FASTA_ALPHA = char.isalpha(FASTA._msa)
 FASTA_UPPER = char.upper(FASTA._msa)
 
 FASTA_NUMBER, FASTA_LENGTH = FASTA_ALPHA.shape
+CONSERVATION = ('entropy', 'relent', 'jsd', 'propent')
+# each sequence twice, with half weight they count as FASTA sequences
+FASTA_TWICE = vstack([FASTA._msa, FASTA._msa])
 FASTA_EYE = zeros((FASTA_NUMBER, FASTA_NUMBER))
 for i in range(FASTA_NUMBER):
     FASTA_EYE[i, i] = 1
@@ -89,6 +99,17 @@ class TestCalcShannonEntropy(TestCase):
         result = calcShannonEntropy(msa, omitgaps=True)
         assert_array_almost_equal(expect, result)
 
+    def testThreads(self):
+
+        msa = array(list('ACDEFGHIKLMNPQRSTVWY-.bjzxUO'),
+                    dtype='|S1')[RandomState(0).randint(0, 28, (200, 3000))]
+        for omitgaps in (True, False):
+            expect = calcShannonEntropy(msa, omitgaps=omitgaps)
+            result = calcShannonEntropy(msa, omitgaps=omitgaps, n_threads=3)
+            assert_array_equal(expect, result)
+            expect = calcShannonEntropy(msa[:, :1000], omitgaps=omitgaps)
+            assert_array_equal(expect, result[:1000])
+
 """
     def testSixSequences3(self):
 
@@ -105,6 +126,41 @@ class TestCalcShannonEntropy(TestCase):
 """
 
 
+class TestConservation(TestCase):
+
+    def testScores(self):
+
+        msa = array([list('AAAW-'),
+                     list('AAKY-'),
+                     list('ACDF-'),
+                     list('ACEH-')], dtype='|S1')
+        background = ones(20) / 20
+        result = calcConservationScores(msa, CONSERVATION,
+                                        background=background)
+        assert_array_almost_equal(calcShannonEntropy(msa), result['entropy'])
+        expect = array([log(20), log(10), log(5), log(5), 0])
+        assert_array_almost_equal(expect, result['relent'])
+        half = (array([1] + [0] * 19) + background) / 2
+        expect = (log(1 / half[0]) + (background *
+                  log(background / half)).sum()) / 2 / log(2)
+        self.assertAlmostEqual(expect, result['jsd'][0])
+        self.assertEqual(0, result['jsd'][4])
+        expect = array([0, 0, -log(.25) / 2 - log(.5) / 2, 0, 0])
+        assert_array_almost_equal(expect, result['propent'])
+
+    def testWeights(self):
+
+        weights = ones(2 * FASTA_NUMBER) / 2
+        expect = calcConservationScores(FASTA, CONSERVATION)
+        result = calcConservationScores(FASTA_TWICE, CONSERVATION,
+                                        weights=weights, n_threads=3)
+        for score in CONSERVATION:
+            assert_array_almost_equal(expect[score], result[score],
+                                      err_msg=score + ' failed')
+        self.assertRaises(ValueError, calcConservationScores, FASTA,
+                          background=ones(19))
+
+
 class TestCalcMutualInfo(TestCase):
 
     def testSixSequences(self):
@@ -279,6 +335,156 @@ class TestCalcMutualInfo(TestCase):
         result = buildMutinfoMatrix(msa, norm=True)
         assert_array_almost_equal(expect, result, err_msg='norm failed')
 
+    def testThreads(self):
+
+        expect = buildMutinfoMatrix(FASTA)
+        result = buildMutinfoMatrix(FASTA, n_threads=4)
+        assert_array_equal(expect, result, err_msg='threads failed')
+        expect = buildMutinfoMatrix(FASTA, norm=True)
+        result = buildMutinfoMatrix(FASTA, norm=True, n_threads=0)
+        assert_array_equal(expect, result, err_msg='threads norm failed')
+
+    def testCodes(self):
+
+        expect = buildMutinfoMatrix(FASTA._getArray())
+        result = buildMutinfoMatrix(FASTA)
+        assert_array_equal(expect, result, err_msg='codes failed')
+        result = buildMutinfoMatrix(FASTA, turbo=False)
+        assert_array_almost_equal(expect, result,
+                                  err_msg='w/out turbo failed')
+
+    def testBadCodes(self):
+
+        from prody.sequence.msatools import msamutinfo
+        msa = FASTA._getArray()
+        mutinfo = zeros((FASTA_LENGTH, FASTA_LENGTH))
+        codes = FASTA._getCodes()
+        self.assertRaises(TypeError, msamutinfo, msa, mutinfo, codes=5)
+        self.assertRaises(TypeError, msamutinfo, msa, mutinfo,
+                          codes=codes.astype(int))
+        self.assertRaises(TypeError, msamutinfo, msa, mutinfo,
+                          codes=codes[:, ::2])
+        self.assertRaises(ValueError, msamutinfo, msa, mutinfo,
+                          codes=codes.T.copy())
+
+    def testBlocked(self):
+
+        expect = buildMutinfoMatrix(FASTA)
+        result = buildMutinfoMatrix(FASTA, strategy='blocked')
+        assert_array_equal(expect, result, err_msg='blocked failed')
+        expect = buildMutinfoMatrix(FASTA, norm=True)
+        result = buildMutinfoMatrix(FASTA, norm=True, strategy='blocked',
+                                    n_threads=0)
+        assert_array_equal(expect, result, err_msg='blocked norm failed')
+
+    def testWeights(self):
+
+        expect = buildMutinfoMatrix(FASTA)
+        result = buildMutinfoMatrix(FASTA_TWICE,
+                                    weights=ones(2 * FASTA_NUMBER) / 2)
+        assert_array_almost_equal(expect, result, err_msg='weights failed')
+        expect = buildMutinfoMatrix(FASTA, weights=calcMeff(FASTA,
+                                                            weight=True)[1])
+        result = buildMutinfoMatrix(FASTA, weights=True, n_threads=2)
+        assert_array_almost_equal(expect, result, err_msg='cached failed')
+
+
+class TestCoevolution(TestCase):
+
+    def testScores(self):
+
+        result = buildCoevolutionMatrices(FASTA, scores=('mutinfo', 'normmi',
+                                          'omes', 'jointent', 'entropy'))
+        expect = buildMutinfoMatrix(FASTA)
+        assert_array_equal(expect, result['mutinfo'], err_msg='MI failed')
+        expect = buildMutinfoMatrix(FASTA, norm=True)
+        assert_array_equal(expect, result['normmi'],
+                           err_msg='normalized MI failed')
+        expect = buildOMESMatrix(FASTA)
+        assert_array_equal(expect, result['omes'], err_msg='OMES failed')
+        expect = calcShannonEntropy(FASTA)
+        assert_array_almost_equal(expect, result['entropy'],
+                                  err_msg='entropy failed')
+        which = result['jointent'] > 0
+        expect = result['mutinfo'][which]
+        assert_array_almost_equal(expect, (result['normmi'] *
+                                           result['jointent'])[which],
+                                  err_msg='joint entropy failed')
+
+    def testOptions(self):
+
+        expect = calcShannonEntropy(FASTA, ambiguity=False, omitgaps=False)
+        result = buildCoevolutionMatrices(FASTA, scores='entropy',
+                                          ambiguity=False, omitgaps=False)
+        self.assertEqual(list(result), ['entropy'])
+        assert_array_almost_equal(expect, result['entropy'],
+                                  err_msg='entropy failed')
+        weights = ones(2 * FASTA_NUMBER) / 2
+        expect = buildOMESMatrix(FASTA)
+        result = buildCoevolutionMatrices(FASTA_TWICE, scores=['omes'],
+                                          weights=weights, n_threads=3)
+        assert_array_almost_equal(expect, result['omes'],
+                                  err_msg='weights failed')
+        result = buildCoevolutionMatrices(FASTA._msa, scores=['omes'],
+                                          strategy='blocked')
+        assert_array_equal(expect, result['omes'], err_msg='blocked failed')
+        self.assertRaises(ValueError, buildCoevolutionMatrices, FASTA,
+                          scores=['sca'])
+
+    def testTop(self):
+
+        dense = buildCoevolutionMatrices(FASTA, scores=('mutinfo', 'omes'))
+        result = buildCoevolutionMatrices(FASTA, scores=('mutinfo', 'omes'),
+                                          top=50, separation=3, n_threads=3)
+        for score in ('mutinfo', 'omes'):
+            rows, cols, values = result[score]
+            matrix = dense[score]
+            expect = sort(matrix[tril_indices(len(matrix), -3)])[::-1][:50]
+            assert_array_almost_equal(expect, values,
+                                      err_msg=score + ' top failed')
+            assert_array_equal(matrix[rows, cols], values)
+            self.assertTrue((rows - cols >= 3).all())
+        rows, cols, values = buildMutinfoMatrix(FASTA, norm=True, top=10,
+                                                strategy='blocked')
+        matrix = buildMutinfoMatrix(FASTA, norm=True)
+        assert_array_equal(matrix[rows, cols], values)
+        rows, cols, values = buildOMESMatrix(FASTA, top=FASTA_LENGTH ** 2)
+        self.assertEqual(len(values), FASTA_LENGTH * (FASTA_LENGTH - 1) // 2)
+        self.assertRaises(ValueError, buildOMESMatrix, FASTA, top=0)
+
+
+class TestAccumulator(TestCase):
+
+    def testIncremental(self):
+
+        acc = CoevolutionAccumulator(FASTA_LENGTH)
+        acc.addSequences(FASTA[:10])
+        acc.addSequences(FASTA._msa[10:], n_threads=3)
+        self.assertEqual(acc.numSequences(), FASTA_NUMBER)
+        assert_array_equal(buildMutinfoMatrix(FASTA), acc.getMutinfo(),
+                           err_msg='MI failed')
+        assert_array_equal(buildMutinfoMatrix(FASTA, norm=True),
+                           acc.getMutinfo(norm=True),
+                           err_msg='normalized MI failed')
+        assert_array_equal(buildOMESMatrix(FASTA, ambiguity=False),
+                           acc.getOMES(ambiguity=False),
+                           err_msg='OMES failed')
+        acc.removeSequences(FASTA[:5])
+        assert_array_equal(buildMutinfoMatrix(FASTA[5:]), acc.getMutinfo(),
+                           err_msg='removal failed')
+        self.assertRaises(ValueError, acc.addSequences, FASTA[:, :10])
+
+    def testSaveLoad(self):
+
+        acc = CoevolutionAccumulator(FASTA_LENGTH)
+        acc.addSequences(FASTA)
+        filename = saveAccumulator(acc, os.path.join(TEMPDIR, 'test'))
+        loaded = loadAccumulator(filename)
+        os.remove(filename)
+        self.assertEqual(loaded.numSequences(), FASTA_NUMBER)
+        loaded.addSequences(FASTA)
+        assert_array_equal(buildOMESMatrix(FASTA_TWICE), loaded.getOMES())
+
 
 class TestCalcMSAOccupancy(TestCase):
 
@@ -314,6 +520,30 @@ class TestIdentity(TestCase):
         assert_array_almost_equal(FASTA_EYE,
                                   buildSeqidMatrix(FASTA, turbo=False))
 
+    def testIdentityMatrixArray(self):
+
+        assert_array_almost_equal(FASTA_EYE,
+                                  buildSeqidMatrix(FASTA._getArray()))
+
+    def testOutput(self):
+
+        expect = buildSeqidMatrix(FASTA)
+        assert_array_equal(expect, buildSeqidMatrix(FASTA, n_threads=3))
+        result = buildSeqidMatrix(FASTA, dtype='float32', packed=True)
+        assert_array_equal(expect[triu_indices(FASTA_NUMBER)]
+                           .astype('float32'), result)
+        result = buildSeqidMatrix(FASTA, dtype='uint16')
+        assert_array_equal((expect * 65535 + .5).astype('uint16'), result)
+        filename = os.path.join(TEMPDIR, 'seqid.dat')
+        out = memmap(filename, 'uint16', 'w+', shape=result.shape)
+        self.assertIs(buildSeqidMatrix(FASTA, dtype='uint16', out=out), out)
+        assert_array_equal(result, out)
+        del out
+        os.remove(filename)
+        self.assertRaises(ValueError, buildSeqidMatrix, FASTA, dtype='int8')
+        self.assertRaises(ValueError, buildSeqidMatrix, FASTA,
+                          out=zeros((2, 2)))
+
 
 class TestUnique(TestCase):
 
@@ -343,6 +573,62 @@ class TestUnique(TestCase):
 
         assert_array_equal(unique, uniqueSequences(FASTA, seqid))
 
+    def testThreads(self):
+
+        random = RandomState(0)
+        letters = array(list('ACDEFGHIKLMNPQRSTVWY--.x'), dtype='|S1')
+        msa = letters[random.randint(0, 24, (20, 150))][random.randint(0, 20,
+                                                                      200)]
+        which = random.rand(*msa.shape) < 0.2
+        msa[which] = letters[random.randint(0, 24, which.sum())]
+        msa[3] = b'-'
+        eye = buildSeqidMatrix(msa)
+        for seqid in (0.3, 0.7, 0.9, 1.0):
+            unique = ones(len(msa), bool)
+            for i in range(len(msa)):
+                if unique[i]:
+                    unique[i + 1:] &= eye[i, i + 1:] < seqid
+            assert_array_equal(unique, uniqueSequences(msa, seqid))
+            assert_array_equal(unique, uniqueSequences(msa, seqid,
+                                                       n_threads=3))
+
+
+class TestSequenceIndex(TestCase):
+
+    def testQueries(self):
+
+        random = RandomState(1)
+        letters = array(list('ACDEFGHIKLMNPQRSTVWY--.x'), dtype='|S1')
+        msa = letters[random.randint(0, 24, (10, 90))][random.randint(0, 10,
+                                                                     120)]
+        which = random.rand(*msa.shape) < 0.3
+        msa[which] = letters[random.randint(0, 24, which.sum())]
+        msa[:, random.rand(90) < 0.3] = b'-'
+        msa[5] = b'-'
+        eye = buildSeqidMatrix(msa)
+        index = SequenceIndex(msa[20:])
+        queries = msa[:20]
+        for seqid in (0.0, 0.4, 0.8, 1.0):
+            results = index.findSimilar(queries, seqid, n_threads=3)
+            for q, (which, values) in enumerate(results):
+                expect = eye[q, 20:]
+                hits = (expect >= seqid).nonzero()[0]
+                hits = hits[lexsort((hits, -expect[hits]))]
+                assert_array_equal(hits, which)
+                assert_array_equal(expect[hits], values)
+        for n in (1, 7, 100):
+            which, values = index.findNearest(queries, n, n_threads=3)
+            for q in range(20):
+                expect = eye[q, 20:]
+                hits = lexsort((range(100), -expect))[:n]
+                assert_array_equal(hits, which[q])
+                assert_array_equal(expect[hits], values[q])
+        query = ''.join(ch.decode() for ch in msa[0])
+        which, values = index.findNearest(query, 3)
+        assert_array_equal(index.findNearest(queries[:1], 3)[0][0], which)
+        which, values = index.findSimilar(query, 0.4)
+        assert_array_equal(index.findSimilar(queries[:1], 0.4)[0][0], which)
+
 
 class TestCalcOMES(TestCase):
 
@@ -504,6 +790,21 @@ class TestCalcOMES(TestCase):
         result = buildOMESMatrix(msa, turbo=False)
         assert_array_almost_equal(expect, result, err_msg='w/out turbo failed')
 
+    def testBlocked(self):
+
+        expect = buildOMESMatrix(FASTA)
+        result = buildOMESMatrix(FASTA, strategy='blocked')
+        assert_array_equal(expect, result, err_msg='blocked failed')
+        self.assertRaises(ValueError, buildOMESMatrix, FASTA,
+                          strategy='tiled')
+
+    def testWeights(self):
+
+        expect = buildOMESMatrix(FASTA)
+        result = buildOMESMatrix(FASTA_TWICE,
+                                 weights=ones(2 * FASTA_NUMBER) / 2)
+        assert_array_almost_equal(expect, result, err_msg='weights failed')
+
 
 class TestCalcSCA(TestCase):
 
@@ -537,6 +838,44 @@ class TestCalcSCA(TestCase):
         result = buildSCAMatrix(fasta, turbo=False)
         assert_array_almost_equal(expect, result, err_msg='w/out turbo failed')
 
+    def testWeights(self):
+
+        expect = buildSCAMatrix(FASTA)
+        weights = ones(2 * FASTA_NUMBER) / 2
+        result = buildSCAMatrix(FASTA_TWICE, weights=weights)
+        assert_array_almost_equal(expect, result, err_msg='weights failed')
+        result = buildSCAMatrix(FASTA_TWICE, weights=weights, turbo=False)
+        assert_array_almost_equal(expect, result, err_msg='w/out turbo failed')
+
+    def testBlocked(self):
+
+        sca = fromfile(pathDatafile('msa_Cys_knot_sca.dat'))
+        expect = sca.reshape((10, 10))
+        fasta = FASTA[:, :10]
+        result = buildSCAMatrix(fasta, strategy='blocked')
+        assert_array_almost_equal(expect, result, err_msg='blocked failed')
+        result = buildSCAMatrix(fasta._msa, strategy='blocked', chunk=35)
+        assert_array_almost_equal(expect, result, err_msg='chunks failed')
+        expect = buildSCAMatrix(FASTA)
+        weights = ones(2 * FASTA_NUMBER) / 2
+        result = buildSCAMatrix(FASTA_TWICE, weights=weights,
+                                strategy='blocked', chunk=1000)
+        assert_array_almost_equal(expect, result, err_msg='weights failed')
+
+    def testBlockedDeep(self):
+
+        # blocked products are single precision, compare relative error
+        # with double precision pairwise calculation on a deep alignment
+        random = RandomState(0)
+        codes = random.randint(0, 21, (100000, 12))
+        codes[:, 1] = codes[:, 0]
+        codes[random.rand(100000) < .8, 2] = 3
+        msa = array(list('-ACDEFGHIKLMNPQRSTVWY'), dtype='|S1')[codes]
+        expect = buildSCAMatrix(msa)
+        result = buildSCAMatrix(msa, strategy='blocked')
+        error = abs(result - expect).max() / abs(expect).max()
+        self.assertLess(error, 1e-6)
+
 
 class TestCalcMeff(TestCase):
 
@@ -716,6 +1055,24 @@ class TestCalcMeff(TestCase):
         assert_array_almost_equal(expect[1], result[1],
                                   err_msg='weight failed')
 
+    def testThreads(self):
+
+        for seqid in (0.4, 0.8, 0.9):
+            expect = calcMeff(FASTA, seqid=seqid, weight=True)
+            result = calcMeff(FASTA, seqid=seqid, weight=True, n_threads=3)
+            self.assertEqual(expect[0], result[0])
+            assert_array_equal(expect[1], result[1], err_msg='threads failed')
+
+    def testLSH(self):
+
+        for seqid in (0.4, 0.8, 0.9):
+            expect = calcMeff(FASTA, seqid=seqid, refine=True, weight=True)
+            result = calcMeff(FASTA, seqid=seqid, refine=True, weight=True,
+                              method='lsh')
+            self.assertTrue((result[1] >= expect[1]).all())
+            assert_array_almost_equal(expect[0], result[0], decimal=0)
+        self.assertRaises(ValueError, calcMeff, FASTA, method='cluster')
+
 
 class TestDirectInfo(TestCase):
 
@@ -1188,6 +1545,8 @@ class TestDirectInfo(TestCase):
             expect, result, err_msg='w/out refine failed')
         result = buildDirectInfoMatrix(fasta, refine=True)
         assert_array_almost_equal(expect, result, err_msg='refine failed')
+        result = buildDirectInfoMatrix(fasta, method='lsh')
+        assert_array_almost_equal(expect, result, err_msg='lsh failed')
 
     def testMATLAB10(self):
 
@@ -1196,3 +1555,66 @@ class TestDirectInfo(TestCase):
         fasta = FASTA[:, :10]
         result = buildDirectInfoMatrix(fasta, refine=True)
         assert_array_almost_equal(expect, result, err_msg='refine failed')
+
+    def testPrecision(self):
+
+        fasta = FASTA[:, :40]
+        expect = buildDirectInfoMatrix(fasta)
+        result = buildDirectInfoMatrix(fasta, n_threads=3)
+        assert_array_almost_equal(expect, result, err_msg='threads failed')
+        result = buildDirectInfoMatrix(fasta, precision='single')
+        assert_array_almost_equal(expect, result, decimal=4,
+                                  err_msg='single precision failed')
+        self.assertRaises(ValueError, buildDirectInfoMatrix, fasta,
+                          precision='half')
+
+    def testIterations(self):
+
+        fasta = FASTA[:, :40]
+        expect = buildDirectInfoMatrix(fasta, n_threads=2)
+        result, hist = buildDirectInfoMatrix(fasta, iterations=True)
+        assert_array_almost_equal(expect, result, err_msg='iterations failed')
+        length = len(result)
+        self.assertEqual(hist.sum(), length * (length - 1) // 2)
+        self.assertEqual(hist[0], 0)
+        result, fine = buildDirectInfoMatrix(fasta, iterations=True,
+                                             epsilon=1e-8)
+        self.assertTrue((fine * range(len(fine))).sum() >
+                        (hist * range(len(hist))).sum())
+        assert_array_almost_equal(expect, result, decimal=3,
+                                  err_msg='epsilon failed')
+
+    def testTop(self):
+
+        fasta = FASTA[:, :40]
+        matrix = buildDirectInfoMatrix(fasta)
+        rows, cols, values = buildDirectInfoMatrix(fasta, top=20,
+                                                   separation=4, n_threads=3)
+        expect = sort(matrix[tril_indices(len(matrix), -4)])[::-1][:20]
+        assert_array_almost_equal(expect, values, err_msg='top failed')
+        assert_array_almost_equal(matrix[rows, cols], values)
+        self.assertTrue((rows - cols >= 4).all())
+
+
+class TestPLMDCA(TestCase):
+
+    def testCoupled(self):
+
+        codes = RandomState(0).randint(0, 20, (300, 8))
+        msa = array(list('ACDEFGHIKLMNPQRSTVWY'), dtype='|S1')[codes]
+        msa[:, 5] = msa[:, 2]
+        result = buildPLMDCAMatrix(msa)
+        self.assertEqual(result.shape, (8, 8))
+        assert_array_equal(result, result.T)
+        assert_array_equal(result.diagonal(), zeros(8))
+        self.assertEqual(result.argmax(), 2 * 8 + 5)
+        expect = result
+        result = buildPLMDCAMatrix(msa, n_threads=3)
+        assert_array_almost_equal(expect, result, err_msg='threads failed')
+
+    def testRefine(self):
+
+        fasta = FASTA[:, :10]
+        expect = buildDirectInfoMatrix(fasta, refine=True).shape
+        result = buildPLMDCAMatrix(fasta, refine=True).shape
+        self.assertEqual(expect, result)
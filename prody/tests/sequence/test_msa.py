@@ -96,6 +96,17 @@ class TestRefinement(TestCase):
 
         assert_array_equal(refined._getArray(), expected)
 
+    def testThreads(self):
+
+        label = 'FSHB_BOVIN'
+        expected = refineMSA(FASTA, label=label, seqid=0.5, rowocc=0.8,
+                             colocc=0.5)
+        refined = refineMSA(FASTA, label=label, seqid=0.5, rowocc=0.8,
+                            colocc=0.5, n_threads=3)
+        assert_array_equal(refined._getArray(), expected._getArray())
+        self.assertEqual(list(refined.iterLabels()),
+                         list(expected.iterLabels()))
+
 
 class TestMerging(TestCase):
 
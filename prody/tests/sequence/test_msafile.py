@@ -8,7 +8,7 @@ try:
 except ImportError:
     from io import StringIO
 
-from numpy import array, log, zeros, char
+from numpy import array, log, zeros, char, tile
 from numpy.testing import assert_array_equal, dec
 
 from prody.tests.datafiles import *
@@ -78,6 +78,173 @@ class TestParseMSA(TestCase):
         self.assertDictEqual(FASTA._mapping, SELEX._mapping)
         self.assertDictEqual(FASTA._mapping, STOCK._mapping)
 
+    def testLongLines(self):
+
+        msa = tile(FASTA._getArray(), 20)
+        filename = join(TEMPDIR, 'long.fasta')
+        with open(filename, 'w') as out:
+            for label, seq in zip(FASTA.iterLabels(), msa):
+                out.write('>{0}\r\n{1}\r\n'.format(label,
+                                                     seq.tobytes().decode()))
+        fasta = parseMSA(filename)
+        os.remove(filename)
+        self.assertListEqual(FASTA._labels, fasta._labels)
+        assert_array_equal(msa, fasta._getArray())
+
+    def testThreads(self):
+
+        for msa, name in ((FASTA, 'msa_Cys_knot.fasta'),
+                          (SELEX, 'msa_Cys_knot.slx'),
+                          (STOCK, 'msa_Cys_knot.sth')):
+            result = parseMSA(pathDatafile(name), n_threads=5)
+            assert_array_equal(msa._getArray(), result._getArray())
+            self.assertListEqual(msa._labels, result._labels)
+            self.assertDictEqual(msa._mapping, result._mapping)
+
+    def testLazy(self):
+
+        for msa, name in ((FASTA, 'msa_Cys_knot.fasta'),
+                          (STOCK, 'msa_Cys_knot.sth')):
+            lazy = parseMSA(pathDatafile(name), lazy=True, n_threads=3)
+            assert_array_equal(msa._getArray(), lazy._getArray())
+            self.assertListEqual(msa._labels, list(lazy._labels))
+            self.assertEqual(msa.numIndexed(), lazy.numIndexed())
+            for label in msa.iterLabels():
+                self.assertEqual(msa.getIndex(label), lazy.getIndex(label))
+                self.assertEqual(msa.countLabel(label),
+                                 lazy.countLabel(label))
+            self.assertIsNone(lazy.getIndex('MISSING'))
+            rows = list(range(0, len(msa), 3))
+            self.assertListEqual([msa._labels[i] for i in rows],
+                                 list(lazy._labels.take(rows)))
+
+    def testCompressed(self):
+
+        import gzip, bz2, lzma
+        for msa, name in ((FASTA, 'msa_Cys_knot.fasta'),
+                          (STOCK, 'msa_Cys_knot.sth')):
+            with open(pathDatafile(name), 'rb') as inp:
+                data = inp.read()
+            for module, ext in ((gzip, '.gz'), (bz2, '.bz2'), (lzma, '.xz')):
+                filename = join(TEMPDIR, name + ext)
+                with module.open(filename, 'wb') as out:
+                    out.write(data)
+                result = parseMSA(filename, n_threads=2)
+                os.remove(filename)
+                assert_array_equal(msa._getArray(), result._getArray())
+                self.assertListEqual(msa._labels, result._labels)
+                self.assertEqual(msa.getTitle(), result.getTitle())
+
+    def testStream(self):
+
+        from prody.sequence.msaio import parseFasta, parseSelex
+
+        def reader(data, size):
+            blocks = [data[i:i + size] for i in range(0, len(data), size)]
+            blocks.append(data[:0])
+            blocks.reverse()
+            return blocks.pop
+
+        for parser, name in ((parseFasta, 'msa_Cys_knot.fasta'),
+                             (parseSelex, 'msa_Cys_knot.sth'),
+                             (parseSelex, 'msa_Cys_knot.slx')):
+            filename = pathDatafile(name)
+            with open(filename, 'rb') as inp:
+                data = inp.read()
+            expect = parser(filename)
+            for size in (1, 7, 1000, len(data)):
+                result = parser(filename, n_threads=2,
+                                read=reader(data, size))
+                assert_array_equal(expect[0], result[0])
+                self.assertListEqual(expect[1], result[1])
+            result = parser(filename, read=reader(data, 50),
+                            filter=lambda key, seq: 'BOVIN' in key,
+                            slice=slice(3, 30))
+            rows = [i for i, label in enumerate(expect[1])
+                    if 'BOVIN' in label.split('/')[0]]
+            assert_array_equal(expect[0][rows, 3:30], result[0])
+
+        data = b'>a\nACDE\nFG\n>b\nACDEF\n>c\nACDEFG\n'
+        for size in (1, 5, len(data)):
+            try:
+                parseFasta('misaligned.fasta', read=reader(data, size))
+            except IOError as err:
+                self.assertTrue(str(err).endswith('line 6'))
+            else:
+                self.fail('misaligned FASTA data was parsed')
+
+    def testA3M(self):
+
+        msa = char.upper(FASTA._getArray())
+        msa[msa == b'.'] = b'-'
+        filename = join(TEMPDIR, 'inserts.a3m')
+        with open(filename, 'w') as out:
+            for i, label in enumerate(FASTA.iterLabels(True)):
+                seq = msa[i].tobytes().decode()
+                out.write('>{0}\n{1}ac.{2}\n{3}\n'.format(
+                    label, seq[:10], seq[10:50], 'y' * i + seq[50:]))
+        a3m = parseMSA(filename, n_threads=3)
+        os.remove(filename)
+        assert_array_equal(msa, a3m._getArray())
+        self.assertListEqual(FASTA._labels, a3m._labels)
+
+    def testBlocks(self):
+
+        msa = STOCK._getArray()
+        labels = STOCK._labels
+        filename = join(TEMPDIR, 'blocks.sth')
+        with open(filename, 'w') as out:
+            out.write('# STOCKHOLM 1.0\n#=GF ID Cys_knot\n\n')
+            for label in labels:
+                out.write('#=GS {0} AC P00001\n'.format(label))
+            for beg, end in ((0, 40), (40, 75), (75, msa.shape[1])):
+                out.write('\n')
+                for label, seq in zip(labels, msa[:, beg:end]):
+                    out.write('{0}{1}{2}\n'.format(
+                        label, ' ' * (beg // 10 + 1), seq.tobytes().decode()))
+                    out.write('#=GR {0} SS {1}\n'.format(label,
+                                                         '-' * (end - beg)))
+                out.write('#=GC RF {0}\n'.format('x' * (end - beg)))
+            out.write('//\n')
+        for n_threads in (1, 4):
+            result = parseMSA(filename, n_threads=n_threads)
+            assert_array_equal(msa, result._getArray())
+            self.assertListEqual(labels, result._labels)
+        os.remove(filename)
+
+    def testFilterSlice(self):
+
+        msa = FASTA._getArray()
+        keys = list(FASTA.iterLabels())
+        rows = [i for i, key in enumerate(keys) if 'BOVIN' in key]
+        for name in ('msa_Cys_knot.fasta', 'msa_Cys_knot.sth'):
+            result = parseMSA(pathDatafile(name), n_threads=2,
+                              filter=lambda key, seq: 'BOVIN' in key,
+                              slice=slice(5, 60, 2))
+            assert_array_equal(msa[rows, 5:60:2], result._getArray())
+            self.assertListEqual([FASTA._labels[i] for i in rows],
+                                 result._labels)
+            cols = [3, 0, -1, 3]
+            result = parseMSA(pathDatafile(name), slice=cols,
+                              filter=lambda label, seq: seq.count('-') < 30,
+                              filter_full=True, lazy=True)
+            which = (msa == b'-').sum(1) < 30
+            assert_array_equal(msa[which][:, cols], result._getArray())
+
+    def testMisaligned(self):
+
+        filename = join(TEMPDIR, 'misaligned.fasta')
+        with open(filename, 'w') as out:
+            out.write('>a\nACDE\nFG\n>b\nACDEF\n>c\nACDEFG\n')
+        for n_threads in (1, 3):
+            try:
+                parseMSA(filename, n_threads=n_threads)
+            except IOError as err:
+                self.assertTrue(str(err).endswith('line 6'))
+            else:
+                self.fail('misaligned FASTA file was parsed')
+        os.remove(filename)
+
 class TestWriteMSA(TestCase):
 
     def testSelex(self):
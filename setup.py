@@ -78,6 +78,53 @@ PACKAGE_DATA = {
 PACKAGE_DIR = {}
 for pkg in PACKAGES:
     PACKAGE_DIR[pkg] = join(*pkg.split('.'))
+# OpenMP is used for multithreaded sequence analysis, it is optional and
+# calculations run in a single thread when extensions are built without it
+
+def checkOpenMP(compile_args, link_args):
+    """Return extension arguments for OpenMP when a small OpenMP program
+    compiles and links with *compile_args* and *link_args*, or an empty
+    dictionary."""
+
+    import shutil
+    import tempfile
+    from distutils.ccompiler import new_compiler
+    from distutils.sysconfig import customize_compiler
+
+    tmpdir = tempfile.mkdtemp()
+    source = join(tmpdir, 'openmp.c')
+    with open(source, 'w') as out:
+        out.write('#include <omp.h>\n'
+                  'int main(void) {\n'
+                  '    int n = 0;\n'
+                  '    #pragma omp parallel\n'
+                  '    {\n'
+                  '        #pragma omp critical\n'
+                  '        n += omp_get_num_threads();\n'
+                  '    }\n'
+                  '    return n < 1;\n'
+                  '}\n')
+    compiler = new_compiler()
+    customize_compiler(compiler)
+    try:
+        objects = compiler.compile([source], output_dir=tmpdir,
+                                   extra_postargs=compile_args)
+        compiler.link_executable(objects, join(tmpdir, 'openmp'),
+                                 extra_postargs=link_args)
+    except Exception:
+        sys.stderr.write('OpenMP is not supported by the compiler, '
+                         'extensions will run in a single thread.\n')
+        return {}
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+    return {'extra_compile_args': compile_args,
+            'extra_link_args': link_args}
+
+if platform.system() == 'Windows':
+    OPENMP = checkOpenMP(['/openmp'], [])
+else:
+    OPENMP = checkOpenMP(['-fopenmp'], ['-fopenmp'])
+
 from glob import glob
 EXTENSIONS = [
     Extension('prody.dynamics.rtbtools',
@@ -85,13 +132,19 @@ EXTENSIONS = [
               include_dirs=[numpy.get_include()]),
     Extension('prody.sequence.msatools',
               [join('prody', 'sequence', 'msatools.c'),],
-              include_dirs=[numpy.get_include()]),
+              depends=[join('prody', 'sequence', 'msacodes.h'),
+                       join('prody', 'sequence', 'msadirect.h'),
+                       join('prody', 'sequence', 'msaplm.h'),
+                       join('prody', 'sequence', 'msaunique.h')],
+              include_dirs=[numpy.get_include()], **OPENMP),
     Extension('prody.sequence.msaio',
               [join('prody', 'sequence', 'msaio.c'),],
-              include_dirs=[numpy.get_include()]),
+              include_dirs=[numpy.get_include()], **OPENMP),
     Extension('prody.sequence.seqtools',
               [join('prody', 'sequence', 'seqtools.c'),],
-              include_dirs=[numpy.get_include()]),
+              depends=[join('prody', 'sequence', 'msacodes.h'),
+                       join('prody', 'sequence', 'msaunique.h')],
+              include_dirs=[numpy.get_include()], **OPENMP),
 ]
 
 CONTRIBUTED = [